@@ -0,0 +1,428 @@
+// Generated by chip8-aot from ./rocket.ch8. Do not edit.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "chip8.h"
+
+#define AOT_MAX_BLOCK_OPS 64
+
+static const uint8_t rom[130] = {
+  0x61, 0x00, 0x62, 0x00, 0x63, 0x38, 0x64, 0x1B, 0x65, 0x00, 0x66, 0x08,
+  0xA2, 0x7E, 0xD5, 0x63, 0x22, 0x6A, 0x42, 0x09, 0x12, 0x14, 0x72, 0x01,
+  0x68, 0x1A, 0x6A, 0x00, 0xC7, 0x1F, 0x77, 0x0F, 0x69, 0x00, 0xA2, 0x78,
+  0xD7, 0x86, 0xA2, 0x7E, 0xD5, 0x63, 0xC0, 0x03, 0x85, 0x04, 0xD5, 0x63,
+  0x3F, 0x00, 0x12, 0x62, 0x60, 0x0F, 0xE0, 0xA1, 0x69, 0x01, 0x39, 0x01,
+  0x12, 0x26, 0xF0, 0x07, 0x30, 0x00, 0x12, 0x26, 0xA2, 0x78, 0xD7, 0x86,
+  0x78, 0xFF, 0xD7, 0x86, 0x3F, 0x00, 0x12, 0x62, 0x60, 0x03, 0xF0, 0x15,
+  0x38, 0x00, 0x12, 0x26, 0x22, 0x6A, 0xA2, 0x78, 0xD7, 0x86, 0x81, 0xA4,
+  0x12, 0x10, 0x6A, 0x01, 0x60, 0x03, 0xF0, 0x18, 0x12, 0x58, 0xA2, 0xA0,
+  0xF1, 0x33, 0xA2, 0xA2, 0xF0, 0x65, 0xF0, 0x29, 0xD3, 0x45, 0x00, 0xEE,
+  0x20, 0x70, 0x70, 0xF8, 0xD8, 0x88, 0x7C, 0xD6, 0x7C, 0x00,
+};
+
+typedef uint16_t (*block_fn)(chip8_t* ch8);
+
+typedef struct block {
+  block_fn fn;
+  uint16_t len;    // bytes of ROM the block was compiled from
+  uint16_t count;  // instructions it executes
+} block_t;
+
+static uint16_t block_0200(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0200: 6100
+  ch8->reg_v[0x1] = 0x00;
+  // 0202: 6200
+  ch8->reg_v[0x2] = 0x00;
+  // 0204: 6338
+  ch8->reg_v[0x3] = 0x38;
+  // 0206: 641B
+  ch8->reg_v[0x4] = 0x1B;
+  // 0208: 6500
+  ch8->reg_v[0x5] = 0x00;
+  // 020A: 6608
+  ch8->reg_v[0x6] = 0x08;
+  // 020C: A27E
+  ch8->reg_i = 0x027E;
+  return 0x020E;
+}
+
+static uint16_t block_0212(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0212: 4209
+  return ch8->reg_v[0x2] != 0x09 ? 0x0216 : 0x0214;
+}
+
+static uint16_t block_0216(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0216: 7201
+  ch8->reg_v[0x2] += 0x01;
+  // 0218: 681A
+  ch8->reg_v[0x8] = 0x1A;
+  // 021A: 6A00
+  ch8->reg_v[0xA] = 0x00;
+  return 0x021C;
+}
+
+static uint16_t block_021E(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 021E: 770F
+  ch8->reg_v[0x7] += 0x0F;
+  // 0220: 6900
+  ch8->reg_v[0x9] = 0x00;
+  // 0222: A278
+  ch8->reg_i = 0x0278;
+  return 0x0224;
+}
+
+static uint16_t block_0226(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0226: A27E
+  ch8->reg_i = 0x027E;
+  return 0x0228;
+}
+
+static uint16_t block_022C(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 022C: 8504
+  val = ch8->reg_v[0x5] + ch8->reg_v[0x0];
+  ch8->reg_v[0xF] = val > 0xFF;
+  ch8->reg_v[0x5] = val & 0xFF;
+  return 0x022E;
+}
+
+static uint16_t block_0230(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0230: 3F00
+  return ch8->reg_v[0xF] == 0x00 ? 0x0234 : 0x0232;
+}
+
+static uint16_t block_0232(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0232: 1262
+  return 0x0262;
+}
+
+static uint16_t block_0234(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0234: 600F
+  ch8->reg_v[0x0] = 0x0F;
+  return 0x0236;
+}
+
+static uint16_t block_0238(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0238: 6901
+  ch8->reg_v[0x9] = 0x01;
+  // 023A: 3901
+  return ch8->reg_v[0x9] == 0x01 ? 0x023E : 0x023C;
+}
+
+static uint16_t block_023A(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 023A: 3901
+  return ch8->reg_v[0x9] == 0x01 ? 0x023E : 0x023C;
+}
+
+static uint16_t block_023C(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 023C: 1226
+  return 0x0226;
+}
+
+static uint16_t block_0240(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0240: 3000
+  return ch8->reg_v[0x0] == 0x00 ? 0x0244 : 0x0242;
+}
+
+static uint16_t block_0242(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0242: 1226
+  return 0x0226;
+}
+
+static uint16_t block_0244(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0244: A278
+  ch8->reg_i = 0x0278;
+  return 0x0246;
+}
+
+static uint16_t block_0248(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0248: 78FF
+  ch8->reg_v[0x8] += 0xFF;
+  return 0x024A;
+}
+
+static uint16_t block_024C(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 024C: 3F00
+  return ch8->reg_v[0xF] == 0x00 ? 0x0250 : 0x024E;
+}
+
+static uint16_t block_024E(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 024E: 1262
+  return 0x0262;
+}
+
+static uint16_t block_0250(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0250: 6003
+  ch8->reg_v[0x0] = 0x03;
+  return 0x0252;
+}
+
+static uint16_t block_0254(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0254: 3800
+  return ch8->reg_v[0x8] == 0x00 ? 0x0258 : 0x0256;
+}
+
+static uint16_t block_0256(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0256: 1226
+  return 0x0226;
+}
+
+static uint16_t block_025A(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 025A: A278
+  ch8->reg_i = 0x0278;
+  return 0x025C;
+}
+
+static uint16_t block_025E(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 025E: 81A4
+  val = ch8->reg_v[0x1] + ch8->reg_v[0xA];
+  ch8->reg_v[0xF] = val > 0xFF;
+  ch8->reg_v[0x1] = val & 0xFF;
+  // 0260: 1210
+  return 0x0210;
+}
+
+static uint16_t block_0262(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0262: 6A01
+  ch8->reg_v[0xA] = 0x01;
+  // 0264: 6003
+  ch8->reg_v[0x0] = 0x03;
+  return 0x0266;
+}
+
+static uint16_t block_0268(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 0268: 1258
+  return 0x0258;
+}
+
+static uint16_t block_026A(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 026A: A2A0
+  ch8->reg_i = 0x02A0;
+  return 0x026C;
+}
+
+static uint16_t block_026E(chip8_t* ch8) {
+  uint16_t val;
+  (void)ch8;
+  (void)val;
+  // 026E: A2A2
+  ch8->reg_i = 0x02A2;
+  return 0x0270;
+}
+
+static const block_t blocks[CHIP8_MEMORY_SIZE] = {
+  [0x0200] = {block_0200, 14, 7},
+  [0x0212] = {block_0212, 2, 1},
+  [0x0216] = {block_0216, 6, 3},
+  [0x021E] = {block_021E, 6, 3},
+  [0x0226] = {block_0226, 2, 1},
+  [0x022C] = {block_022C, 2, 1},
+  [0x0230] = {block_0230, 2, 1},
+  [0x0232] = {block_0232, 2, 1},
+  [0x0234] = {block_0234, 2, 1},
+  [0x0238] = {block_0238, 4, 2},
+  [0x023A] = {block_023A, 2, 1},
+  [0x023C] = {block_023C, 2, 1},
+  [0x0240] = {block_0240, 2, 1},
+  [0x0242] = {block_0242, 2, 1},
+  [0x0244] = {block_0244, 2, 1},
+  [0x0248] = {block_0248, 2, 1},
+  [0x024C] = {block_024C, 2, 1},
+  [0x024E] = {block_024E, 2, 1},
+  [0x0250] = {block_0250, 2, 1},
+  [0x0254] = {block_0254, 2, 1},
+  [0x0256] = {block_0256, 2, 1},
+  [0x025A] = {block_025A, 2, 1},
+  [0x025E] = {block_025E, 4, 2},
+  [0x0262] = {block_0262, 4, 2},
+  [0x0268] = {block_0268, 2, 1},
+  [0x026A] = {block_026A, 2, 1},
+  [0x026E] = {block_026E, 2, 1},
+};
+
+typedef struct aot {
+  bool enabled[CHIP8_MEMORY_SIZE];
+} aot_t;
+
+static void aot_init(aot_t* aot, chip8_t* ch8) {
+  memcpy(&ch8->mem[CHIP8_PROGRAM_START_ADDRESS], rom, sizeof(rom));
+  for (int i = 0; i < CHIP8_MEMORY_SIZE; i++)
+    aot->enabled[i] = blocks[i].fn != NULL;
+}
+
+// Re-check every block overlapping a write: it only runs natively while
+// its bytes still match the ROM it was compiled from.
+static void aot_written(aot_t* aot, const chip8_t* ch8, uint16_t addr,
+                        uint16_t len) {
+  int first = addr - 2 * AOT_MAX_BLOCK_OPS;
+  if (first < CHIP8_PROGRAM_START_ADDRESS)
+    first = CHIP8_PROGRAM_START_ADDRESS;
+  for (int i = first; i < addr + len && i < CHIP8_MEMORY_SIZE; i++) {
+    const block_t* block = &blocks[i];
+    if (block->fn == NULL || i + block->len <= addr) continue;
+    aot->enabled[i] =
+        memcmp(&ch8->mem[i], &rom[i - CHIP8_PROGRAM_START_ADDRESS],
+               block->len) == 0;
+  }
+}
+
+// Same contract as chip8_run_cycles. Compiled blocks never raise events.
+static chip8_stop_t aot_run(aot_t* aot, chip8_t* ch8, uint32_t budget,
+                            uint32_t* cycles_run) {
+  uint32_t count = budget;
+  chip8_stop_t stop = CHIP8_STOP_BUDGET;
+
+  while (count > 0 && stop == CHIP8_STOP_BUDGET) {
+    uint16_t ip = ch8->ip;
+
+    if (ip >= CHIP8_MEMORY_SIZE - 1) {
+      stop = chip8_run_instruction(ch8);
+      count--;
+      continue;
+    }
+
+    const block_t* block = &blocks[ip];
+    if (aot->enabled[ip] && block->count <= count) {
+      ch8->ip = block->fn(ch8);
+      chip8_tick(ch8, block->count);
+      count -= block->count;
+      continue;
+    }
+
+    chip8_op_t op;
+    chip8_decode((ch8->mem[ip] << 8) | ch8->mem[ip + 1], &op);
+    uint16_t addr = ch8->reg_i;
+    stop = chip8_run_instruction(ch8);
+    if (op.writes) aot_written(aot, ch8, addr, op.writes);
+    count--;
+  }
+
+  if (cycles_run) *cycles_run = budget - count;
+  return stop;
+}
+
+#ifndef CHIP8_AOT_NO_MAIN
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+int main(int argc, char** argv) {
+  uint32_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+  static aot_t aot;
+  chip8_t ch8;
+  struct timespec start, end;
+
+  chip8_init(&ch8);
+  aot_init(&aot, &ch8);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (uint32_t left = count; left > 0;) {
+    uint32_t ran;
+    chip8_stop_t stop = aot_run(&aot, &ch8, left, &ran);
+    left -= ran;
+    if (stop == CHIP8_STOP_IDLE || stop == CHIP8_STOP_WAIT_KEY)
+      left -= chip8_fast_forward(&ch8, left);
+    if (stop == CHIP8_STOP_ILLEGAL || stop == CHIP8_STOP_STACK_FAULT) {
+      fprintf(stderr, "fault %d at %04X\n", stop, ch8.ip);
+      count -= left;
+      break;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  for (int y = 0; y < CHIP8_FRAMEBUFFER_Y_LEN; y++) {
+    for (int x = 0; x < CHIP8_FRAMEBUFFER_X_LEN; x++) {
+      putchar(chip8_pixel(&ch8, x, y) ? '#' : '.');
+    }
+    putchar('\n');
+  }
+
+  double secs =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("ip: %04X, %u instructions in %.3fs (%.1f M/s)\n", ch8.ip,
+         count, secs, count / secs / 1e6);
+  return 0;
+}
+
+#endif  // CHIP8_AOT_NO_MAIN
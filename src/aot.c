@@ -0,0 +1,447 @@
+// chip8-aot - Ahead-of-time recompiler from a CHIP-8 ROM to C.
+//
+// Walks the control flow of a ROM from the program start, splits the
+// reachable code into basic blocks and writes a C translation unit with one
+// function per block. The output links against chip8.o into a native binary
+// for that ROM. Instructions without a native translation, indirect jumps
+// (BMMM) and blocks whose bytes were rewritten at runtime fall back to the
+// interpreter.
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chip8.h"
+
+#define AOT_MAX_BLOCK_OPS 64
+
+typedef struct aot {
+  uint8_t mem[CHIP8_MEMORY_SIZE];
+  uint16_t rom_size;
+  bool reachable[CHIP8_MEMORY_SIZE];
+  bool leader[CHIP8_MEMORY_SIZE];
+} aot_t;
+
+static uint16_t fetch(const aot_t* aot, uint16_t addr) {
+  return (aot->mem[addr] << 8) | aot->mem[addr + 1];
+}
+
+static bool in_rom(const aot_t* aot, uint32_t addr) {
+  return addr >= CHIP8_PROGRAM_START_ADDRESS &&
+         addr + 1 < (uint32_t)CHIP8_PROGRAM_START_ADDRESS + aot->rom_size;
+}
+
+// Instructions translated to C. Everything else is left to the interpreter.
+static bool is_native(uint16_t instruction) {
+  switch (instruction >> 12) {
+    case 0x1:
+    case 0x3:
+    case 0x4:
+    case 0x6:
+    case 0x7:
+    case 0xA:
+      return true;
+    case 0x5:
+    case 0x9:
+      return (instruction & 0x000F) == 0;
+    case 0x8:
+      switch (instruction & 0x000F) {
+        case 0x0:
+        case 0x1:
+        case 0x2:
+        case 0x4:
+        case 0x5:
+          return true;
+        default:
+          return false;
+      }
+    case 0xF:
+      return (instruction & 0x00FF) == 0x1E;
+    default:
+      return false;
+  }
+}
+
+// Jumps closing an idle loop raise an event, so they are left to the
+// interpreter. Mirrors chip8_idle_jump on the ROM image.
+static bool is_idle_jump(const aot_t* aot, uint16_t addr) {
+  uint16_t instruction = fetch(aot, addr);
+  uint16_t nnn = instruction & 0x0FFF;
+
+  if ((instruction & 0xF000) != 0x1000) return false;
+  if (nnn == addr) return true;
+  if (nnn + 4 != addr) return false;
+
+  uint16_t first = fetch(aot, nnn);
+  return (first & 0xF0FF) == 0xF007 &&
+         fetch(aot, nnn + 2) == (0x3000 | (first & 0x0F00));
+}
+
+static bool translates(const aot_t* aot, uint16_t addr) {
+  return is_native(fetch(aot, addr)) && !is_idle_jump(aot, addr);
+}
+
+static bool is_skip(uint16_t instruction) {
+  switch (instruction >> 12) {
+    case 0x3:
+    case 0x4:
+    case 0x5:
+    case 0x9:
+    case 0xE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Collect the successors of the instruction at addr. Returns how many.
+static int successors(uint16_t instruction, uint16_t addr, uint16_t* out) {
+  uint16_t nnn = instruction & 0x0FFF;
+
+  if (instruction == 0x00EE) return 0;
+  if ((instruction & 0xF000) == 0xB000) return 0;  // indirect
+  if ((instruction & 0xF000) == 0x1000) {
+    out[0] = nnn;
+    return 1;
+  }
+  if ((instruction & 0xF000) == 0x2000 ||
+      ((instruction & 0xF000) == 0x0000 && instruction != 0x00E0)) {
+    out[0] = nnn;
+    out[1] = addr + 2;
+    return 2;
+  }
+  if (is_skip(instruction)) {
+    out[0] = addr + 2;
+    out[1] = addr + 4;
+    return 2;
+  }
+  out[0] = addr + 2;
+  return 1;
+}
+
+static void analyze(aot_t* aot) {
+  static uint16_t worklist[CHIP8_MEMORY_SIZE * 2];
+  int top = 0;
+
+  worklist[top++] = CHIP8_PROGRAM_START_ADDRESS;
+  aot->leader[CHIP8_PROGRAM_START_ADDRESS] = true;
+
+  while (top > 0) {
+    uint16_t addr = worklist[--top];
+    if (!in_rom(aot, addr) || aot->reachable[addr]) continue;
+    aot->reachable[addr] = true;
+
+    uint16_t instruction = fetch(aot, addr);
+    uint16_t next[2];
+    int count = successors(instruction, addr, next);
+    bool falls_through = count == 1 && next[0] == addr + 2;
+
+    // Successors past the end of memory are never entered natively, the
+    // interpreter faults on them.
+    for (int i = 0; i < count; i++) {
+      if (next[i] >= CHIP8_MEMORY_SIZE) continue;
+      if (!falls_through) aot->leader[next[i]] = true;
+      worklist[top++] = next[i];
+    }
+
+    // Code after a non-native instruction is entered from the interpreter.
+    if (!translates(aot, addr) && addr + 2 < CHIP8_MEMORY_SIZE) {
+      aot->leader[addr + 2] = true;
+    }
+  }
+}
+
+static void emit_op(FILE* out, uint16_t instruction, uint16_t addr) {
+  uint8_t x = (instruction >> 8) & 0x0F;
+  uint8_t y = (instruction >> 4) & 0x0F;
+  uint8_t kk = instruction & 0xFF;
+  uint16_t nnn = instruction & 0x0FFF;
+
+  fprintf(out, "  // %04X: %04X\n", addr, instruction);
+
+  switch (instruction >> 12) {
+    case 0x1:
+      fprintf(out, "  return 0x%04X;\n", nnn);
+      break;
+    case 0x3:
+      fprintf(out, "  return ch8->reg_v[0x%X] == 0x%02X ? 0x%04X : 0x%04X;\n",
+              x, kk, addr + 4, addr + 2);
+      break;
+    case 0x4:
+      fprintf(out, "  return ch8->reg_v[0x%X] != 0x%02X ? 0x%04X : 0x%04X;\n",
+              x, kk, addr + 4, addr + 2);
+      break;
+    case 0x5:
+    case 0x9:
+      fprintf(out,
+              "  return ch8->reg_v[0x%X] %s ch8->reg_v[0x%X] ? 0x%04X : "
+              "0x%04X;\n",
+              x, (instruction >> 12) == 0x5 ? "==" : "!=", y, addr + 4,
+              addr + 2);
+      break;
+    case 0x6:
+      fprintf(out, "  ch8->reg_v[0x%X] = 0x%02X;\n", x, kk);
+      break;
+    case 0x7:
+      fprintf(out, "  ch8->reg_v[0x%X] += 0x%02X;\n", x, kk);
+      break;
+    case 0x8:
+      switch (instruction & 0x000F) {
+        case 0x0:
+          fprintf(out, "  ch8->reg_v[0x%X] = ch8->reg_v[0x%X];\n", x, y);
+          break;
+        case 0x1:
+          fprintf(out, "  ch8->reg_v[0x%X] |= ch8->reg_v[0x%X];\n", x, y);
+          break;
+        case 0x2:
+          fprintf(out, "  ch8->reg_v[0x%X] &= ch8->reg_v[0x%X];\n", x, y);
+          break;
+        case 0x4:
+          fprintf(out,
+                  "  val = ch8->reg_v[0x%X] + ch8->reg_v[0x%X];\n"
+                  "  ch8->reg_v[0xF] = val > 0xFF;\n"
+                  "  ch8->reg_v[0x%X] = val & 0xFF;\n",
+                  x, y, x);
+          break;
+        case 0x5:
+          fprintf(out,
+                  "  ch8->reg_v[0xF] = ch8->reg_v[0x%X] >= ch8->reg_v[0x%X];\n"
+                  "  ch8->reg_v[0x%X] -= ch8->reg_v[0x%X];\n",
+                  x, y, x, y);
+          break;
+      }
+      break;
+    case 0xA:
+      fprintf(out, "  ch8->reg_i = 0x%04X;\n", nnn);
+      break;
+    case 0xF:
+      fprintf(out, "  ch8->reg_i += ch8->reg_v[0x%X];\n", x);
+      break;
+  }
+}
+
+static bool ends_block(uint16_t instruction) {
+  return (instruction >> 12) == 0x1 || is_skip(instruction);
+}
+
+// Emit the block starting at start. Returns the number of instructions.
+static int emit_block(FILE* out, aot_t* aot, uint16_t start) {
+  uint16_t addr = start;
+  int count = 0;
+
+  fprintf(out, "static uint16_t block_%04X(chip8_t* ch8) {\n", start);
+  fprintf(out, "  uint16_t val;\n  (void)ch8;\n  (void)val;\n");
+
+  while (count < AOT_MAX_BLOCK_OPS && in_rom(aot, addr)) {
+    uint16_t instruction = fetch(aot, addr);
+    if (!translates(aot, addr)) break;
+
+    emit_op(out, instruction, addr);
+    count++;
+    addr += 2;
+    if (ends_block(instruction)) {
+      fprintf(out, "}\n\n");
+      return count;
+    }
+  }
+
+  // Blocks cut short by the size limit continue in a block of their own.
+  if (count == AOT_MAX_BLOCK_OPS && in_rom(aot, addr)) {
+    aot->leader[addr] = true;
+    aot->reachable[addr] = true;
+  }
+
+  fprintf(out, "  return 0x%04X;\n}\n\n", addr);
+  return count;
+}
+
+static const char* prelude =
+    "typedef uint16_t (*block_fn)(chip8_t* ch8);\n"
+    "\n"
+    "typedef struct block {\n"
+    "  block_fn fn;\n"
+    "  uint16_t len;    // bytes of ROM the block was compiled from\n"
+    "  uint16_t count;  // instructions it executes\n"
+    "} block_t;\n"
+    "\n";
+
+static const char* runtime =
+    "typedef struct aot {\n"
+    "  bool enabled[CHIP8_MEMORY_SIZE];\n"
+    "} aot_t;\n"
+    "\n"
+    "static void aot_init(aot_t* aot, chip8_t* ch8) {\n"
+    "  memcpy(&ch8->mem[CHIP8_PROGRAM_START_ADDRESS], rom, sizeof(rom));\n"
+    "  for (int i = 0; i < CHIP8_MEMORY_SIZE; i++)\n"
+    "    aot->enabled[i] = blocks[i].fn != NULL;\n"
+    "}\n"
+    "\n"
+    "// Re-check every block overlapping a write: it only runs natively while\n"
+    "// its bytes still match the ROM it was compiled from.\n"
+    "static void aot_written(aot_t* aot, const chip8_t* ch8, uint16_t addr,\n"
+    "                        uint16_t len) {\n"
+    "  int first = addr - 2 * AOT_MAX_BLOCK_OPS;\n"
+    "  if (first < CHIP8_PROGRAM_START_ADDRESS)\n"
+    "    first = CHIP8_PROGRAM_START_ADDRESS;\n"
+    "  for (int i = first; i < addr + len && i < CHIP8_MEMORY_SIZE; i++) {\n"
+    "    const block_t* block = &blocks[i];\n"
+    "    if (block->fn == NULL || i + block->len <= addr) continue;\n"
+    "    aot->enabled[i] =\n"
+    "        memcmp(&ch8->mem[i], &rom[i - CHIP8_PROGRAM_START_ADDRESS],\n"
+    "               block->len) == 0;\n"
+    "  }\n"
+    "}\n"
+    "\n"
+    "// Same contract as chip8_run_cycles. Compiled blocks never raise events.\n"
+    "static chip8_stop_t aot_run(aot_t* aot, chip8_t* ch8, uint32_t budget,\n"
+    "                            uint32_t* cycles_run) {\n"
+    "  uint32_t count = budget;\n"
+    "  chip8_stop_t stop = CHIP8_STOP_BUDGET;\n"
+    "\n"
+    "  while (count > 0 && stop == CHIP8_STOP_BUDGET) {\n"
+    "    uint16_t ip = ch8->ip;\n"
+    "\n"
+    "    if (ip >= CHIP8_MEMORY_SIZE - 1) {\n"
+    "      stop = chip8_run_instruction(ch8);\n"
+    "      count--;\n"
+    "      continue;\n"
+    "    }\n"
+    "\n"
+    "    const block_t* block = &blocks[ip];\n"
+    "    if (aot->enabled[ip] && block->count <= count) {\n"
+    "      ch8->ip = block->fn(ch8);\n"
+    "      chip8_tick(ch8, block->count);\n"
+    "      count -= block->count;\n"
+    "      continue;\n"
+    "    }\n"
+    "\n"
+    "    chip8_op_t op;\n"
+    "    chip8_decode((ch8->mem[ip] << 8) | ch8->mem[ip + 1], &op);\n"
+    "    uint16_t addr = ch8->reg_i;\n"
+    "    stop = chip8_run_instruction(ch8);\n"
+    "    if (op.writes) aot_written(aot, ch8, addr, op.writes);\n"
+    "    count--;\n"
+    "  }\n"
+    "\n"
+    "  if (cycles_run) *cycles_run = budget - count;\n"
+    "  return stop;\n"
+    "}\n"
+    "\n"
+    "#ifndef CHIP8_AOT_NO_MAIN\n"
+    "\n"
+    "#include <stdio.h>\n"
+    "#include <stdlib.h>\n"
+    "#include <time.h>\n"
+    "\n"
+    "int main(int argc, char** argv) {\n"
+    "  uint32_t count = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;\n"
+    "  static aot_t aot;\n"
+    "  chip8_t ch8;\n"
+    "  struct timespec start, end;\n"
+    "\n"
+    "  chip8_init(&ch8);\n"
+    "  aot_init(&aot, &ch8);\n"
+    "\n"
+    "  clock_gettime(CLOCK_MONOTONIC, &start);\n"
+    "  for (uint32_t left = count; left > 0;) {\n"
+    "    uint32_t ran;\n"
+    "    chip8_stop_t stop = aot_run(&aot, &ch8, left, &ran);\n"
+    "    left -= ran;\n"
+    "    if (stop == CHIP8_STOP_IDLE || stop == CHIP8_STOP_WAIT_KEY)\n"
+    "      left -= chip8_fast_forward(&ch8, left);\n"
+    "    if (stop == CHIP8_STOP_ILLEGAL || stop == CHIP8_STOP_STACK_FAULT) {\n"
+    "      fprintf(stderr, \"fault %d at %04X\\n\", stop, ch8.ip);\n"
+    "      count -= left;\n"
+    "      break;\n"
+    "    }\n"
+    "  }\n"
+    "  clock_gettime(CLOCK_MONOTONIC, &end);\n"
+    "\n"
+    "  for (int y = 0; y < CHIP8_FRAMEBUFFER_Y_LEN; y++) {\n"
+    "    for (int x = 0; x < CHIP8_FRAMEBUFFER_X_LEN; x++) {\n"
+    "      putchar(chip8_pixel(&ch8, x, y) ? '#' : '.');\n"
+    "    }\n"
+    "    putchar('\\n');\n"
+    "  }\n"
+    "\n"
+    "  double secs =\n"
+    "      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;\n"
+    "  printf(\"ip: %04X, %u instructions in %.3fs (%.1f M/s)\\n\", ch8.ip,\n"
+    "         count, secs, count / secs / 1e6);\n"
+    "  return 0;\n"
+    "}\n"
+    "\n"
+    "#endif  // CHIP8_AOT_NO_MAIN\n";
+
+static void emit(FILE* out, aot_t* aot, const char* rom_path) {
+  fprintf(out, "// Generated by chip8-aot from %s. Do not edit.\n\n", rom_path);
+  fprintf(out,
+          "#include <stdbool.h>\n#include <stddef.h>\n#include <stdint.h>\n"
+          "#include <string.h>\n\n#include \"chip8.h\"\n\n");
+  fprintf(out, "#define AOT_MAX_BLOCK_OPS %d\n\n", AOT_MAX_BLOCK_OPS);
+
+  fprintf(out, "static const uint8_t rom[%u] = {", aot->rom_size);
+  for (int i = 0; i < aot->rom_size; i++) {
+    fprintf(out, "%s0x%02X,", i % 12 ? " " : "\n  ",
+            aot->mem[CHIP8_PROGRAM_START_ADDRESS + i]);
+  }
+  fprintf(out, "\n};\n\n");
+  fputs(prelude, out);
+
+  static int counts[CHIP8_MEMORY_SIZE];
+  static uint16_t lens[CHIP8_MEMORY_SIZE];
+  for (int addr = 0; addr < CHIP8_MEMORY_SIZE; addr++) {
+    if (!aot->leader[addr] || !aot->reachable[addr]) continue;
+    if (!translates(aot, addr)) continue;
+
+    counts[addr] = emit_block(out, aot, addr);
+    // A skip at the end of a block reads nothing past itself.
+    lens[addr] = counts[addr] * 2;
+  }
+
+  fprintf(out, "static const block_t blocks[CHIP8_MEMORY_SIZE] = {\n");
+  for (int addr = 0; addr < CHIP8_MEMORY_SIZE; addr++) {
+    if (counts[addr] == 0) continue;
+    fprintf(out, "  [0x%04X] = {block_%04X, %u, %d},\n", addr, addr,
+            lens[addr], counts[addr]);
+  }
+  fprintf(out, "};\n\n");
+}
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    printf("Usage: %s [rom] [output.c]\n", argv[0]);
+    return 1;
+  }
+
+  static aot_t aot;
+  FILE* fp = fopen(argv[1], "rb");
+  if (fp == NULL) {
+    printf("Error: cannot open %s\n", argv[1]);
+    return 1;
+  }
+
+  aot.rom_size = fread(&aot.mem[CHIP8_PROGRAM_START_ADDRESS], 1,
+                       CHIP8_MEMORY_SIZE - CHIP8_PROGRAM_START_ADDRESS, fp);
+  fclose(fp);
+
+  if (aot.rom_size == 0) {
+    printf("Error: %s is empty\n", argv[1]);
+    return 1;
+  }
+
+  analyze(&aot);
+
+  FILE* out = fopen(argv[2], "w");
+  if (out == NULL) {
+    printf("Error: cannot write %s\n", argv[2]);
+    return 1;
+  }
+
+  emit(out, &aot, argv[1]);
+  fputs(runtime, out);
+  fclose(out);
+
+  return 0;
+}
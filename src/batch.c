@@ -0,0 +1,713 @@
+#include "batch.h"
+
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BATCH_LOCKSTEP 1
+#define BATCH_ISA "AVX2"
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BATCH_LOCKSTEP 1
+#define BATCH_ISA "SSE2"
+#else
+#define BATCH_LOCKSTEP 0
+#define BATCH_ISA "scalar"
+#endif
+
+#define BATCH_LANE_ALIGN 64  // lanes, so every lane array is cache aligned
+#define BATCH_PAGE_SHIFT 6   // 64 byte pages, one bit each in dirty
+#define BATCH_MIN_GROUP 4    // smaller groups run lane by lane
+#define BATCH_MAX_SMALL_GROUPS 8  // per step, before giving up on lockstep
+
+struct chip8_batch {
+  uint32_t size;
+  uint32_t lanes;  // size rounded up to BATCH_LANE_ALIGN
+
+  uint16_t* ip;
+  uint16_t* reg_i;
+  uint8_t* reg_v[CHIP8_REGISTER_COUNT];
+  uint8_t* timer;
+  uint8_t* tone_clock;
+  uint16_t* keys;
+  uint8_t* event;
+  uint32_t* rng;
+  uint64_t* cycle;
+  uint64_t* timer_tick;
+  uint64_t* tone_tick;
+
+  // Memory, stack, framebuffer and everything not kept in the arrays above.
+  // A lane running on its own moves into its machine and stays there until
+  // it rejoins a group, so only ip and event in the arrays are kept current
+  // meanwhile.
+  chip8_t* machines;
+  uint8_t* in_machine;  // 0xFF for lanes living in their machine
+
+  // Pages of each lane's memory that may differ from code. Lanes only run in
+  // lockstep on instructions fetched from pages they have not written.
+  uint64_t* dirty;
+  uint8_t* tainted;  // 0xFF for lanes with any dirty pages
+  uint8_t code[CHIP8_MEMORY_SIZE];
+
+  uint8_t* todo;     // 0xFF for lanes still to run in this step
+  uint8_t* sel;      // 0xFF for lanes in the group running in lockstep
+  uint8_t* advance;  // how far the group moves ip, per lane
+  void* arrays;      // backing store of all the per lane arrays
+
+  uint64_t lockstep;  // lane instructions run across SIMD lanes
+  uint64_t grouped;
+  uint64_t alone;
+};
+
+#if defined(__AVX2__)
+
+typedef __m256i vec_t;
+#define VEC_BYTES 32
+
+static inline vec_t vec_load(const void* p) {
+  return _mm256_loadu_si256((const __m256i*)p);
+}
+static inline void vec_store(void* p, vec_t v) {
+  _mm256_storeu_si256((__m256i*)p, v);
+}
+static inline vec_t vec_set8(uint8_t b) { return _mm256_set1_epi8((char)b); }
+static inline vec_t vec_set16(uint16_t w) {
+  return _mm256_set1_epi16((short)w);
+}
+static inline vec_t vec_and(vec_t a, vec_t b) { return _mm256_and_si256(a, b); }
+static inline vec_t vec_or(vec_t a, vec_t b) { return _mm256_or_si256(a, b); }
+static inline vec_t vec_andnot(vec_t a, vec_t b) {
+  return _mm256_andnot_si256(a, b);
+}
+static inline vec_t vec_add8(vec_t a, vec_t b) { return _mm256_add_epi8(a, b); }
+static inline vec_t vec_sub8(vec_t a, vec_t b) { return _mm256_sub_epi8(a, b); }
+static inline vec_t vec_adds8(vec_t a, vec_t b) {
+  return _mm256_adds_epu8(a, b);
+}
+static inline vec_t vec_max8(vec_t a, vec_t b) { return _mm256_max_epu8(a, b); }
+static inline vec_t vec_eq8(vec_t a, vec_t b) { return _mm256_cmpeq_epi8(a, b); }
+static inline vec_t vec_add16(vec_t a, vec_t b) {
+  return _mm256_add_epi16(a, b);
+}
+static inline vec_t vec_mul16(vec_t a, vec_t b) {
+  return _mm256_mullo_epi16(a, b);
+}
+static inline vec_t vec_eq16(vec_t a, vec_t b) {
+  return _mm256_cmpeq_epi16(a, b);
+}
+// Zero-extend VEC_BYTES / 2 bytes into 16-bit lanes.
+static inline vec_t vec_widen(const uint8_t* p) {
+  return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)p));
+}
+// Pack two vectors of 16-bit 0 / 0xFFFF masks into one of bytes, in order.
+static inline vec_t vec_narrow(vec_t lo, vec_t hi) {
+  return _mm256_permute4x64_epi64(_mm256_packs_epi16(lo, hi), 0xD8);
+}
+static inline uint32_t vec_mask(vec_t v) {
+  return (uint32_t)_mm256_movemask_epi8(v);
+}
+
+#elif defined(__SSE2__)
+
+typedef __m128i vec_t;
+#define VEC_BYTES 16
+
+static inline vec_t vec_load(const void* p) {
+  return _mm_loadu_si128((const __m128i*)p);
+}
+static inline void vec_store(void* p, vec_t v) {
+  _mm_storeu_si128((__m128i*)p, v);
+}
+static inline vec_t vec_set8(uint8_t b) { return _mm_set1_epi8((char)b); }
+static inline vec_t vec_set16(uint16_t w) { return _mm_set1_epi16((short)w); }
+static inline vec_t vec_and(vec_t a, vec_t b) { return _mm_and_si128(a, b); }
+static inline vec_t vec_or(vec_t a, vec_t b) { return _mm_or_si128(a, b); }
+static inline vec_t vec_andnot(vec_t a, vec_t b) {
+  return _mm_andnot_si128(a, b);
+}
+static inline vec_t vec_add8(vec_t a, vec_t b) { return _mm_add_epi8(a, b); }
+static inline vec_t vec_sub8(vec_t a, vec_t b) { return _mm_sub_epi8(a, b); }
+static inline vec_t vec_adds8(vec_t a, vec_t b) { return _mm_adds_epu8(a, b); }
+static inline vec_t vec_max8(vec_t a, vec_t b) { return _mm_max_epu8(a, b); }
+static inline vec_t vec_eq8(vec_t a, vec_t b) { return _mm_cmpeq_epi8(a, b); }
+static inline vec_t vec_add16(vec_t a, vec_t b) { return _mm_add_epi16(a, b); }
+static inline vec_t vec_mul16(vec_t a, vec_t b) {
+  return _mm_mullo_epi16(a, b);
+}
+static inline vec_t vec_eq16(vec_t a, vec_t b) { return _mm_cmpeq_epi16(a, b); }
+// Zero-extend VEC_BYTES / 2 bytes into 16-bit lanes.
+static inline vec_t vec_widen(const uint8_t* p) {
+  return _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)p),
+                           _mm_setzero_si128());
+}
+// Pack two vectors of 16-bit 0 / 0xFFFF masks into one of bytes, in order.
+static inline vec_t vec_narrow(vec_t lo, vec_t hi) {
+  return _mm_packs_epi16(lo, hi);
+}
+static inline uint32_t vec_mask(vec_t v) {
+  return (uint32_t)_mm_movemask_epi8(v);
+}
+
+#endif
+
+static uint16_t fetch(const uint8_t* mem, uint16_t addr) {
+  return (mem[addr] << 8) | mem[addr + 1];
+}
+
+// Copy the array fields of a lane into a machine, and back.
+static void write_lane(const chip8_batch_t* batch, uint32_t lane,
+                       chip8_t* ch8) {
+  ch8->ip = batch->ip[lane];
+  ch8->reg_i = batch->reg_i[lane];
+  for (int r = 0; r < CHIP8_REGISTER_COUNT; r++) {
+    ch8->reg_v[r] = batch->reg_v[r][lane];
+  }
+  ch8->timer = batch->timer[lane];
+  ch8->tone_clock = batch->tone_clock[lane];
+  ch8->keys = batch->keys[lane];
+  ch8->event = batch->event[lane];
+  ch8->rng = batch->rng[lane];
+  ch8->cycle = batch->cycle[lane];
+  ch8->timer_tick = batch->timer_tick[lane];
+  ch8->tone_tick = batch->tone_tick[lane];
+}
+
+static void read_lane(chip8_batch_t* batch, uint32_t lane, const chip8_t* ch8) {
+  batch->ip[lane] = ch8->ip;
+  batch->reg_i[lane] = ch8->reg_i;
+  for (int r = 0; r < CHIP8_REGISTER_COUNT; r++) {
+    batch->reg_v[r][lane] = ch8->reg_v[r];
+  }
+  batch->timer[lane] = ch8->timer;
+  batch->tone_clock[lane] = ch8->tone_clock;
+  batch->keys[lane] = ch8->keys;
+  batch->event[lane] = ch8->event;
+  batch->rng[lane] = ch8->rng;
+  batch->cycle[lane] = ch8->cycle;
+  batch->timer_tick[lane] = ch8->timer_tick;
+  batch->tone_tick[lane] = ch8->tone_tick;
+}
+
+static void mark_dirty(chip8_batch_t* batch, uint32_t lane, uint16_t addr,
+                       uint16_t len) {
+  for (uint32_t page = addr >> BATCH_PAGE_SHIFT;
+       page <= (uint32_t)(addr + len - 1) >> BATCH_PAGE_SHIFT; page++) {
+    batch->dirty[lane] |= 1ull << page;
+  }
+  batch->tainted[lane] = 0xFF;
+}
+
+// Whether the instruction at addr in the lane is the one in code.
+static bool shares_code(const chip8_batch_t* batch, uint32_t lane,
+                        uint16_t addr) {
+  if (addr >= CHIP8_MEMORY_SIZE - 1) return false;
+  uint64_t pages = (1ull << (addr >> BATCH_PAGE_SHIFT)) |
+                   (1ull << ((addr + 1) >> BATCH_PAGE_SHIFT));
+  return (batch->dirty[lane] & pages) == 0;
+}
+
+// Move a lane into its machine, or back out into the arrays.
+static chip8_t* to_machine(chip8_batch_t* batch, uint32_t lane) {
+  chip8_t* ch8 = &batch->machines[lane];
+  if (!batch->in_machine[lane]) {
+    write_lane(batch, lane, ch8);
+    batch->in_machine[lane] = 0xFF;
+  }
+  return ch8;
+}
+
+static void to_arrays(chip8_batch_t* batch, uint32_t lane) {
+  if (batch->in_machine[lane]) {
+    read_lane(batch, lane, &batch->machines[lane]);
+    batch->in_machine[lane] = 0;
+  }
+}
+
+static void run_alone(chip8_batch_t* batch, uint32_t lane) {
+  chip8_t* ch8 = to_machine(batch, lane);
+  uint16_t reg_i = ch8->reg_i;
+  uint16_t instruction = 0;
+
+  if (ch8->ip < CHIP8_MEMORY_SIZE - 1) instruction = fetch(ch8->mem, ch8->ip);
+  chip8_run_instruction(ch8);
+  batch->ip[lane] = ch8->ip;
+  batch->event[lane] = ch8->event;
+
+  // FX33 and FX55 write to memory at I.
+  if (ch8->event == CHIP8_STOP_BUDGET) {
+    if ((instruction & 0xF0FF) == 0xF033) {
+      mark_dirty(batch, lane, reg_i, 3);
+    } else if ((instruction & 0xF0FF) == 0xF055) {
+      mark_dirty(batch, lane, reg_i, ((instruction >> 8) & 0x0F) + 1);
+    }
+  }
+  batch->alone++;
+}
+
+// How lanes sharing an instruction run it.
+enum {
+  RUN_ALONE,   // each through the interpreter
+  RUN_VECTOR,  // all at once, across SIMD lanes
+  RUN_GROUP,   // one after the other, straight off the arrays
+};
+
+// RUN_VECTOR instructions only touch the array fields and raise no events.
+// Jumps that might close an idle loop are left to the interpreter, which
+// knows when to raise CHIP8_STOP_IDLE.
+static int how_to_run(uint16_t instruction, uint16_t addr) {
+  uint16_t nnn = instruction & 0x0FFF;
+
+  if (!BATCH_LOCKSTEP) return RUN_ALONE;
+
+  switch (instruction >> 12) {
+    case 0x1:
+      return nnn != addr && nnn + 4 != addr ? RUN_VECTOR : RUN_ALONE;
+    case 0x3:
+    case 0x4:
+    case 0x6:
+    case 0x7:
+    case 0xA:
+    case 0xB:
+      return RUN_VECTOR;
+    case 0x5:
+    case 0x9:
+      return (instruction & 0x000F) == 0 ? RUN_VECTOR : RUN_ALONE;
+    case 0x8:
+      switch (instruction & 0x000F) {
+        case 0x0:
+        case 0x1:
+        case 0x2:
+        case 0x4:
+        case 0x5:
+          return RUN_VECTOR;
+        default:
+          return RUN_ALONE;
+      }
+    case 0xC:
+    case 0xD:
+      return RUN_GROUP;
+    case 0xE:
+      return (instruction & 0xFF) == 0x9E || (instruction & 0xFF) == 0xA1
+                 ? RUN_VECTOR
+                 : RUN_ALONE;
+    case 0xF:
+      return (instruction & 0xFF) == 0x1E || (instruction & 0xFF) == 0x29
+                 ? RUN_VECTOR
+                 : RUN_ALONE;
+    default:
+      return RUN_ALONE;
+  }
+}
+
+#if BATCH_LOCKSTEP
+
+// Select the lanes still to run in this step that are on addr with the
+// shared instruction there, from `first` on. Returns how many, and sets *end
+// past the last chunk holding any.
+static uint32_t select_group(chip8_batch_t* batch, uint32_t first,
+                             uint16_t addr, uint32_t* end) {
+  vec_t target = vec_set16(addr);
+  uint32_t count = 0;
+
+  for (uint32_t c = first & ~(VEC_BYTES - 1); c < batch->size;
+       c += VEC_BYTES) {
+    vec_t todo = vec_load(&batch->todo[c]);
+    vec_t sel = vec_and(
+        todo, vec_narrow(vec_eq16(vec_load(&batch->ip[c]), target),
+                         vec_eq16(vec_load(&batch->ip[c + VEC_BYTES / 2]),
+                                  target)));
+    if (vec_mask(sel) == 0) continue;
+
+    // Lanes that wrote to their memory may have other code at addr, and
+    // lanes that ran on their own have to come back to the arrays.
+    uint32_t check = vec_mask(vec_and(
+        sel, vec_or(vec_load(&batch->tainted[c]),
+                    vec_load(&batch->in_machine[c]))));
+    vec_store(&batch->sel[c], sel);
+    while (check) {
+      uint32_t lane = c + __builtin_ctz(check);
+      check &= check - 1;
+      if (batch->tainted[lane] && !shares_code(batch, lane, addr)) {
+        batch->sel[lane] = 0;
+      } else {
+        to_arrays(batch, lane);
+      }
+    }
+
+    sel = vec_load(&batch->sel[c]);
+    vec_store(&batch->todo[c], vec_andnot(sel, todo));
+    count += __builtin_popcount(vec_mask(sel));
+    *end = c + VEC_BYTES;
+  }
+  return count;
+}
+
+// Run the instruction on every selected lane in [lo, hi), both multiples of
+// VEC_BYTES.
+static void run_lockstep(chip8_batch_t* batch, uint16_t instruction,
+                         uint32_t lo, uint32_t hi) {
+  chip8_op_t op;
+  chip8_decode(instruction, &op);
+  uint8_t* vx = batch->reg_v[op.x];
+  uint8_t* vy = batch->reg_v[op.y];
+  uint8_t* vf = batch->reg_v[0xF];
+  const vec_t one = vec_set8(1), two = vec_set8(2);
+
+  // Registers first, along with how far each lane moves ip.
+  for (uint32_t c = lo; c < hi; c += VEC_BYTES) {
+    vec_t sel = vec_load(&batch->sel[c]);
+    vec_t skip = vec_set8(0);  // 0xFF where the next instruction is skipped
+    vec_t a = vec_load(&vx[c]), b = vec_load(&vy[c]), result;
+
+    switch (instruction >> 12) {
+      case 0x3:
+        skip = vec_eq8(a, vec_set8(op.kk));
+        break;
+      case 0x4:
+        skip = vec_andnot(vec_eq8(a, vec_set8(op.kk)), vec_set8(0xFF));
+        break;
+      case 0x5:
+        skip = vec_eq8(a, b);
+        break;
+      case 0x9:
+        skip = vec_andnot(vec_eq8(a, b), vec_set8(0xFF));
+        break;
+      case 0x6:
+        vec_store(&vx[c], vec_or(vec_and(sel, vec_set8(op.kk)),
+                                 vec_andnot(sel, a)));
+        break;
+      case 0x7:
+        result = vec_add8(a, vec_set8(op.kk));
+        vec_store(&vx[c], vec_or(vec_and(sel, result), vec_andnot(sel, a)));
+        break;
+      case 0x8:
+        // VF is written before VX, and 8XY5 reads both after it, exactly as
+        // the interpreter does when X or Y is F.
+        if (op.n == 0x4) {
+          result = vec_add8(a, b);
+          vec_t carry = vec_andnot(vec_eq8(vec_adds8(a, b), result), one);
+          vec_t f = vec_load(&vf[c]);
+          vec_store(&vf[c], vec_or(vec_and(sel, carry), vec_andnot(sel, f)));
+          a = vec_load(&vx[c]);
+        } else if (op.n == 0x5) {
+          vec_t borrow = vec_and(vec_eq8(vec_max8(a, b), a), one);
+          vec_t f = vec_load(&vf[c]);
+          vec_store(&vf[c], vec_or(vec_and(sel, borrow), vec_andnot(sel, f)));
+          a = vec_load(&vx[c]);
+          b = vec_load(&vy[c]);
+          result = vec_sub8(a, b);
+        } else if (op.n == 0x1) {
+          result = vec_or(a, b);
+        } else if (op.n == 0x2) {
+          result = vec_and(a, b);
+        } else {
+          result = b;
+        }
+        vec_store(&vx[c], vec_or(vec_and(sel, result), vec_andnot(sel, a)));
+        break;
+      case 0xE: {
+        // Looking up a bit by a per lane index has no byte-wise vector
+        // equivalent, so that part goes lane by lane.
+        alignas(VEC_BYTES) uint8_t held[VEC_BYTES];
+        for (uint32_t i = 0; i < VEC_BYTES; i++) {
+          uint8_t key = vx[c + i];
+          held[i] = key < CHIP8_KEY_COUNT && (batch->keys[c + i] >> key) & 1
+                        ? 0xFF
+                        : 0;
+        }
+        skip = vec_load(held);
+        if (op.kk == 0xA1) skip = vec_andnot(skip, vec_set8(0xFF));
+        break;
+      }
+      default:
+        break;
+    }
+
+    vec_store(&batch->advance[c],
+              vec_and(sel, vec_add8(two, vec_and(skip, two))));
+    vec_store(&batch->event[c],  // CHIP8_STOP_BUDGET
+              vec_andnot(sel, vec_load(&batch->event[c])));
+  }
+
+  // Then the 16-bit ip and I.
+  for (uint32_t c = lo; c < hi; c += VEC_BYTES / 2) {
+    vec_t sel = vec_eq16(vec_widen(&batch->sel[c]), vec_set16(0xFF));
+    vec_t ip = vec_load(&batch->ip[c]), reg_i = vec_load(&batch->reg_i[c]);
+    vec_t nnn = vec_set16(CHIP8_OP_NNN(&op));
+
+    switch (instruction >> 12) {
+      case 0x1:
+        ip = vec_or(vec_and(sel, nnn), vec_andnot(sel, ip));
+        break;
+      case 0xB:
+        nnn = vec_add16(nnn, vec_widen(&batch->reg_v[0][c]));
+        ip = vec_or(vec_and(sel, nnn), vec_andnot(sel, ip));
+        break;
+      case 0xA:
+        reg_i = vec_or(vec_and(sel, nnn), vec_andnot(sel, reg_i));
+        ip = vec_add16(ip, vec_widen(&batch->advance[c]));
+        break;
+      case 0xF:
+        if (op.kk == 0x1E) {
+          reg_i = vec_add16(reg_i, vec_and(sel, vec_widen(&vx[c])));
+        } else {
+          vec_t digit = vec_and(vec_widen(&vx[c]), vec_set16(0x0F));
+          digit = vec_mul16(digit, vec_set16(5));
+          reg_i = vec_or(vec_and(sel, digit), vec_andnot(sel, reg_i));
+        }
+        ip = vec_add16(ip, vec_widen(&batch->advance[c]));
+        break;
+      default:
+        ip = vec_add16(ip, vec_widen(&batch->advance[c]));
+        break;
+    }
+
+    vec_store(&batch->ip[c], ip);
+    vec_store(&batch->reg_i[c], reg_i);
+  }
+
+  for (uint32_t lane = lo; lane < hi; lane++) {
+    batch->cycle[lane] += batch->sel[lane] & 1;
+  }
+}
+
+// CXKK and DXYN on every selected lane in [lo, hi), both multiples of
+// VEC_BYTES. Each lane draws into its own framebuffer, but there is no need
+// to move it into its machine for that.
+static void run_group(chip8_batch_t* batch, uint16_t instruction, uint32_t lo,
+                      uint32_t hi) {
+  chip8_op_t op;
+  chip8_decode(instruction, &op);
+  uint8_t* vx = batch->reg_v[op.x];
+  uint8_t* vy = batch->reg_v[op.y];
+
+  for (uint32_t c = lo; c < hi; c += VEC_BYTES) {
+    uint32_t bits = vec_mask(vec_load(&batch->sel[c]));
+    while (bits) {
+      uint32_t lane = c + __builtin_ctz(bits);
+      bits &= bits - 1;
+
+      batch->cycle[lane]++;
+      if (instruction >> 12 == 0xC) {
+        vx[lane] = chip8_random(&batch->rng[lane]) & op.kk;
+        batch->event[lane] = CHIP8_STOP_BUDGET;
+      } else if (batch->reg_i[lane] + op.n > CHIP8_MEMORY_SIZE) {
+        batch->event[lane] = CHIP8_STOP_ILLEGAL;
+        continue;
+      } else {
+        chip8_t* ch8 = &batch->machines[lane];
+        batch->reg_v[0xF][lane] = chip8_draw(ch8, vx[lane], vy[lane],
+                                             &ch8->mem[batch->reg_i[lane]],
+                                             op.n);
+        batch->event[lane] = CHIP8_STOP_FRAME;
+      }
+      batch->ip[lane] += 2;
+    }
+  }
+}
+
+#endif  // BATCH_LOCKSTEP
+
+// The first lane from `lane` on still to run in this step, or size. Lanes
+// are taken in order, so none before `lane` are left.
+static uint32_t next_todo(const chip8_batch_t* batch, uint32_t lane) {
+#if BATCH_LOCKSTEP
+  for (uint32_t c = lane & ~(VEC_BYTES - 1); c < batch->size;
+       c += VEC_BYTES) {
+    uint32_t bits = vec_mask(vec_load(&batch->todo[c]));
+    if (bits) return c + __builtin_ctz(bits);
+  }
+  return batch->size;
+#else
+  while (lane < batch->size && !batch->todo[lane]) lane++;
+  return lane;
+#endif
+}
+
+// Run one instruction on every lane marked in todo. Lanes on the same
+// instruction go together; once the lanes have scattered too far for that
+// to pay off, the rest go one by one.
+static void step(chip8_batch_t* batch) {
+  uint32_t small_groups = 0;
+
+  for (uint32_t lane = next_todo(batch, 0); lane < batch->size;
+       lane = next_todo(batch, lane)) {
+    uint16_t addr = batch->ip[lane];
+    uint16_t instruction = 0;
+    int how = RUN_ALONE;
+    if (shares_code(batch, lane, addr)) {
+      instruction = fetch(batch->code, addr);
+      how = how_to_run(instruction, addr);
+    }
+    if (how == RUN_ALONE || small_groups >= BATCH_MAX_SMALL_GROUPS) {
+      batch->todo[lane] = 0;
+      run_alone(batch, lane);
+      continue;
+    }
+
+#if BATCH_LOCKSTEP
+    uint32_t end = lane;
+    uint32_t count = select_group(batch, lane, addr, &end);
+    uint32_t lo = lane & ~(VEC_BYTES - 1);
+    uint32_t hi = (end + VEC_BYTES - 1) & ~(VEC_BYTES - 1);
+
+    if (count < BATCH_MIN_GROUP) {
+      small_groups++;
+      for (uint32_t i = lane; i < end; i++) {
+        if (batch->sel[i]) run_alone(batch, i);
+      }
+    } else if (how == RUN_VECTOR) {
+      run_lockstep(batch, instruction, lo, hi);
+      batch->lockstep += count;
+    } else {
+      run_group(batch, instruction, lo, hi);
+      batch->grouped += count;
+    }
+    memset(&batch->sel[lo], 0, hi - lo);
+#endif
+  }
+}
+
+static void* take(uint8_t** next, size_t bytes) {
+  void* array = *next;
+  *next += bytes;
+  return array;
+}
+
+chip8_batch_t* chip8_batch_create(uint32_t size, const chip8_t* init) {
+  if (size == 0) return NULL;
+
+  chip8_batch_t* batch = calloc(1, sizeof(chip8_batch_t));
+  if (batch == NULL) return NULL;
+
+  uint32_t lanes = (size + BATCH_LANE_ALIGN - 1) & ~(BATCH_LANE_ALIGN - 1);
+  size_t lane_bytes = 3 * sizeof(uint16_t) + CHIP8_REGISTER_COUNT + 8 +
+                      sizeof(uint32_t) + 4 * sizeof(uint64_t);
+  batch->size = size;
+  batch->lanes = lanes;
+  batch->arrays = aligned_alloc(BATCH_LANE_ALIGN, lanes * lane_bytes);
+  batch->machines = aligned_alloc(CHIP8_CACHE_LINE, size * sizeof(chip8_t));
+  if (batch->arrays == NULL || batch->machines == NULL) {
+    chip8_batch_destroy(batch);
+    return NULL;
+  }
+  memset(batch->arrays, 0, lanes * lane_bytes);
+
+  // Widest first, so each array stays aligned.
+  uint8_t* next = batch->arrays;
+  batch->cycle = take(&next, lanes * sizeof(uint64_t));
+  batch->timer_tick = take(&next, lanes * sizeof(uint64_t));
+  batch->tone_tick = take(&next, lanes * sizeof(uint64_t));
+  batch->dirty = take(&next, lanes * sizeof(uint64_t));
+  batch->rng = take(&next, lanes * sizeof(uint32_t));
+  batch->ip = take(&next, lanes * sizeof(uint16_t));
+  batch->reg_i = take(&next, lanes * sizeof(uint16_t));
+  batch->keys = take(&next, lanes * sizeof(uint16_t));
+  for (int r = 0; r < CHIP8_REGISTER_COUNT; r++) {
+    batch->reg_v[r] = take(&next, lanes);
+  }
+  batch->timer = take(&next, lanes);
+  batch->tone_clock = take(&next, lanes);
+  batch->event = take(&next, lanes);
+  batch->todo = take(&next, lanes);
+  batch->sel = take(&next, lanes);
+  batch->advance = take(&next, lanes);
+  batch->tainted = take(&next, lanes);
+  batch->in_machine = take(&next, lanes);
+
+  memcpy(batch->code, init->mem, CHIP8_MEMORY_SIZE);
+  for (uint32_t lane = 0; lane < size; lane++) {
+    chip8_batch_load(batch, lane, init);
+  }
+  return batch;
+}
+
+void chip8_batch_destroy(chip8_batch_t* batch) {
+  free(batch->arrays);
+  free(batch->machines);
+  free(batch);
+}
+
+uint32_t chip8_batch_size(const chip8_batch_t* batch) { return batch->size; }
+
+void chip8_batch_load(chip8_batch_t* batch, uint32_t lane, const chip8_t* ch8) {
+  batch->machines[lane] = *ch8;
+  read_lane(batch, lane, ch8);
+  batch->in_machine[lane] = 0;
+
+  batch->dirty[lane] = 0;
+  batch->tainted[lane] = 0;
+  for (uint32_t addr = 0; addr < CHIP8_MEMORY_SIZE;
+       addr += 1 << BATCH_PAGE_SHIFT) {
+    if (memcmp(&ch8->mem[addr], &batch->code[addr], 1 << BATCH_PAGE_SHIFT)) {
+      mark_dirty(batch, lane, addr, 1);
+    }
+  }
+}
+
+void chip8_batch_store(const chip8_batch_t* batch, uint32_t lane,
+                       chip8_t* ch8) {
+  *ch8 = batch->machines[lane];
+  if (!batch->in_machine[lane]) write_lane(batch, lane, ch8);
+}
+
+void chip8_batch_set_keys(chip8_batch_t* batch, uint32_t lane,
+                          uint16_t keys) {
+  batch->keys[lane] = keys;
+  batch->machines[lane].keys = keys;
+}
+
+chip8_stop_t chip8_batch_stop(const chip8_batch_t* batch, uint32_t lane) {
+  return batch->event[lane];
+}
+
+void chip8_batch_step(chip8_batch_t* batch) {
+  memset(batch->todo, 0xFF, batch->size);
+  step(batch);
+}
+
+static uint64_t lane_cycle(const chip8_batch_t* batch, uint32_t lane) {
+  return batch->in_machine[lane] ? batch->machines[lane].cycle
+                                       : batch->cycle[lane];
+}
+
+void chip8_batch_run_cycles(chip8_batch_t* batch, uint32_t budget,
+                            uint32_t* cycles_run) {
+  // Every instruction ticks the clock once, so the cycles each lane ran fall
+  // out of its clock at the end.
+  for (uint32_t lane = 0; lane < batch->size; lane++) {
+    batch->event[lane] = CHIP8_STOP_BUDGET;
+    if (cycles_run) cycles_run[lane] = (uint32_t)lane_cycle(batch, lane);
+  }
+
+  for (uint32_t ran = 0; ran < budget; ran++) {
+    uint32_t running = 0;
+    for (uint32_t lane = 0; lane < batch->size; lane++) {
+      batch->todo[lane] = batch->event[lane] == CHIP8_STOP_BUDGET ? 0xFF : 0;
+      running += batch->todo[lane] & 1;
+    }
+    if (running == 0) break;
+    step(batch);
+  }
+
+  if (cycles_run) {
+    for (uint32_t lane = 0; lane < batch->size; lane++) {
+      cycles_run[lane] = (uint32_t)lane_cycle(batch, lane) - cycles_run[lane];
+    }
+  }
+}
+
+void chip8_batch_report(const chip8_batch_t* batch, FILE* out) {
+  uint64_t total = batch->lockstep + batch->grouped + batch->alone;
+
+  fprintf(out, "Batch of %u lanes (%s):\n", batch->size, BATCH_ISA);
+  fprintf(out, "  %llu instructions in lockstep, %llu grouped, %llu alone\n",
+          (unsigned long long)batch->lockstep,
+          (unsigned long long)batch->grouped,
+          (unsigned long long)batch->alone);
+  fprintf(out, "  %.1f%% vectorized\n",
+          total ? 100.0 * batch->lockstep / total : 0.0);
+}
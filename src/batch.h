@@ -0,0 +1,49 @@
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chip8.h"
+
+// A batch of machines kept as a struct of arrays: ip, I, V0-VF, the timers
+// and the clock each live in an array indexed by lane, while memory, the
+// stack and the framebuffer stay in a chip8_t per lane. Lanes that sit on the
+// same instruction run it together with SSE2 or AVX2 (when built with
+// -mavx2), one lane per byte. Draws and random numbers still go lane by lane,
+// and lanes that drift apart run on their own through the interpreter.
+// Either way every lane ends up exactly as chip8_run_instruction would leave
+// it.
+typedef struct chip8_batch chip8_batch_t;
+
+// All lanes start out as copies of `init`, whose memory is also the code the
+// lanes are assumed to share. Returns NULL if size is 0 or out of memory.
+chip8_batch_t* chip8_batch_create(uint32_t size, const chip8_t* init);
+void chip8_batch_destroy(chip8_batch_t* batch);
+
+uint32_t chip8_batch_size(const chip8_batch_t* batch);
+
+// Copy a machine into or out of a lane.
+void chip8_batch_load(chip8_batch_t* batch, uint32_t lane, const chip8_t* ch8);
+void chip8_batch_store(const chip8_batch_t* batch, uint32_t lane,
+                       chip8_t* ch8);
+
+// Set which keys are held down, as chip8_t.keys.
+void chip8_batch_set_keys(chip8_batch_t* batch, uint32_t lane, uint16_t keys);
+
+// The event raised by the lane's last instruction.
+chip8_stop_t chip8_batch_stop(const chip8_batch_t* batch, uint32_t lane);
+
+// chip8_run_instruction on every lane.
+void chip8_batch_step(chip8_batch_t* batch);
+
+// chip8_run_cycles on every lane: each one runs until it raises an event or
+// has run `budget` instructions. cycles_run, if not NULL, gets one count per
+// lane.
+void chip8_batch_run_cycles(chip8_batch_t* batch, uint32_t budget,
+                            uint32_t* cycles_run);
+
+// Print how many lane instructions ran in lockstep and how many on their own.
+void chip8_batch_report(const chip8_batch_t* batch, FILE* out);
+
+#endif  // __BATCH_H__
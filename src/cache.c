@@ -0,0 +1,216 @@
+#include "cache.h"
+
+#include <stddef.h>
+#include <string.h>
+
+// A fused handler runs a whole superinstruction of up to `len` instructions,
+// ticking the clocks itself, and returns how many it executed. `op` is the
+// cache entry of the first instruction; the one at addr + 2 is op[2] and so
+// on.
+typedef uint32_t (*fused_handler_t)(chip8_t* chip8, const chip8_op_t* op,
+                                    uint8_t len);
+
+static uint16_t fetch(const chip8_t* ch8, uint16_t addr) {
+  return (ch8->mem[addr] << 8) | ch8->mem[addr + 1];
+}
+
+static uint32_t fused_annn_dxyn(chip8_t* ch8, const chip8_op_t* op,
+                                uint8_t len) {
+  (void)len;
+  chip8_tick(ch8, 2);
+  ch8->reg_i = CHIP8_OP_NNN(op);
+  ch8->ip += 2;
+  op[2].handler(ch8, &op[2]);
+  return 2;
+}
+
+static uint32_t fused_6xkk_run(chip8_t* ch8, const chip8_op_t* op,
+                               uint8_t len) {
+  for (int i = 0; i < len; i++) ch8->reg_v[op[i * 2].x] = op[i * 2].kk;
+  chip8_tick(ch8, len);
+  ch8->ip += len * 2;
+  return len;
+}
+
+static uint32_t fused_7xkk_3xkk(chip8_t* ch8, const chip8_op_t* op,
+                                uint8_t len) {
+  (void)len;
+  chip8_tick(ch8, 2);
+  ch8->reg_v[op[0].x] += op[0].kk;
+  ch8->ip += ch8->reg_v[op[2].x] == op[2].kk ? 6 : 4;
+  return 2;
+}
+
+static uint32_t fused_fx07_3x00_1nnn(chip8_t* ch8, const chip8_op_t* op,
+                                     uint8_t len) {
+  (void)len;
+  chip8_tick(ch8, 1);
+  ch8->reg_v[op[0].x] = chip8_timer(ch8);
+  chip8_tick(ch8, 1);
+  if (ch8->reg_v[op[2].x] == op[2].kk) {
+    ch8->ip += 6;
+    return 2;
+  }
+  chip8_tick(ch8, 1);
+  ch8->ip += 4;
+  op[4].handler(ch8, &op[4]);  // may raise CHIP8_STOP_IDLE
+  return 3;
+}
+
+static const fused_handler_t fused_handlers[CHIP8_FUSION_COUNT] = {
+  [CHIP8_FUSION_ANNN_DXYN] = fused_annn_dxyn,
+  [CHIP8_FUSION_6XKK_RUN] = fused_6xkk_run,
+  [CHIP8_FUSION_7XKK_3XKK] = fused_7xkk_3xkk,
+  [CHIP8_FUSION_FX07_3X00_1NNN] = fused_fx07_3x00_1nnn,
+};
+
+static const char* fusion_names[CHIP8_FUSION_COUNT] = {
+  [CHIP8_FUSION_ANNN_DXYN] = "ANNN DXYN",
+  [CHIP8_FUSION_6XKK_RUN] = "6XKK run",
+  [CHIP8_FUSION_7XKK_3XKK] = "7XKK 3XKK",
+  [CHIP8_FUSION_FX07_3X00_1NNN] = "FX07 3X00 1NNN",
+};
+
+static const chip8_op_t* entry(chip8_cache_t* cache, const chip8_t* ch8,
+                               uint16_t addr) {
+  chip8_op_t* op = &cache->ops[addr];
+  if (op->handler == NULL) chip8_decode(fetch(ch8, addr), op);
+  return op;
+}
+
+// Find the superinstruction starting at addr. Every instruction it covers
+// is decoded as a side effect, so fused handlers can read their operands.
+static uint8_t detect_fusion(chip8_cache_t* cache, const chip8_t* ch8,
+                             uint16_t addr) {
+  uint8_t fusion = CHIP8_FUSION_NONE;
+  uint8_t len = 1;
+
+  if (addr < CHIP8_MEMORY_SIZE - 3) {
+    uint16_t first = entry(cache, ch8, addr)->instruction;
+    uint16_t second = entry(cache, ch8, addr + 2)->instruction;
+
+    if ((first & 0xF000) == 0xA000 && (second & 0xF000) == 0xD000) {
+      fusion = CHIP8_FUSION_ANNN_DXYN;
+      len = 2;
+    } else if ((first & 0xF000) == 0x6000 && (second & 0xF000) == 0x6000) {
+      fusion = CHIP8_FUSION_6XKK_RUN;
+      len = 2;
+      while (len < CHIP8_FUSION_MAX_LEN &&
+             addr + len * 2 < CHIP8_MEMORY_SIZE - 1 &&
+             (entry(cache, ch8, addr + len * 2)->instruction & 0xF000) ==
+                 0x6000) {
+        len++;
+      }
+    } else if ((first & 0xF000) == 0x7000 && (second & 0xF000) == 0x3000) {
+      fusion = CHIP8_FUSION_7XKK_3XKK;
+      len = 2;
+    } else if ((first & 0xF0FF) == 0xF007 && (second & 0xF0FF) == 0x3000 &&
+               ((first ^ second) & 0x0F00) == 0 &&
+               addr < CHIP8_MEMORY_SIZE - 5 &&
+               (entry(cache, ch8, addr + 4)->instruction & 0xF000) == 0x1000) {
+      fusion = CHIP8_FUSION_FX07_3X00_1NNN;
+      len = 3;
+    }
+  }
+
+  cache->ops[addr].fused = fusion;
+  cache->fusion_len[addr] = len;
+  return fusion;
+}
+
+void chip8_cache_init(chip8_cache_t* cache, const chip8_t* ch8) {
+  chip8_cache_invalidate(cache, 0, CHIP8_MEMORY_SIZE);
+  cache->executed = 0;
+  memset(cache->fired, 0, sizeof(cache->fired));
+  memset(cache->fused, 0, sizeof(cache->fused));
+
+  for (uint16_t addr = CHIP8_PROGRAM_START_ADDRESS;
+       addr < CHIP8_MEMORY_SIZE - 1; addr += 2) {
+    chip8_decode(fetch(ch8, addr), &cache->ops[addr]);
+  }
+}
+
+void chip8_cache_invalidate(chip8_cache_t* cache, uint16_t addr,
+                            uint16_t len) {
+  uint32_t end = (uint32_t)addr + len;
+  if (end > CHIP8_MEMORY_SIZE) end = CHIP8_MEMORY_SIZE;
+
+  // The instruction starting one byte before addr also covers addr.
+  for (uint32_t i = addr > 0 ? addr - 1 : 0; i < end; i++) {
+    cache->ops[i].handler = NULL;
+  }
+
+  // So does any superinstruction starting up to its length before it.
+  const uint16_t span = CHIP8_FUSION_MAX_LEN * 2 - 1;
+  for (uint32_t i = addr > span ? addr - span : 0; i < end; i++) {
+    cache->ops[i].fused = CHIP8_FUSION_UNKNOWN;
+  }
+}
+
+chip8_stop_t chip8_cache_run(chip8_cache_t* cache, chip8_t* ch8,
+                             uint32_t budget, uint32_t* cycles_run) {
+  uint32_t count = budget;
+
+  ch8->event = CHIP8_STOP_BUDGET;
+  while (count > 0) {
+    uint16_t ip = ch8->ip;
+
+    if (ip >= CHIP8_MEMORY_SIZE - 1) {
+      chip8_run_instruction(ch8);
+      count--;
+      break;
+    }
+
+    chip8_op_t* op = &cache->ops[ip];
+    if (op->handler == NULL) chip8_decode(fetch(ch8, ip), op);
+
+    uint8_t fusion = op->fused;
+    if (fusion == CHIP8_FUSION_UNKNOWN) fusion = detect_fusion(cache, ch8, ip);
+
+    // A skip or jump landing inside a sequence simply starts at its own
+    // entry; the fused form only runs from the first instruction.
+    if (fusion != CHIP8_FUSION_NONE && cache->fusion_len[ip] <= count) {
+      uint32_t ran = fused_handlers[fusion](ch8, op, cache->fusion_len[ip]);
+      cache->fired[fusion]++;
+      cache->fused[fusion] += ran;
+      count -= ran;
+      if (ch8->event != CHIP8_STOP_BUDGET) break;
+      continue;
+    }
+
+    chip8_tick(ch8, 1);
+
+    if (op->writes) {
+      // FX33/FX55 may rewrite code, so drop whatever they touched.
+      uint16_t addr = ch8->reg_i;
+      uint16_t len = op->writes;
+      op->handler(ch8, op);
+      chip8_cache_invalidate(cache, addr, len);
+    } else {
+      op->handler(ch8, op);
+    }
+    count--;
+    if (ch8->event != CHIP8_STOP_BUDGET) break;
+  }
+
+  cache->executed += budget - count;
+  if (cycles_run) *cycles_run = budget - count;
+  return ch8->event;
+}
+
+void chip8_cache_report(const chip8_cache_t* cache, FILE* out) {
+  uint64_t fired = 0, fused = 0;
+
+  fprintf(out, "Superinstructions (%llu instructions executed):\n",
+          (unsigned long long)cache->executed);
+  for (int i = CHIP8_FUSION_NONE + 1; i < CHIP8_FUSION_COUNT; i++) {
+    fprintf(out, "  %-16s fired %10llu, covered %10llu instructions\n",
+            fusion_names[i], (unsigned long long)cache->fired[i],
+            (unsigned long long)cache->fused[i]);
+    fired += cache->fired[i];
+    fused += cache->fused[i];
+  }
+  fprintf(out, "  %llu dispatches saved (%.1f%% of instructions fused)\n",
+          (unsigned long long)(fused - fired),
+          cache->executed ? 100.0 * fused / cache->executed : 0.0);
+}
@@ -0,0 +1,48 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chip8.h"
+
+// Superinstructions: common opcode sequences run as a single fused handler
+// when execution reaches their first instruction.
+enum {
+  CHIP8_FUSION_NONE,
+  CHIP8_FUSION_ANNN_DXYN,       // ANNN, DXYN
+  CHIP8_FUSION_6XKK_RUN,        // 6XKK, 6XKK, ...
+  CHIP8_FUSION_7XKK_3XKK,       // 7XKK, 3XKK
+  CHIP8_FUSION_FX07_3X00_1NNN,  // FX07, 3X00, 1NNN
+  CHIP8_FUSION_COUNT,
+  CHIP8_FUSION_UNKNOWN = 0xFF,  // not looked for yet
+};
+
+#define CHIP8_FUSION_MAX_LEN 8  // instructions
+
+// Predecoded instruction cache. Each address of chip8_t.mem maps to a decoded
+// micro-op (handler plus operands), so the run loop never re-fetches or
+// re-decodes an instruction. Entries are filled lazily and dropped whenever
+// the bytes behind them are written.
+struct chip8_cache {
+  chip8_op_t ops[CHIP8_MEMORY_SIZE];
+  uint8_t fusion_len[CHIP8_MEMORY_SIZE];  // instructions in ops[].fused
+  uint64_t executed;
+  uint64_t fired[CHIP8_FUSION_COUNT];
+  uint64_t fused[CHIP8_FUSION_COUNT];  // instructions run inside fusions
+};
+
+typedef struct chip8_cache chip8_cache_t;
+
+// Predecode the program region of chip8->mem. Call again after loading a new
+// ROM or otherwise writing to memory from outside the core.
+void chip8_cache_init(chip8_cache_t* cache, const chip8_t* chip8);
+void chip8_cache_invalidate(chip8_cache_t* cache, uint16_t addr, uint16_t len);
+// Same contract as chip8_run_cycles.
+chip8_stop_t chip8_cache_run(chip8_cache_t* cache, chip8_t* chip8,
+                             uint32_t budget, uint32_t* cycles_run);
+
+// Print which superinstructions fired and how many dispatches they saved.
+void chip8_cache_report(const chip8_cache_t* cache, FILE* out);
+
+#endif  // __CACHE_H__
@@ -1,12 +1,25 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
-#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "chip8.h"
 
+static_assert(CHIP8_STACK_SIZE >= 1 && CHIP8_STACK_SIZE <= 255,
+              "sp must be able to hold the stack depth");
+static_assert(offsetof(chip8_t, stack) <= CHIP8_CACHE_LINE,
+              "registers spill out of the first cache line");
+static_assert(sizeof(chip8_t) == CHIP8_STATE_SIZE,
+              "chip8_t is over its size budget");
+
 static const uint8_t digits[16][5] = {
   {0xF0, 0x90, 0x90, 0x90, 0xF0},  // 0
   {0x20, 0x60, 0x20, 0x20, 0xF0},  // 1
@@ -27,19 +40,59 @@ static const uint8_t digits[16][5] = {
 };
 
 void chip8_init(chip8_t* ch8) {
+  // Registers, stack and display are cleared in one go, then the few
+  // registers that do not start at zero are set.
+  memset(ch8, 0, offsetof(chip8_t, mem));
+  chip8_profile_forget(ch8);
   ch8->ip = CHIP8_PROGRAM_START_ADDRESS;
-  ch8->reg_i = 0;
-  for (int i = 0; i < CHIP8_REGISTER_COUNT; i++) ch8->reg_v[i] = 0;
-  ch8->timer = 0;
-  ch8->tone_clock = 0;
-  ch8->keypress = CHIP8_NO_KEY_PRESSED;
-  ch8->sp = 0;
-  memset(ch8->stack, 0, CHIP8_MEMORY_SIZE);
+  ch8->cpu_hz = CHIP8_DEFAULT_CPU_HZ;
+  ch8->event = CHIP8_STOP_BUDGET;
+  ch8->rng = CHIP8_DEFAULT_SEED;
+  ch8->dirty_rows = CHIP8_FRAMEBUFFER_ALL_ROWS;
   memset(ch8->mem, 0, CHIP8_MEMORY_SIZE);
-  memset(ch8->framebuffer, 0, CHIP8_FRAMEBUFFER_SIZE);
   memcpy(&ch8->mem[CHIP8_DIGITS_START_ADDRESS], digits, sizeof(digits));
 }
 
+void chip8_seed(chip8_t* ch8, uint32_t seed) {
+  // xorshift gets stuck on zero.
+  ch8->rng = seed ? seed : CHIP8_DEFAULT_SEED;
+}
+
+void chip8_set_cpu_hz(chip8_t* ch8, uint32_t hz) {
+  // The ticks the timers were set at go back as far as the count does, so
+  // they count down as before.
+  uint64_t ticks = chip8_ticks(ch8);
+  ch8->timer_tick -= ticks;
+  ch8->tone_tick -= ticks;
+  ch8->cycle = 0;
+  ch8->cpu_hz = hz ? hz : CHIP8_DEFAULT_CPU_HZ;
+}
+
+uint64_t chip8_ticks(const chip8_t* ch8) {
+  return ch8->cycle * CHIP8_TIMER_HZ / ch8->cpu_hz;
+}
+
+static uint8_t count_down(uint8_t value, uint64_t set_at, uint64_t now) {
+  return now - set_at < value ? value - (now - set_at) : 0;
+}
+
+uint8_t chip8_timer(const chip8_t* ch8) {
+  return count_down(ch8->timer, ch8->timer_tick, chip8_ticks(ch8));
+}
+
+uint8_t chip8_tone(const chip8_t* ch8) {
+  return count_down(ch8->tone_clock, ch8->tone_tick, chip8_ticks(ch8));
+}
+
+uint32_t chip8_frame_cycles(const chip8_t* ch8, uint32_t frames) {
+  // First cycle at which cycle * 60 / cpu_hz reaches the target tick.
+  uint64_t ticks = chip8_ticks(ch8) + frames;
+  uint64_t target = (ticks * ch8->cpu_hz + CHIP8_TIMER_HZ - 1) / CHIP8_TIMER_HZ;
+  if (target <= ch8->cycle) return 0;
+  return target - ch8->cycle > UINT32_MAX ? UINT32_MAX
+                                          : (uint32_t)(target - ch8->cycle);
+}
+
 status_t chip8_load_rom(chip8_t* ch8, const char* filepath) {
   FILE* fp = fopen(filepath, "rb");
   if (fp == NULL) {
@@ -54,11 +107,13 @@ status_t chip8_load_rom(chip8_t* ch8, const char* filepath) {
   rewind(fp);
 
   if (file_size > max_bytes_to_read) {
+    fclose(fp);
     return ERR;
   }
 
   size_t bytes_read =
       fread(&ch8->mem[CHIP8_PROGRAM_START_ADDRESS], 1, max_bytes_to_read, fp);
+  fclose(fp);
 
   if (bytes_read == 0) {
     return ERR;
@@ -67,234 +122,813 @@ status_t chip8_load_rom(chip8_t* ch8, const char* filepath) {
   return OK;
 }
 
-void chip8_run_instruction(chip8_t* ch8) {
-  uint16_t instruction = (ch8->mem[ch8->ip] << 8) | ch8->mem[ch8->ip + 1];
-
-  // TODO Do this at the appropriate speed
-  if (ch8->timer > 0) ch8->timer--;
-  if (ch8->tone_clock > 0) ch8->tone_clock--;
-
-  if ((instruction & 0xF000) == 0x1000) {
-    // 1MMM - Go to MMM
-    ch8->ip = 0x0FFF & instruction;
-  } else if ((instruction & 0xF000) == 0xB000) {
-    // BMMM - Go to MMM + V0
-    ch8->ip = (0x0FFF & instruction) + ch8->reg_v[0];
-  } else if ((instruction & 0xF000) == 0x2000) {
-    // 2MMM - Do subroutine at 0MMM (must end with 00EE)
-    ch8->stack[ch8->sp++] = ch8->ip + 2;
-    ch8->ip = 0x0FFF & instruction;
-  } else if (instruction == 0x00EE) {
-    // 00EE - Return from subroutine
-    ch8->ip = ch8->stack[--ch8->sp];
-  } else if ((instruction & 0xF000) == 0x3000) {
-    // 3XKK - Skip next instruction if VX == KK
-    uint8_t reg = (instruction >> 8) & 0x0F;
-    uint8_t val = instruction & 0xFF;
-    if (ch8->reg_v[reg] == val) {
-      ch8->ip += 4;
-    } else {
-      ch8->ip += 2;
-    }
-  } else if ((instruction & 0xF000) == 0x4000) {
-    // 4XKK - Skip next instruction if VX != KK
-    uint8_t reg = (instruction >> 8) & 0x0F;
-    uint8_t val = instruction & 0xFF;
-    if (ch8->reg_v[reg] != val) {
-      ch8->ip += 4;
-    } else {
-      ch8->ip += 2;
-    }
-  } else if ((instruction & 0xF00F) == 0x5000) {
-    // 5XY0 - Skip next instruction if VX == VY
-    uint8_t reg_x = (instruction >> 8) & 0x0F;
-    uint8_t reg_y = (instruction >> 4) & 0x0F;
-    if (ch8->reg_v[reg_x] == ch8->reg_v[reg_y]) {
-      ch8->ip += 4;
-    } else {
-      ch8->ip += 2;
-    }
-  } else if ((instruction & 0xF00F) == 0x9000) {
-    // 9XY0 - Skip next instruction if VX != VY
-    uint8_t reg_x = (instruction >> 8) & 0x0F;
-    uint8_t reg_y = (instruction >> 4) & 0x0F;
-    if (ch8->reg_v[reg_x] != ch8->reg_v[reg_y]) {
-      ch8->ip += 4;
-    } else {
-      ch8->ip += 2;
-    }
-  } else if ((instruction & 0xF0FF) == 0xE09E) {
-    // EX9E - Skip next instruction if VX == hexadecimal key (LSD)
-    uint8_t reg_x = (instruction >> 8) & 0x0F;
-    if (ch8->reg_v[reg_x] == ch8->keypress &&
-        ch8->keypress != CHIP8_NO_KEY_PRESSED) {
-      ch8->ip += 4;
-    } else {
-      ch8->ip += 2;
-    }
-  } else if ((instruction & 0xF0FF) == 0xE0A1) {
-    // EXA1 - Skip next instruction if VX != hexadecimal key (LSD)
-    uint8_t reg_x = (instruction >> 8) & 0x0F;
-    if (ch8->reg_v[reg_x] != ch8->keypress ||
-        ch8->keypress == CHIP8_NO_KEY_PRESSED) {
-      ch8->ip += 4;
-    } else {
-      ch8->ip += 2;
-    }
-  } else if ((instruction & 0xF000) == 0x6000) {
-    // 6XKK - Let VX = KK
-    uint8_t reg = (instruction >> 8) & 0x0F;
-    uint8_t val = instruction & 0xFF;
-    ch8->reg_v[reg] = val;
-    ch8->ip += 2;
-  } else if ((instruction & 0xF000) == 0xC000) {
-    // CXKK - Let VX = random byte (KK = mask)
-    uint8_t reg = (instruction >> 8) & 0x0F;
-    uint8_t mask = instruction & 0xFF;
-    ch8->reg_v[reg] = (rand() % 256) & mask;
-    ch8->ip += 2;
-  } else if ((instruction & 0xF000) == 0x7000) {
-    // 7XKK - Let VX = VX + KK
-    uint8_t reg = (instruction >> 8) & 0x0F;
-    uint8_t val = instruction & 0xFF;
-    ch8->reg_v[reg] += val;
-    ch8->ip += 2;
-  } else if ((instruction & 0xF00F) == 0x8000) {
-    // 8XY0 - Let VX = VY
-    uint8_t reg_x = (instruction >> 8) & 0x0F;
-    uint8_t reg_y = (instruction >> 4) & 0x0F;
-    ch8->reg_v[reg_x] = ch8->reg_v[reg_y];
-    ch8->ip += 2;
-  } else if ((instruction & 0xF00F) == 0x8001) {
-    // 8XY1 - Let VX = VX/VY (VF changed)
-    uint8_t reg_x = (instruction >> 8) & 0x0F;
-    uint8_t reg_y = (instruction >> 4) & 0x0F;
-    ch8->reg_v[reg_x] /= ch8->reg_v[reg_y];
-    ch8->ip += 2;
-  } else if ((instruction & 0xF00F) == 0x8002) {
-    // 8XY2 - Let VX = VX & VY (VF changed)
-    uint8_t reg_x = (instruction >> 8) & 0x0F;
-    uint8_t reg_y = (instruction >> 4) & 0x0F;
-    ch8->reg_v[reg_x] &= ch8->reg_v[reg_y];
-    ch8->ip += 2;
-  } else if ((instruction & 0xF00F) == 0x8004) {
-    // 8XY4 - Let VX = VX + VY (VF = 00 if VX + VY <= FF,
-    // VF == 01 if VX + VY > FF)
-    uint8_t reg_x = (instruction >> 8) & 0x0F;
-    uint8_t reg_y = (instruction >> 4) & 0x0F;
-    uint16_t val = ch8->reg_v[reg_x] + ch8->reg_v[reg_y];
-    ch8->reg_v[0x0F] = (val > 0xFF ? 1 : 0);
-    ch8->reg_v[reg_x] = (val & 0xFF);
-    ch8->ip += 2;
-  } else if ((instruction & 0xF00F) == 0x8005) {
-    // 8XY5 - Let VX = VX - VY (VF = 00 if VX < VY,
-    // VF == 01 if VX >= VY)
-    uint8_t reg_x = (instruction >> 8) & 0x0F;
-    uint8_t reg_y = (instruction >> 4) & 0x0F;
-    ch8->reg_v[0x0F] = (ch8->reg_v[reg_x] >= ch8->reg_v[reg_y] ? 1 : 0);
-    ch8->reg_v[reg_x] -= ch8->reg_v[reg_y];
-    ch8->ip += 2;
-  } else if ((instruction & 0xF0FF) == 0xF007) {
-    // FX07 - Let VX = current timer value
-    uint8_t reg_x = (instruction >> 8) & 0x0F;
-    ch8->reg_v[reg_x] = ch8->timer;
-    ch8->ip += 2;
-  } else if ((instruction & 0xF0FF) == 0xF00A) {
-    // FX0A - Let VX = hexadecimal key digit (waits for key press)
-    uint8_t reg_x = (instruction >> 8) & 0x0F;
-    if (ch8->keypress != CHIP8_NO_KEY_PRESSED) {
-      ch8->reg_v[reg_x] = ch8->keypress;
-      ch8->ip += 2;
+#ifdef CHIP8_PROFILE
+#define PROFILE_MAX_NODES 4096
+#define PROFILE_HOT_ADDRESSES 16
+
+// A function in the call tree, once for every path of calls leading to it.
+typedef struct profile_node {
+  uint16_t addr;     // where it starts, the program start for the root
+  uint16_t parent;
+  uint16_t child;    // first function it called, 0 for none
+  uint16_t sibling;  // next function its parent called
+  uint64_t calls;
+  uint64_t self;  // instructions run in it, not counting its callees
+} profile_node_t;
+
+static struct profile {
+  uint64_t instructions[0x10000];  // by instruction word
+  uint64_t addrs[CHIP8_MEMORY_SIZE];
+  uint64_t pixels;  // lit sprite pixels DXYN drew
+  profile_node_t nodes[PROFILE_MAX_NODES];
+  uint16_t node_count;
+  const chip8_t* machine;                   // whose calls at_depth follows
+  uint16_t at_depth[CHIP8_STACK_SIZE + 1];  // node running at each depth
+} profile = {
+    .node_count = 1,
+    .nodes[0] = {.addr = CHIP8_PROGRAM_START_ADDRESS},
+};
+
+// Opcode families as the histogram groups them, the first match winning.
+static const struct {
+  uint16_t mask;
+  uint16_t value;
+  const char* name;
+} families[] = {
+    {0xFFFF, 0x00E0, "00E0"}, {0xFFFF, 0x00EE, "00EE"},
+    {0xF000, 0x0000, "0MMM"}, {0xF000, 0x1000, "1MMM"},
+    {0xF000, 0x2000, "2MMM"}, {0xF000, 0x3000, "3XKK"},
+    {0xF000, 0x4000, "4XKK"}, {0xF00F, 0x5000, "5XY0"},
+    {0xF000, 0x6000, "6XKK"}, {0xF000, 0x7000, "7XKK"},
+    {0xF00F, 0x8000, "8XY0"}, {0xF00F, 0x8001, "8XY1"},
+    {0xF00F, 0x8002, "8XY2"}, {0xF00F, 0x8004, "8XY4"},
+    {0xF00F, 0x8005, "8XY5"}, {0xF00F, 0x9000, "9XY0"},
+    {0xF000, 0xA000, "AMMM"}, {0xF000, 0xB000, "BMMM"},
+    {0xF000, 0xC000, "CXKK"}, {0xF000, 0xD000, "DXYN"},
+    {0xF0FF, 0xE09E, "EX9E"}, {0xF0FF, 0xE0A1, "EXA1"},
+    {0xF0FF, 0xF007, "FX07"}, {0xF0FF, 0xF00A, "FX0A"},
+    {0xF0FF, 0xF015, "FX15"}, {0xF0FF, 0xF018, "FX18"},
+    {0xF0FF, 0xF01E, "FX1E"}, {0xF0FF, 0xF029, "FX29"},
+    {0xF0FF, 0xF033, "FX33"}, {0xF0FF, 0xF055, "FX55"},
+    {0xF0FF, 0xF065, "FX65"}, {0x0000, 0x0000, "illegal"},
+};
+#define FAMILY_COUNT (sizeof(families) / sizeof(families[0]))
+
+// The node for a call to addr from `parent`, added on the first one. Calls
+// past the last free node are counted against the caller.
+static uint16_t profile_callee(uint16_t parent, uint16_t addr) {
+  for (uint16_t node = profile.nodes[parent].child; node != 0;
+       node = profile.nodes[node].sibling) {
+    if (profile.nodes[node].addr == addr) return node;
+  }
+
+  uint16_t node = profile.node_count;
+  if (node >= PROFILE_MAX_NODES) return parent;
+  profile.node_count++;
+  profile.nodes[node] = (profile_node_t){
+      .addr = addr,
+      .parent = parent,
+      .sibling = profile.nodes[parent].child,
+  };
+  profile.nodes[parent].child = node;
+  return node;
+}
+
+// Pick up the calls a machine is in from its stack, each return address
+// following the 0MMM or 2MMM that pushed it.
+static void profile_follow(const chip8_t* ch8) {
+  profile.machine = ch8;
+  for (int depth = 1; depth <= ch8->sp; depth++) {
+    uint16_t call = ch8->stack[depth - 1] - 2;
+    uint16_t addr = call < CHIP8_MEMORY_SIZE - 1
+                        ? (ch8->mem[call] & 0x0F) << 8 | ch8->mem[call + 1]
+                        : 0;
+    profile.at_depth[depth] = profile_callee(profile.at_depth[depth - 1], addr);
+  }
+}
+
+void chip8_profile_forget(const chip8_t* ch8) {
+  if (profile.machine == ch8) profile.machine = NULL;
+}
+
+// Count the instruction at ip before it runs, then follow it into a call
+// once it has, given sp as it was before.
+static inline void profile_before(const chip8_t* ch8, uint16_t instruction) {
+  if (ch8 != profile.machine) profile_follow(ch8);
+  profile.instructions[instruction]++;
+  profile.addrs[ch8->ip]++;
+  profile.nodes[profile.at_depth[ch8->sp]].self++;
+}
+
+static inline void profile_after(const chip8_t* ch8, uint8_t sp) {
+  // Both 0MMM and 2MMM push, and nothing else grows the stack.
+  if (ch8->sp == sp + 1) {
+    uint16_t node = profile_callee(profile.at_depth[sp], ch8->ip);
+    profile.nodes[node].calls++;
+    profile.at_depth[ch8->sp] = node;
+  }
+}
+
+static int profile_family(uint16_t instruction) {
+  int family = 0;
+  while ((instruction & families[family].mask) != families[family].value) {
+    family++;
+  }
+  return family;
+}
+
+// Instructions run in each node and everything it called. Callees always
+// come after their caller, so one pass backwards adds them all up.
+static void profile_inclusive(uint64_t* inclusive) {
+  for (int node = profile.node_count - 1; node >= 0; node--) {
+    inclusive[node] += profile.nodes[node].self;
+    if (node > 0) inclusive[profile.nodes[node].parent] += inclusive[node];
+  }
+}
+
+void chip8_profile_report(FILE* out) {
+  uint64_t counts[FAMILY_COUNT] = {0};
+  uint64_t total = 0;
+
+  for (uint32_t instruction = 0; instruction < 0x10000; instruction++) {
+    if (profile.instructions[instruction] == 0) continue;
+    counts[profile_family(instruction)] += profile.instructions[instruction];
+    total += profile.instructions[instruction];
+  }
+  if (total == 0) return;
+
+  fprintf(out, "Profile: %llu instructions, %llu sprite pixels drawn\n",
+          (unsigned long long)total, (unsigned long long)profile.pixels);
+  fprintf(out, "  opcode  count          share\n");
+  for (size_t family = 0; family < FAMILY_COUNT; family++) {
+    if (counts[family] == 0) continue;
+    fprintf(out, "  %-7s %-14llu %5.1f%%\n", families[family].name,
+            (unsigned long long)counts[family], 100.0 * counts[family] / total);
+  }
+
+  // Hottest addresses first, picked one at a time.
+  static bool shown[CHIP8_MEMORY_SIZE];
+  memset(shown, 0, sizeof(shown));
+  fprintf(out, "  address count          share\n");
+  for (int i = 0; i < PROFILE_HOT_ADDRESSES; i++) {
+    int hottest = -1;
+    for (int addr = 0; addr < CHIP8_MEMORY_SIZE; addr++) {
+      if (!shown[addr] && profile.addrs[addr] > 0 &&
+          (hottest < 0 || profile.addrs[addr] > profile.addrs[hottest])) {
+        hottest = addr;
+      }
     }
-  } else if ((instruction & 0xF0FF) == 0xF015) {
-    // FX15 - Set timer = VX (01 = 1/60 second)
-    uint8_t reg = (instruction >> 8) & 0x0F;
-    ch8->timer = ch8->reg_v[reg];
+    if (hottest < 0) break;
+    shown[hottest] = true;
+    fprintf(out, "  0x%03X   %-14llu %5.1f%%\n", hottest,
+            (unsigned long long)profile.addrs[hottest],
+            100.0 * profile.addrs[hottest] / total);
+  }
+
+  static uint64_t inclusive[PROFILE_MAX_NODES];
+  memset(inclusive, 0, sizeof(inclusive));
+  profile_inclusive(inclusive);
+  if (profile.node_count > 1) {
+    fprintf(out, "  call           calls      inclusive      exclusive\n");
+  }
+  for (int node = 1; node < profile.node_count; node++) {
+    const profile_node_t* callee = &profile.nodes[node];
+    fprintf(out, "  0x%03X -> 0x%03X %-10llu %-14llu %llu\n",
+            profile.nodes[callee->parent].addr, callee->addr,
+            (unsigned long long)callee->calls,
+            (unsigned long long)inclusive[node],
+            (unsigned long long)callee->self);
+  }
+}
+
+static void write_stack(FILE* out, uint16_t node) {
+  if (node != 0) {
+    write_stack(out, profile.nodes[node].parent);
+    fputc(';', out);
+  }
+  fprintf(out, "0x%03X", profile.nodes[node].addr);
+}
+
+status_t chip8_profile_write_folded(const char* path) {
+  FILE* out = fopen(path, "w");
+  if (out == NULL) return ERR;
+
+  for (int node = 0; node < profile.node_count; node++) {
+    if (profile.nodes[node].self == 0) continue;
+    write_stack(out, node);
+    fprintf(out, " %llu\n", (unsigned long long)profile.nodes[node].self);
+  }
+
+  return fclose(out) == 0 ? OK : ERR;
+}
+#endif
+
+static void op_unknown(chip8_t* ch8, const chip8_op_t* op) {
+  (void)op;
+  ch8->event = CHIP8_STOP_ILLEGAL;
+}
+
+static bool push(chip8_t* ch8, uint16_t addr) {
+  if (ch8->sp >= CHIP8_STACK_SIZE) {
+    ch8->event = CHIP8_STOP_STACK_FAULT;
+    return false;
+  }
+  ch8->stack[ch8->sp++] = addr;
+  return true;
+}
+
+// Check that the `len` bytes at I are inside memory before touching them.
+static bool check_i(chip8_t* ch8, uint16_t len) {
+  if (ch8->reg_i + len > CHIP8_MEMORY_SIZE) {
+    ch8->event = CHIP8_STOP_ILLEGAL;
+    return false;
+  }
+  return true;
+}
+
+static void op_0mmm(chip8_t* ch8, const chip8_op_t* op) {
+  // 0MMM - Do machine language subroutine at 0MMM (subroutine must end with
+  // D4 byte)
+  if (!push(ch8, ch8->ip + 2)) return;
+  ch8->ip = CHIP8_OP_NNN(op);
+}
+
+static void op_00e0(chip8_t* ch8, const chip8_op_t* op) {
+  // 00E0 - Erase display (all 0s)
+  (void)op;
+  for (int y = 0; y < CHIP8_FRAMEBUFFER_Y_LEN; y++) {
+    if (ch8->framebuffer[y]) ch8->dirty_rows |= 1u << y;
+  }
+  memset(ch8->framebuffer, 0, CHIP8_FRAMEBUFFER_SIZE);
+  ch8->event = CHIP8_STOP_FRAME;
+  ch8->ip += 2;
+}
+
+static void op_00ee(chip8_t* ch8, const chip8_op_t* op) {
+  // 00EE - Return from subroutine
+  (void)op;
+  if (ch8->sp == 0) {
+    ch8->event = CHIP8_STOP_STACK_FAULT;
+    return;
+  }
+  ch8->ip = ch8->stack[--ch8->sp];
+}
+
+static bool closes_idle_loop(const chip8_t* ch8, uint16_t addr,
+                             uint16_t target);
+
+static void op_1mmm(chip8_t* ch8, const chip8_op_t* op) {
+  // 1MMM - Go to MMM
+  uint16_t from = ch8->ip;
+  ch8->ip = CHIP8_OP_NNN(op);
+  if (closes_idle_loop(ch8, from, ch8->ip) &&
+      chip8_idle(ch8) != CHIP8_IDLE_NONE) {
+    ch8->event = CHIP8_STOP_IDLE;
+  }
+}
+
+static void op_2mmm(chip8_t* ch8, const chip8_op_t* op) {
+  // 2MMM - Do subroutine at 0MMM (must end with 00EE)
+  if (!push(ch8, ch8->ip + 2)) return;
+  ch8->ip = CHIP8_OP_NNN(op);
+}
+
+static void op_3xkk(chip8_t* ch8, const chip8_op_t* op) {
+  // 3XKK - Skip next instruction if VX == KK
+  uint8_t reg = op->x;
+  uint8_t val = op->kk;
+  if (ch8->reg_v[reg] == val) {
+    ch8->ip += 4;
+  } else {
     ch8->ip += 2;
-  } else if ((instruction & 0xF0FF) == 0xF018) {
-    // FX18 - Set tone duration = VX (01 = 1/60 second)
-    uint8_t reg = (instruction >> 8) & 0x0F;
-    ch8->tone_clock = ch8->reg_v[reg];
+  }
+}
+
+static void op_4xkk(chip8_t* ch8, const chip8_op_t* op) {
+  // 4XKK - Skip next instruction if VX != KK
+  uint8_t reg = op->x;
+  uint8_t val = op->kk;
+  if (ch8->reg_v[reg] != val) {
+    ch8->ip += 4;
+  } else {
     ch8->ip += 2;
-  } else if ((instruction & 0xF000) == 0xA000) {
-    // AMMM - Set I = 0MMM
-    ch8->reg_i = instruction & 0x0FFF;
+  }
+}
+
+static void op_5xy0(chip8_t* ch8, const chip8_op_t* op) {
+  // 5XY0 - Skip next instruction if VX == VY
+  if (op->n != 0) {
+    op_unknown(ch8, op);
+    return;
+  }
+  uint8_t reg_x = op->x;
+  uint8_t reg_y = op->y;
+  if (ch8->reg_v[reg_x] == ch8->reg_v[reg_y]) {
+    ch8->ip += 4;
+  } else {
     ch8->ip += 2;
-  } else if ((instruction & 0xF0FF) == 0xF01E) {
-    // FX1E - Let I = I + VX
-    uint8_t reg = (instruction >> 8) & 0x0F;
-    ch8->reg_i += ch8->reg_v[reg];
+  }
+}
+
+static void op_6xkk(chip8_t* ch8, const chip8_op_t* op) {
+  // 6XKK - Let VX = KK
+  uint8_t reg = op->x;
+  uint8_t val = op->kk;
+  ch8->reg_v[reg] = val;
+  ch8->ip += 2;
+}
+
+static void op_7xkk(chip8_t* ch8, const chip8_op_t* op) {
+  // 7XKK - Let VX = VX + KK
+  uint8_t reg = op->x;
+  uint8_t val = op->kk;
+  ch8->reg_v[reg] += val;
+  ch8->ip += 2;
+}
+
+static void op_8xy0(chip8_t* ch8, const chip8_op_t* op) {
+  // 8XY0 - Let VX = VY
+  uint8_t reg_x = op->x;
+  uint8_t reg_y = op->y;
+  ch8->reg_v[reg_x] = ch8->reg_v[reg_y];
+  ch8->ip += 2;
+}
+
+static void op_8xy1(chip8_t* ch8, const chip8_op_t* op) {
+  // 8XY1 - Let VX = VX/VY (VF changed), where / is the manual's OR
+  uint8_t reg_x = op->x;
+  uint8_t reg_y = op->y;
+  ch8->reg_v[reg_x] |= ch8->reg_v[reg_y];
+  ch8->ip += 2;
+}
+
+static void op_8xy2(chip8_t* ch8, const chip8_op_t* op) {
+  // 8XY2 - Let VX = VX & VY (VF changed)
+  uint8_t reg_x = op->x;
+  uint8_t reg_y = op->y;
+  ch8->reg_v[reg_x] &= ch8->reg_v[reg_y];
+  ch8->ip += 2;
+}
+
+static void op_8xy4(chip8_t* ch8, const chip8_op_t* op) {
+  // 8XY4 - Let VX = VX + VY (VF = 00 if VX + VY <= FF,
+  // VF == 01 if VX + VY > FF)
+  uint8_t reg_x = op->x;
+  uint8_t reg_y = op->y;
+  uint16_t val = ch8->reg_v[reg_x] + ch8->reg_v[reg_y];
+  ch8->reg_v[0x0F] = (val > 0xFF ? 1 : 0);
+  ch8->reg_v[reg_x] = (val & 0xFF);
+  ch8->ip += 2;
+}
+
+static void op_8xy5(chip8_t* ch8, const chip8_op_t* op) {
+  // 8XY5 - Let VX = VX - VY (VF = 00 if VX < VY,
+  // VF == 01 if VX >= VY)
+  uint8_t reg_x = op->x;
+  uint8_t reg_y = op->y;
+  ch8->reg_v[0x0F] = (ch8->reg_v[reg_x] >= ch8->reg_v[reg_y] ? 1 : 0);
+  ch8->reg_v[reg_x] -= ch8->reg_v[reg_y];
+  ch8->ip += 2;
+}
+
+static void op_9xy0(chip8_t* ch8, const chip8_op_t* op) {
+  // 9XY0 - Skip next instruction if VX != VY
+  if (op->n != 0) {
+    op_unknown(ch8, op);
+    return;
+  }
+  uint8_t reg_x = op->x;
+  uint8_t reg_y = op->y;
+  if (ch8->reg_v[reg_x] != ch8->reg_v[reg_y]) {
+    ch8->ip += 4;
+  } else {
     ch8->ip += 2;
-  } else if ((instruction & 0xF0FF) == 0xF029) {
-    // FX29 - Let I = 5 byte display pattern for LSD of VX
-    uint8_t reg = (instruction >> 8) & 0x0F;
-    uint8_t n = ch8->reg_v[reg] & 0x0F;
-    ch8->reg_i = CHIP8_DIGITS_START_ADDRESS + (n * 5);
+  }
+}
+
+static void op_ammm(chip8_t* ch8, const chip8_op_t* op) {
+  // AMMM - Set I = 0MMM
+  ch8->reg_i = CHIP8_OP_NNN(op);
+  ch8->ip += 2;
+}
+
+static void op_bmmm(chip8_t* ch8, const chip8_op_t* op) {
+  // BMMM - Go to MMM + V0
+  ch8->ip = (CHIP8_OP_NNN(op)) + ch8->reg_v[0];
+}
+
+static void op_cxkk(chip8_t* ch8, const chip8_op_t* op) {
+  // CXKK - Let VX = random byte (KK = mask)
+  uint8_t reg = op->x;
+  uint8_t mask = op->kk;
+  ch8->reg_v[reg] = chip8_random(&ch8->rng) & mask;
+  ch8->ip += 2;
+}
+
+bool chip8_draw(chip8_t* ch8, uint8_t x, uint8_t y, const uint8_t* sprite,
+                uint8_t n) {
+  x %= CHIP8_FRAMEBUFFER_X_LEN;
+  y %= CHIP8_FRAMEBUFFER_Y_LEN;
+  if (n > CHIP8_FRAMEBUFFER_Y_LEN - y) n = CHIP8_FRAMEBUFFER_Y_LEN - y;
+
+  uint64_t* rows = &ch8->framebuffer[y];
+  uint64_t hits = 0;
+  int i = 0;
+
+  // Every row the sprite covers, even ones it leaves as they were.
+  ch8->dirty_rows |= (uint32_t)((((uint64_t)1 << n) - 1) << y);
+
+#if defined(__SSE2__)
+  // Two rows at a time. The shift drops pixels past the right edge.
+  __m128i shift = _mm_cvtsi32_si128(x);
+  __m128i collided = _mm_setzero_si128();
+  for (; i + 2 <= n; i += 2) {
+    __m128i pixels = _mm_srl_epi64(
+        _mm_set_epi64x((int64_t)((uint64_t)sprite[i + 1] << 56),
+                       (int64_t)((uint64_t)sprite[i] << 56)),
+        shift);
+    __m128i row = _mm_loadu_si128((const __m128i*)&rows[i]);
+    collided = _mm_or_si128(collided, _mm_and_si128(row, pixels));
+    _mm_storeu_si128((__m128i*)&rows[i], _mm_xor_si128(row, pixels));
+  }
+  hits = _mm_movemask_epi8(_mm_cmpeq_epi8(collided, _mm_setzero_si128())) !=
+         0xFFFF;
+#endif
+
+  for (; i < n; i++) {
+    uint64_t pixels = ((uint64_t)sprite[i] << 56) >> x;
+    hits |= rows[i] & pixels;
+    rows[i] ^= pixels;
+  }
+
+  return hits != 0;
+}
+
+static void op_dxyn(chip8_t* ch8, const chip8_op_t* op) {
+  // DXYN - Show n byte MI pattern at VX - VY coordinates.
+  // I unchanged. MI pattern is combined with existing display via
+  // exclusive-OR function. VF = 01 if a 1 in MI pattern matches 1 in existing
+  // display.
+  uint8_t x = ch8->reg_v[op->x];
+  uint8_t y = ch8->reg_v[op->y];
+
+  if (!check_i(ch8, op->n)) return;
+
+#ifdef CHIP8_PROFILE
+  for (int i = 0; i < op->n; i++) {
+    profile.pixels += __builtin_popcount(ch8->mem[ch8->reg_i + i]);
+  }
+#endif
+  ch8->reg_v[15] = chip8_draw(ch8, x, y, &ch8->mem[ch8->reg_i], op->n);
+  ch8->event = CHIP8_STOP_FRAME;
+  ch8->ip += 2;
+}
+
+static void op_ex9e(chip8_t* ch8, const chip8_op_t* op) {
+  // EX9E - Skip next instruction if VX == hexadecimal key (LSD)
+  uint8_t reg_x = op->x;
+  if (chip8_key_held(ch8, ch8->reg_v[reg_x])) {
+    ch8->ip += 4;
+  } else {
     ch8->ip += 2;
-  } else if ((instruction & 0xF0FF) == 0xF033) {
-    // FX33 - Let MI = 3 decimal digit equivalent of VX (I unchanged)
-    uint8_t reg = (instruction >> 8) & 0x0F;
-    ch8->mem[ch8->reg_i] = ch8->reg_v[reg] / 100 % 10;
-    ch8->mem[ch8->reg_i + 1] = ch8->reg_v[reg] / 10 % 10;
-    ch8->mem[ch8->reg_i + 2] = ch8->reg_v[reg] % 10;
+  }
+}
+
+static void op_exa1(chip8_t* ch8, const chip8_op_t* op) {
+  // EXA1 - Skip next instruction if VX != hexadecimal key (LSD)
+  uint8_t reg_x = op->x;
+  if (!chip8_key_held(ch8, ch8->reg_v[reg_x])) {
+    ch8->ip += 4;
+  } else {
     ch8->ip += 2;
-  } else if ((instruction & 0xF0FF) == 0xF055) {
-    // FX55 - Let MI = V0 : VX (I = I + X + 1)
-    uint8_t reg_x = (instruction >> 8) & 0x0F;
-    for (int i = 0; i <= reg_x; i++) {
-      ch8->mem[ch8->reg_i++] = ch8->reg_v[i];
-    }
+  }
+}
+
+static void op_fx07(chip8_t* ch8, const chip8_op_t* op) {
+  // FX07 - Let VX = current timer value
+  uint8_t reg_x = op->x;
+  ch8->reg_v[reg_x] = chip8_timer(ch8);
+  ch8->ip += 2;
+}
+
+static void op_fx0a(chip8_t* ch8, const chip8_op_t* op) {
+  // FX0A - Let VX = hexadecimal key digit (waits for key press)
+  // With several keys down, the lowest one wins.
+  uint8_t reg_x = op->x;
+  if (ch8->keys) {
+    ch8->reg_v[reg_x] = __builtin_ctz(ch8->keys);
     ch8->ip += 2;
-  } else if ((instruction & 0xF0FF) == 0xF065) {
-    // FX65 - Let V0 : VX = MI (I = I + X + 1)
-    uint8_t reg_x = (instruction >> 8) & 0x0F;
-    for (int i = 0; i <= reg_x; i++) {
-      ch8->reg_v[i] = ch8->mem[ch8->reg_i++];
+  } else {
+    ch8->event = CHIP8_STOP_WAIT_KEY;
+  }
+}
+
+static void op_fx15(chip8_t* ch8, const chip8_op_t* op) {
+  // FX15 - Set timer = VX (01 = 1/60 second)
+  uint8_t reg = op->x;
+  ch8->timer = ch8->reg_v[reg];
+  ch8->timer_tick = chip8_ticks(ch8);
+  ch8->ip += 2;
+}
+
+static void op_fx18(chip8_t* ch8, const chip8_op_t* op) {
+  // FX18 - Set tone duration = VX (01 = 1/60 second)
+  uint8_t reg = op->x;
+  ch8->tone_clock = ch8->reg_v[reg];
+  ch8->tone_tick = chip8_ticks(ch8);
+  ch8->ip += 2;
+}
+
+static void op_fx1e(chip8_t* ch8, const chip8_op_t* op) {
+  // FX1E - Let I = I + VX
+  uint8_t reg = op->x;
+  ch8->reg_i += ch8->reg_v[reg];
+  ch8->ip += 2;
+}
+
+static void op_fx29(chip8_t* ch8, const chip8_op_t* op) {
+  // FX29 - Let I = 5 byte display pattern for LSD of VX
+  uint8_t reg = op->x;
+  uint8_t n = ch8->reg_v[reg] & 0x0F;
+  ch8->reg_i = CHIP8_DIGITS_START_ADDRESS + (n * 5);
+  ch8->ip += 2;
+}
+
+static void op_fx33(chip8_t* ch8, const chip8_op_t* op) {
+  // FX33 - Let MI = 3 decimal digit equivalent of VX (I unchanged)
+  uint8_t reg = op->x;
+  if (!check_i(ch8, 3)) return;
+  ch8->mem[ch8->reg_i] = ch8->reg_v[reg] / 100 % 10;
+  ch8->mem[ch8->reg_i + 1] = ch8->reg_v[reg] / 10 % 10;
+  ch8->mem[ch8->reg_i + 2] = ch8->reg_v[reg] % 10;
+  ch8->ip += 2;
+}
+
+static void op_fx55(chip8_t* ch8, const chip8_op_t* op) {
+  // FX55 - Let MI = V0 : VX (I = I + X + 1)
+  uint8_t reg_x = op->x;
+  if (!check_i(ch8, reg_x + 1)) return;
+  for (int i = 0; i <= reg_x; i++) {
+    ch8->mem[ch8->reg_i++] = ch8->reg_v[i];
+  }
+  ch8->ip += 2;
+}
+
+static void op_fx65(chip8_t* ch8, const chip8_op_t* op) {
+  // FX65 - Let V0 : VX = MI (I = I + X + 1)
+  uint8_t reg_x = op->x;
+  if (!check_i(ch8, reg_x + 1)) return;
+  for (int i = 0; i <= reg_x; i++) {
+    ch8->reg_v[i] = ch8->mem[ch8->reg_i++];
+  }
+  ch8->ip += 2;
+}
+
+// 8XYN - arithmetic family, keyed on N.
+static const chip8_handler_t ops_8xyn[16] = {
+  [0x0] = op_8xy0,
+  [0x1] = op_8xy1,
+  [0x2] = op_8xy2,
+  [0x4] = op_8xy4,
+  [0x5] = op_8xy5,
+};
+
+// EXKK - keyboard family, keyed on KK.
+static const chip8_handler_t ops_exkk[256] = {
+  [0x9E] = op_ex9e,
+  [0xA1] = op_exa1,
+};
+
+// FXKK - timer/memory family, keyed on KK.
+static const chip8_handler_t ops_fxkk[256] = {
+  [0x07] = op_fx07,
+  [0x0A] = op_fx0a,
+  [0x15] = op_fx15,
+  [0x18] = op_fx18,
+  [0x1E] = op_fx1e,
+  [0x29] = op_fx29,
+  [0x33] = op_fx33,
+  [0x55] = op_fx55,
+  [0x65] = op_fx65,
+};
+
+static void op_0_family(chip8_t* ch8, const chip8_op_t* op) {
+  switch (op->instruction) {
+    case 0x00E0:
+      op_00e0(ch8, op);
+      break;
+    case 0x00EE:
+      op_00ee(ch8, op);
+      break;
+    default:
+      op_0mmm(ch8, op);
+      break;
+  }
+}
+
+static void op_8_family(chip8_t* ch8, const chip8_op_t* op) {
+  chip8_handler_t handler = ops_8xyn[op->n];
+  (handler ? handler : op_unknown)(ch8, op);
+}
+
+static void op_e_family(chip8_t* ch8, const chip8_op_t* op) {
+  chip8_handler_t handler = ops_exkk[op->kk];
+  (handler ? handler : op_unknown)(ch8, op);
+}
+
+static void op_f_family(chip8_t* ch8, const chip8_op_t* op) {
+  chip8_handler_t handler = ops_fxkk[op->kk];
+  (handler ? handler : op_unknown)(ch8, op);
+}
+
+// Top-level dispatch, keyed on the most significant nibble.
+static const chip8_handler_t ops[16] = {
+  op_0_family, op_1mmm, op_2mmm, op_3xkk, op_4xkk, op_5xy0,
+  op_6xkk,     op_7xkk, op_8_family, op_9xy0, op_ammm, op_bmmm,
+  op_cxkk,     op_dxyn, op_e_family, op_f_family,
+};
+
+static void extract_operands(uint16_t instruction, chip8_op_t* op) {
+  op->instruction = instruction;
+  op->x = (instruction >> 8) & 0x0F;
+  op->y = (instruction >> 4) & 0x0F;
+  op->kk = instruction & 0xFF;
+  op->n = instruction & 0x0F;
+}
+
+// Resolve the leaf handler directly, so cached ops skip the family step.
+static chip8_handler_t lookup_handler(uint16_t instruction) {
+  switch (instruction >> 12) {
+    case 0x0:
+      if (instruction == 0x00E0) return op_00e0;
+      if (instruction == 0x00EE) return op_00ee;
+      return op_0mmm;
+    case 0x8:
+      return ops_8xyn[instruction & 0x0F];
+    case 0xE:
+      return ops_exkk[instruction & 0xFF];
+    case 0xF:
+      return ops_fxkk[instruction & 0xFF];
+    default:
+      return ops[instruction >> 12];
+  }
+}
+
+void chip8_decode(uint16_t instruction, chip8_op_t* op) {
+  chip8_handler_t handler = lookup_handler(instruction);
+
+  extract_operands(instruction, op);
+  op->handler = handler ? handler : op_unknown;
+  op->fused = 0xFF;  // not yet examined for fusion
+
+  if (handler == op_fx33) {
+    op->writes = 3;
+  } else if (handler == op_fx55) {
+    op->writes = op->x + 1;
+  } else {
+    op->writes = 0;
+  }
+}
+
+static uint16_t fetch(const chip8_t* ch8, uint16_t addr) {
+  return (ch8->mem[addr] << 8) | ch8->mem[addr + 1];
+}
+
+// The idle loop starting at addr, judged from the code alone.
+static chip8_idle_t idle_loop(const chip8_t* ch8, uint16_t addr) {
+  if (addr >= CHIP8_MEMORY_SIZE - 1) return CHIP8_IDLE_NONE;
+
+  uint16_t first = fetch(ch8, addr);
+  if (first == (0x1000 | addr)) return CHIP8_IDLE_FOREVER;
+  if ((first & 0xF0FF) == 0xF00A) return CHIP8_IDLE_KEY;
+  if ((first & 0xF0FF) == 0xF007 && addr < CHIP8_MEMORY_SIZE - 5 &&
+      fetch(ch8, addr + 2) == (0x3000 | (first & 0x0F00)) &&
+      fetch(ch8, addr + 4) == (0x1000 | addr)) {
+    return CHIP8_IDLE_TIMER;
+  }
+  return CHIP8_IDLE_NONE;
+}
+
+static bool closes_idle_loop(const chip8_t* ch8, uint16_t addr,
+                             uint16_t target) {
+  if (target != addr && target + 4 != addr) return false;
+  chip8_idle_t loop = idle_loop(ch8, target);
+  return loop == CHIP8_IDLE_FOREVER || loop == CHIP8_IDLE_TIMER;
+}
+
+bool chip8_idle_jump(const chip8_t* ch8, uint16_t addr) {
+  if (addr >= CHIP8_MEMORY_SIZE - 1) return false;
+  uint16_t instruction = fetch(ch8, addr);
+  return (instruction & 0xF000) == 0x1000 &&
+         closes_idle_loop(ch8, addr, instruction & 0x0FFF);
+}
+
+chip8_idle_t chip8_idle(const chip8_t* ch8) {
+  chip8_idle_t loop = idle_loop(ch8, ch8->ip);
+  if (loop == CHIP8_IDLE_KEY && ch8->keys) {
+    return CHIP8_IDLE_NONE;
+  }
+  if (loop == CHIP8_IDLE_TIMER && chip8_timer(ch8) == 0) {
+    return CHIP8_IDLE_NONE;
+  }
+  return loop;
+}
+
+uint32_t chip8_fast_forward(chip8_t* ch8, uint32_t budget) {
+  switch (chip8_idle(ch8)) {
+    case CHIP8_IDLE_KEY:
+    case CHIP8_IDLE_FOREVER:
+      chip8_tick(ch8, budget);
+      return budget;
+    case CHIP8_IDLE_TIMER: {
+      // Each iteration is 3 cycles, and its FX07 reads the timer on the
+      // first. Skip those that would still read a non-zero value.
+      uint64_t until_zero = chip8_frame_cycles(ch8, chip8_timer(ch8));
+      uint64_t iterations = (until_zero + 1) / 3;
+      if (iterations > budget / 3) iterations = budget / 3;
+      if (iterations == 0) return 0;
+
+      chip8_tick(ch8, 3 * (iterations - 1) + 1);
+      ch8->reg_v[ch8->mem[ch8->ip] & 0x0F] = chip8_timer(ch8);
+      chip8_tick(ch8, 2);
+      return 3 * iterations;
     }
-    ch8->ip += 2;
-  } else if (instruction == 0x00E0) {
-    // 00E0 - Erase display (all 0s)
-    memset(&ch8->framebuffer, 0, CHIP8_FRAMEBUFFER_SIZE);
-    ch8->ip += 2;
-  } else if ((instruction & 0xF000) == 0xD000) {
-    // DXYN - Show n byte MI pattern at VX - VY coordinates.
-    // I unchanged. MI pattern is combined with existing display via
-    // exclusive-OR function. VF = 01 if a 1 in MI pattern matches 1 in existing
-    // display.
-    uint8_t reg_x = (instruction >> 8) & 0x0F;
-    uint8_t reg_y = (instruction >> 4) & 0x0F;
-    uint8_t n = instruction & 0x0F;
-    uint8_t x = ch8->reg_v[reg_x];
-    uint8_t y = ch8->reg_v[reg_y];
-
-    // Clear hit flag
-    ch8->reg_v[15] = 0;
-
-    for (int i = 0; i < n; i++) {
-      uint8_t byte_pattern = ch8->mem[ch8->reg_i + i];
-      uint8_t fb_idx = (x + ((y + i) * CHIP8_FRAMEBUFFER_X_LEN)) / 8;
-      uint8_t bit_idx = (x + ((y + i) * CHIP8_FRAMEBUFFER_X_LEN)) % 8;
-      uint8_t hit = ch8->framebuffer[fb_idx] & (byte_pattern >> bit_idx);
-      ch8->framebuffer[fb_idx] ^= (byte_pattern >> bit_idx);
-
-      if (bit_idx > 0) {
-        fb_idx += 1;
-        bit_idx = 8 - bit_idx;
-        hit |= ch8->framebuffer[fb_idx] & ((byte_pattern << bit_idx) & 0xFF);
-        ch8->framebuffer[fb_idx] ^= ((byte_pattern << bit_idx) & 0xFF);
-      }
+    default:
+      return 0;
+  }
+}
 
-      if (hit) ch8->reg_v[15] = 1;
+void chip8_code_report(const chip8_t* ch8, FILE* out) {
+  for (int i = -2; i < 6; i++) {
+    uint16_t addr = ch8->ip + i * 2;
+    fprintf(out, "%s %04X:", i == 0 ? ">" : " ", addr);
+    if (addr < CHIP8_MEMORY_SIZE - 1) fprintf(out, " %04X", fetch(ch8, addr));
+    fprintf(out, "\r\n");
+  }
+}
+
+static inline void step(chip8_t* ch8) {
+  if (ch8->ip >= CHIP8_MEMORY_SIZE - 1) {
+    chip8_tick(ch8, 1);
+    ch8->event = CHIP8_STOP_ILLEGAL;
+    return;
+  }
+
+  uint16_t instruction = fetch(ch8, ch8->ip);
+  chip8_op_t op;
+
+  extract_operands(instruction, &op);
+  chip8_tick(ch8, 1);
+#ifdef CHIP8_PROFILE
+  uint8_t sp = ch8->sp;
+  profile_before(ch8, instruction);
+  ops[instruction >> 12](ch8, &op);
+  profile_after(ch8, sp);
+#else
+  ops[instruction >> 12](ch8, &op);
+#endif
+}
+
+chip8_stop_t chip8_run_instruction(chip8_t* ch8) {
+  ch8->event = CHIP8_STOP_BUDGET;
+  step(ch8);
+  return ch8->event;
+}
+
+chip8_stop_t chip8_run_cycles(chip8_t* ch8, uint32_t budget,
+                              uint32_t* cycles_run) {
+  uint32_t ran = 0;
+
+  ch8->event = CHIP8_STOP_BUDGET;
+  while (ran < budget) {
+    step(ch8);
+    ran++;
+    if (ch8->event != CHIP8_STOP_BUDGET) break;
+  }
+
+  if (cycles_run) *cycles_run = ran;
+  return ch8->event;
+}
+
+chip8_stop_t chip8_run_frames(chip8_t* ch8, uint32_t frames,
+                              uint32_t* cycles_run) {
+  uint32_t budget = chip8_frame_cycles(ch8, frames);
+  uint32_t total = 0;
+  chip8_stop_t stop = CHIP8_STOP_BUDGET;
+
+  while (total < budget) {
+    uint32_t ran;
+    stop = chip8_run_cycles(ch8, budget - total, &ran);
+    total += ran;
+    if (stop == CHIP8_STOP_IDLE || stop == CHIP8_STOP_WAIT_KEY) {
+      total += chip8_fast_forward(ch8, budget - total);
     }
+    if (stop != CHIP8_STOP_FRAME && stop != CHIP8_STOP_IDLE) break;
+  }
 
-    ch8->ip += 2;
-  } else if ((instruction & 0xF000) == 0x0000) {
-    // 0MMM - Do machine language subroutine at 0MMM (subroutine must end with
-    // D4 byte)
-    ch8->stack[ch8->sp++] = ch8->ip + 2;
-    ch8->ip = 0x0FFF & instruction;
-  } else {
-    printf("Error: unknown instruction: %04x\r\n", instruction);
-    exit(1);
+  if (cycles_run) *cycles_run = total;
+  if (stop == CHIP8_STOP_FRAME || stop == CHIP8_STOP_IDLE) {
+    return CHIP8_STOP_BUDGET;
   }
+  return stop;
 }
@@ -1,45 +1,246 @@
 #ifndef __CHIP8_H__
 #define __CHIP8_H__
 
+#include <stdalign.h>
+#include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #define CHIP8_REGISTER_COUNT 16
 #define CHIP8_MEMORY_SIZE 4096
 #define CHIP8_PROGRAM_START_ADDRESS 0x0200
-#define CHIP8_STACK_SIZE 256
+// Calls that may be nested, 16 as on most interpreters since the HP48 ones.
+// Builds can set it anywhere from 1 to 255, sp being a byte.
+#ifndef CHIP8_STACK_SIZE
+#define CHIP8_STACK_SIZE 16
+#endif
 #define CHIP8_FRAMEBUFFER_X_LEN 64
 #define CHIP8_FRAMEBUFFER_Y_LEN 32
 #define CHIP8_FRAMEBUFFER_MAX_X 0x3F
 #define CHIP8_FRAMEBUFFER_MAX_Y 0x1F
 #define CHIP8_FRAMEBUFFER_SIZE \
   ((CHIP8_FRAMEBUFFER_X_LEN * CHIP8_FRAMEBUFFER_Y_LEN) / 8)
+#define CHIP8_FRAMEBUFFER_ALL_ROWS 0xFFFFFFFFu  // one dirty bit per row
 #define CHIP8_DIGITS_START_ADDRESS 0x0000
 
-#define CHIP8_NO_KEY_PRESSED 0xAF
+#define CHIP8_KEY_COUNT 16
+
+#define CHIP8_DEFAULT_CPU_HZ 600
+#define CHIP8_DEFAULT_SEED 0x2545F491
+#define CHIP8_TIMER_HZ 60
+
+#define CHIP8_CACHE_LINE 64
+// The size budget of chip8_t: 64 bytes of registers, the stack, display and
+// memory, rounded up to whole cache lines. That is 4480 bytes with the
+// default stack, some 239,000 machines per GiB.
+#define CHIP8_STATE_SIZE                                                      \
+  ((64 + 2 * CHIP8_STACK_SIZE + CHIP8_FRAMEBUFFER_SIZE + CHIP8_MEMORY_SIZE + \
+    CHIP8_CACHE_LINE - 1) /                                                   \
+   CHIP8_CACHE_LINE * CHIP8_CACHE_LINE)
 
 typedef enum status {
   ERR = 0,
   OK = 1,
 } status_t;
 
+// Why chip8_run_cycles returned. Faults leave ip on the instruction that
+// raised them, without touching registers or memory.
+typedef enum chip8_stop {
+  CHIP8_STOP_BUDGET = 0,   // ran every cycle it was given
+  CHIP8_STOP_WAIT_KEY,     // FX0A is waiting for a key press
+  CHIP8_STOP_FRAME,        // 00E0 or DXYN changed the framebuffer
+  CHIP8_STOP_ILLEGAL,      // unknown opcode, or ip or I out of memory
+  CHIP8_STOP_STACK_FAULT,  // call with a full stack or return with an empty one
+  CHIP8_STOP_IDLE,         // jumped back into an idle loop, see chip8_idle
+} chip8_stop_t;
+
+// Loops that spin without changing anything until a key or timer ends them.
+typedef enum chip8_idle {
+  CHIP8_IDLE_NONE = 0,
+  CHIP8_IDLE_KEY,      // FX0A waiting for a key press
+  CHIP8_IDLE_TIMER,    // FX07, 3X00, 1NNN polling the delay timer
+  CHIP8_IDLE_FOREVER,  // 1NNN jumping to itself
+} chip8_idle_t;
+
+// Machines are cache line aligned, with the registers, which are everything
+// instructions other than draws and memory accesses touch, filling the first
+// line. They all come before the arrays, which chip8_clone relies on.
 struct chip8 {
-  uint16_t ip;  // instruction pointer
+  alignas(CHIP8_CACHE_LINE) uint16_t ip;  // instruction pointer
   uint16_t reg_i;
   uint8_t reg_v[CHIP8_REGISTER_COUNT];
-  uint8_t timer;
-  uint8_t tone_clock;
-  uint8_t keypress;
-  uint8_t sp;  // stack pointer
+  uint8_t timer;       // delay timer, as set at timer_tick
+  uint8_t tone_clock;  // sound timer, as set at tone_tick
+  uint8_t sp;          // stack pointer
+  uint8_t event;       // chip8_stop_t raised by the last instruction
+  uint16_t keys;       // bit k set while key k is held down
+  uint32_t rng;        // xorshift state behind CXKK
+  uint32_t dirty_rows;  // see chip8_dirty_rows
+  uint32_t cpu_hz;
+  uint64_t cycle;       // instructions run since the last cpu_hz change
+  uint64_t timer_tick;  // 60 Hz tick the timers were last set at
+  uint64_t tone_tick;
   uint16_t stack[CHIP8_STACK_SIZE];
+  uint64_t framebuffer[CHIP8_FRAMEBUFFER_Y_LEN];  // see chip8_row
   uint8_t mem[CHIP8_MEMORY_SIZE];
-  uint8_t framebuffer[CHIP8_FRAMEBUFFER_SIZE];
 };
 
 typedef struct chip8 chip8_t;
 
+typedef struct chip8_op chip8_op_t;
+typedef void (*chip8_handler_t)(chip8_t* chip8, const chip8_op_t* op);
+
+// A decoded instruction: the handler that executes it plus its operand
+// fields, extracted once so they can be cached and reused.
+struct chip8_op {
+  chip8_handler_t handler;
+  uint16_t instruction;
+  uint8_t x;
+  uint8_t y;
+  uint8_t kk;
+  uint8_t n;
+  uint8_t writes;  // bytes written to memory at I (FX33, FX55)
+  uint8_t fused;   // superinstruction starting here, set by the cache engine
+};
+
+#define CHIP8_OP_NNN(op) ((op)->instruction & 0x0FFF)
+
 void chip8_init(chip8_t* chip8);
+// Machines start from CHIP8_DEFAULT_SEED, so runs repeat unless reseeded.
+void chip8_seed(chip8_t* chip8, uint32_t seed);
 void chip8_debug(const chip8_t* chip8);
 status_t chip8_load_rom(chip8_t* chip8, const char* filepath);
-void chip8_run_instruction(chip8_t* chip8);
+void chip8_decode(uint16_t instruction, chip8_op_t* op);
+chip8_stop_t chip8_run_instruction(chip8_t* chip8);
+
+// Run up to `budget` instructions, returning early as soon as one raises an
+// event. The instruction raising it counts towards `cycles_run`, which may be
+// NULL.
+chip8_stop_t chip8_run_cycles(chip8_t* chip8, uint32_t budget,
+                              uint32_t* cycles_run);
+
+// Timers count down at 60 Hz while instructions run at cpu_hz. Both are
+// derived from the cycle counter when read, so running an instruction only
+// has to advance it. Changing cpu_hz starts the cycles and ticks over from
+// zero, carrying the timers across.
+void chip8_set_cpu_hz(chip8_t* chip8, uint32_t hz);
+uint64_t chip8_ticks(const chip8_t* chip8);
+uint8_t chip8_timer(const chip8_t* chip8);
+uint8_t chip8_tone(const chip8_t* chip8);
+
+// Cycles left until `frames` more 60 Hz ticks have passed.
+uint32_t chip8_frame_cycles(const chip8_t* chip8, uint32_t frames);
+
+// Run whole frames in one batch, carrying on past FRAME events and skipping
+// over idle loops. Returns CHIP8_STOP_BUDGET once they all ran, or the event
+// that cut them short; a key wait still uses up the rest of the frames.
+chip8_stop_t chip8_run_frames(chip8_t* chip8, uint32_t frames,
+                              uint32_t* cycles_run);
+
+// What the loop at ip is spinning on, if it is an idle loop that will keep
+// spinning for now.
+chip8_idle_t chip8_idle(const chip8_t* chip8);
+
+// Whether the 1NNN at addr closes an idle loop, so that taking it can raise
+// CHIP8_STOP_IDLE. Compiling engines leave those jumps to the interpreter.
+bool chip8_idle_jump(const chip8_t* chip8, uint16_t addr);
+
+// Skip over the idle loop at ip, up to `budget` cycles, leaving the machine
+// exactly as running it would have. Returns the cycles skipped: all of them
+// for key waits and jumps to self, and whole iterations up to the timer
+// expiring for delay loops.
+uint32_t chip8_fast_forward(chip8_t* chip8, uint32_t budget);
+
+// The instructions from 2 before ip to 5 after it, marking the one at ip, as
+// the debug view lists them. Lines end in \r\n, for a terminal in raw mode.
+// Addresses outside memory, which ip reaches after faulting, are left blank.
+void chip8_code_report(const chip8_t* chip8, FILE* out);
+
+// The display is stored one word per row, with x = 0 in the top bit, so
+// drawing a sprite row takes one shift, one AND and one XOR.
+static inline uint64_t chip8_row(const chip8_t* chip8, uint8_t y) {
+  return chip8->framebuffer[y];
+}
+
+static inline void chip8_set_row(chip8_t* chip8, uint8_t y, uint64_t pixels) {
+  chip8->framebuffer[y] = pixels;
+}
+
+static inline bool chip8_pixel(const chip8_t* chip8, uint8_t x, uint8_t y) {
+  return (chip8->framebuffer[y] >> (CHIP8_FRAMEBUFFER_MAX_X - x)) & 1;
+}
+
+// Rows that 00E0 or DXYN may have changed since the host last took them,
+// bit y for row y. A freshly initialized machine has every row dirty, so the
+// first frame always gets drawn.
+static inline uint32_t chip8_dirty_rows(const chip8_t* chip8) {
+  return chip8->dirty_rows;
+}
+
+static inline bool chip8_frame_changed(const chip8_t* chip8) {
+  return chip8->dirty_rows != 0;
+}
+
+// Return the dirty rows and start tracking afresh, for hosts that have just
+// shown the frame.
+static inline uint32_t chip8_take_dirty_rows(chip8_t* chip8) {
+  uint32_t rows = chip8->dirty_rows;
+  chip8->dirty_rows = 0;
+  return rows;
+}
+
+// XOR an n byte sprite onto the framebuffer at (x, y), as DXYN does. The
+// position wraps around the screen, and whatever then sticks out past the
+// right or bottom edge is clipped. Returns whether it erased any lit pixel.
+bool chip8_draw(chip8_t* chip8, uint8_t x, uint8_t y, const uint8_t* sprite,
+                uint8_t n);
+
+static inline bool chip8_key_held(const chip8_t* chip8, uint8_t key) {
+  return key < CHIP8_KEY_COUNT && (chip8->keys >> key) & 1;
+}
+
+// Next byte of the xorshift generator behind CXKK.
+static inline uint8_t chip8_random(uint32_t* rng) {
+  uint32_t x = *rng;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *rng = x;
+  return x >> 24;
+}
+
+#ifdef CHIP8_PROFILE
+#ifndef CHIP8_PROFILE_PATH
+#define CHIP8_PROFILE_PATH "chip8.folded"
+#endif
+
+// Guest profiler, built in with -DCHIP8_PROFILE and absent otherwise. It
+// counts every instruction the interpreter runs, by opcode and by address,
+// the sprite pixels DXYN draws, and the calls made through 0MMM and 2MMM,
+// building a tree of them with the instructions run in each. The counts are
+// shared by every machine in the process and not locked, so machines must
+// run on one thread at a time; farms are held to one thread. Each machine's
+// calls are picked up from its stack whenever it runs after another one.
+
+// Opcode histogram, hottest addresses and call edges with their inclusive
+// and exclusive instruction counts.
+void chip8_profile_report(FILE* out);
+
+// The call tree as folded stacks, one line per path of calls with the
+// instructions run in its innermost function, for flamegraph.pl and the
+// tools that read its input.
+status_t chip8_profile_write_folded(const char* path);
+
+// Drop what is known of the calls chip8 is in, for when its stack has been
+// replaced, as chip8_init, snapshots and rewinding do.
+void chip8_profile_forget(const chip8_t* chip8);
+#else
+static inline void chip8_profile_forget(const chip8_t* chip8) { (void)chip8; }
+#endif
+
+// Advance the machine clock by a number of executed instructions.
+static inline void chip8_tick(chip8_t* chip8, uint32_t cycles) {
+  chip8->cycle += cycles;
+}
 
 #endif  // __CHIP8_H__
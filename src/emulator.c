@@ -0,0 +1,383 @@
+#include "emulator.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rewind.h"
+#include "savestate.h"
+#include "snapshot.h"
+
+#define MAX_CATCH_UP_FRAMES 6
+
+#define CACHE_LINE 64
+#define QUEUE_SIZE 64  // a power of two
+#define FRESH 4        // in middle while its frame has not been taken
+
+typedef struct message {
+  uint8_t command;  // emulator_command_t
+  uint8_t arg;
+  uint64_t time_ns;  // when it was sent
+} message_t;
+
+struct emulator {
+  chip8_t* ch8;
+  engine_t* engine;
+  pacer_t pacer;
+  input_t input;
+  telemetry_t telemetry;
+  rewind_t* rewind;  // every frame run or instruction stepped
+  const char* state_path;
+  uint32_t saves;
+  uint32_t loads;
+  uint32_t save_errors;
+  pthread_t thread;
+  int wake[2];   // pipe waking the emulation thread up for input
+  int ready[2];  // pipe telling the front end a frame is ready
+  _Atomic bool quit;
+
+  // The machine as it was handed over, for resets.
+  uint8_t base[CHIP8_MEMORY_SIZE];
+  uint8_t pristine[CHIP8_SNAPSHOT_MAX_SIZE];
+  size_t pristine_size;
+
+  // The front end adds input at tail, the emulation thread takes it from
+  // head. Each index is only written by one side.
+  alignas(CACHE_LINE) _Atomic uint32_t head;
+  alignas(CACHE_LINE) _Atomic uint32_t tail;
+  message_t queue[QUEUE_SIZE];
+
+  // The emulation thread fills frames[back] and swaps it with middle, the
+  // front end swaps middle with frames[front] when FRESH is set. Neither
+  // ever waits for the other.
+  emulator_frame_t frames[3];
+  alignas(CACHE_LINE) _Atomic uint8_t middle;
+  uint8_t back;
+  alignas(CACHE_LINE) uint8_t front;
+};
+
+static void drain(int fd) {
+  char bytes[64];
+  while (read(fd, bytes, sizeof(bytes)) > 0) {
+  }
+}
+
+static void notify(int fd) {
+  // A full pipe already has the other side awake.
+  if (write(fd, "", 1) < 0) return;
+}
+
+static bool pop_message(emulator_t* emulator, message_t* message) {
+  uint32_t head = atomic_load_explicit(&emulator->head, memory_order_relaxed);
+  uint32_t tail = atomic_load_explicit(&emulator->tail, memory_order_acquire);
+  if (head == tail) return false;
+  *message = emulator->queue[head % QUEUE_SIZE];
+  atomic_store_explicit(&emulator->head, head + 1, memory_order_release);
+  return true;
+}
+
+static void publish(emulator_t* emulator, chip8_stop_t stop, bool paused) {
+  emulator_frame_t* frame = &emulator->frames[emulator->back];
+  frame->machine = *emulator->ch8;
+  frame->dirty_rows = chip8_take_dirty_rows(emulator->ch8);
+  frame->stop = stop;
+  frame->paused = paused;
+  frame->pacing = emulator->pacer.stats;
+  frame->input = emulator->input.stats;
+  frame->telemetry = emulator->telemetry;
+  frame->rewind = rewind_stats(emulator->rewind);
+  frame->saves = emulator->saves;
+  frame->loads = emulator->loads;
+  frame->save_errors = emulator->save_errors;
+
+  // A frame the front end has not taken yet is about to be replaced, so its
+  // changes go out with this one. Only this thread writes frames, so reading
+  // it is safe even if the front end takes it meanwhile, which at worst
+  // reports its rows twice.
+  uint8_t middle = atomic_load(&emulator->middle);
+  if (middle & FRESH) {
+    frame->dirty_rows |= emulator->frames[middle & ~FRESH].dirty_rows;
+  }
+
+  uint8_t old = atomic_exchange_explicit(
+      &emulator->middle, emulator->back | FRESH, memory_order_acq_rel);
+  emulator->back = old & ~FRESH;
+  notify(emulator->ready[1]);
+}
+
+// Frames the machine can be left alone for without anything observable
+// happening: 0 if it is busy, -1 if only a key press can change anything.
+static int64_t idle_frames(const chip8_t* ch8) {
+  uint8_t timer = chip8_timer(ch8);
+  uint8_t tone = chip8_tone(ch8);
+
+  switch (chip8_idle(ch8)) {
+    case CHIP8_IDLE_TIMER:
+      return timer;
+    case CHIP8_IDLE_KEY:
+    case CHIP8_IDLE_FOREVER:
+      if (timer || tone) return timer > tone ? timer : tone;
+      return -1;
+    default:
+      return 0;
+  }
+}
+
+static void reset(emulator_t* emulator) {
+  chip8_t* ch8 = emulator->ch8;
+
+  chip8_restore(ch8, emulator->base, emulator->pristine,
+                emulator->pristine_size);
+  chip8_seed(ch8, time(NULL));
+  engine_reset(emulator->engine, ch8);
+}
+
+static bool save(emulator_t* emulator) {
+  const chip8_t* machines[] = {emulator->ch8};
+  return emulator->state_path != NULL &&
+         chip8_savestate_save(emulator->state_path, emulator->base, machines,
+                              1) == OK;
+}
+
+static bool load(emulator_t* emulator) {
+  chip8_savestate_t states;
+  if (emulator->state_path == NULL ||
+      chip8_savestate_open(&states, emulator->state_path) != OK) {
+    return false;
+  }
+  // States of another ROM would run its code on top of this one.
+  bool ok = memcmp(states.base, emulator->base, CHIP8_MEMORY_SIZE) == 0 &&
+            chip8_savestate_load(&states, 0, emulator->ch8) == OK;
+  chip8_savestate_close(&states);
+  if (ok) {
+    emulator->ch8->keys = emulator->input.keys;
+    engine_reset(emulator->engine, emulator->ch8);
+    rewind_record(emulator->rewind, emulator->ch8);
+  }
+  return ok;
+}
+
+// Apply everything queued since the last frame and let go of keys no longer
+// held. Returns whether anything happened.
+static bool take_input(emulator_t* emulator, bool* paused,
+                       chip8_stop_t* stop) {
+  message_t message;
+  bool changed = false;
+  uint64_t now = input_now_ns();
+
+  input_release(&emulator->input, now);
+  while (pop_message(emulator, &message)) {
+    changed = true;
+    switch (message.command) {
+      case EMULATOR_KEY:
+        input_press(&emulator->input, message.arg, message.time_ns, now);
+        emulator->ch8->keys = emulator->input.keys;
+        break;
+      case EMULATOR_RESET:
+        reset(emulator);
+        break;
+      case EMULATOR_STEP:
+        *paused = true;
+        *stop = engine_run(emulator->engine, emulator->ch8, 1);
+        rewind_record(emulator->rewind, emulator->ch8);
+        break;
+      case EMULATOR_REWIND:
+        *paused = true;
+        *stop = CHIP8_STOP_BUDGET;
+        if (rewind_back(emulator->rewind, emulator->ch8, message.arg) > 0) {
+          engine_reset(emulator->engine, emulator->ch8);
+        }
+        break;
+      case EMULATOR_RESUME:
+        *paused = false;
+        break;
+      case EMULATOR_SAVE:
+        if (save(emulator)) {
+          emulator->saves++;
+        } else {
+          emulator->save_errors++;
+        }
+        break;
+      case EMULATOR_LOAD:
+        *stop = CHIP8_STOP_BUDGET;
+        if (load(emulator)) {
+          emulator->loads++;
+        } else {
+          emulator->save_errors++;
+        }
+        break;
+    }
+  }
+
+  if (emulator->ch8->keys != emulator->input.keys) {
+    emulator->ch8->keys = emulator->input.keys;
+    changed = true;
+  }
+  return changed;
+}
+
+static void* emulator_main(void* arg) {
+  emulator_t* emulator = arg;
+  chip8_t* ch8 = emulator->ch8;
+  bool paused = false;
+  int64_t idle = 0;
+  pacer_init(&emulator->pacer, CHIP8_TIMER_HZ);
+
+  publish(emulator, CHIP8_STOP_BUDGET, paused);
+
+  while (!atomic_load(&emulator->quit)) {
+    chip8_stop_t stop = CHIP8_STOP_BUDGET;
+    bool changed = take_input(emulator, &paused, &stop);
+
+    // Frames slept through in a delay loop are caught up on all at once,
+    // each skipping straight over the loop.
+    uint32_t max_frames = MAX_CATCH_UP_FRAMES + (idle > 0 ? idle : 0);
+    uint64_t skipped = emulator->pacer.stats.skipped;
+    uint32_t frames = pacer_frames_due(&emulator->pacer, max_frames);
+    if (!paused && frames > 0) {
+      uint64_t start = input_now_ns();
+      // A frame at a time, so that rewinding goes back frame by frame even
+      // through a batch.
+      for (uint32_t frame = 0; frame < frames; frame++) {
+        stop = engine_run(emulator->engine, ch8, chip8_frame_cycles(ch8, 1));
+        rewind_record(emulator->rewind, ch8);
+        if (stop == CHIP8_STOP_ILLEGAL || stop == CHIP8_STOP_STACK_FAULT) {
+          break;
+        }
+      }
+      histogram_record(&emulator->telemetry.phases[TELEMETRY_EMULATE],
+                       input_now_ns() - start);
+      changed = true;
+    }
+    // After waiting for a single frame, any more due were overdue, and
+    // skipped ones never ran at all. Frames slept through on purpose, in a
+    // delay loop or waiting for a key, do not count.
+    if (idle == 0) {
+      emulator->telemetry.missed +=
+          frames - (frames > 0) + emulator->pacer.stats.skipped - skipped;
+    }
+    // Stop on the faulting instruction, for the front end to show.
+    if (stop == CHIP8_STOP_ILLEGAL || stop == CHIP8_STOP_STACK_FAULT) {
+      paused = true;
+    }
+
+    if (changed) publish(emulator, stop, paused);
+
+    idle = paused ? -1 : idle_frames(ch8);
+    uint64_t start = input_now_ns();
+    bool woken = pacer_wait(&emulator->pacer, emulator->wake[0], idle);
+    histogram_record(&emulator->telemetry.phases[TELEMETRY_SLEEP],
+                     input_now_ns() - start);
+    if (woken) drain(emulator->wake[0]);
+  }
+
+  return NULL;
+}
+
+static bool open_pipe(int fds[2]) {
+  if (pipe(fds) != 0) return false;
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, O_NONBLOCK);
+  return true;
+}
+
+emulator_t* emulator_start(chip8_t* ch8, engine_t* engine, uint32_t hold_ms,
+                           const char* state_path) {
+  size_t size = (sizeof(emulator_t) + CACHE_LINE - 1) & ~(CACHE_LINE - 1);
+  emulator_t* emulator = aligned_alloc(CACHE_LINE, size);
+  if (emulator == NULL) return NULL;
+  memset(emulator, 0, sizeof(emulator_t));
+
+  emulator->ch8 = ch8;
+  emulator->engine = engine;
+  emulator->state_path = state_path;
+  memcpy(emulator->base, ch8->mem, CHIP8_MEMORY_SIZE);
+  emulator->pristine_size = chip8_snapshot(ch8, emulator->base,
+                                           emulator->pristine,
+                                           sizeof(emulator->pristine));
+  input_init(&emulator->input, hold_ms);
+  telemetry_init(&emulator->telemetry);
+  emulator->rewind = rewind_create(REWIND_DEFAULT_BYTES, REWIND_DEFAULT_FRAMES);
+  if (emulator->rewind == NULL) {
+    free(emulator);
+    return NULL;
+  }
+  rewind_record(emulator->rewind, ch8);
+  atomic_init(&emulator->quit, false);
+  atomic_init(&emulator->head, 0);
+  atomic_init(&emulator->tail, 0);
+  atomic_init(&emulator->middle, 1);
+  emulator->back = 0;
+  emulator->front = 2;
+
+  if (!open_pipe(emulator->wake)) {
+    rewind_destroy(emulator->rewind);
+    free(emulator);
+    return NULL;
+  }
+  if (!open_pipe(emulator->ready)) {
+    close(emulator->wake[0]);
+    close(emulator->wake[1]);
+    rewind_destroy(emulator->rewind);
+    free(emulator);
+    return NULL;
+  }
+  if (pthread_create(&emulator->thread, NULL, emulator_main, emulator) != 0) {
+    for (int i = 0; i < 2; i++) {
+      close(emulator->wake[i]);
+      close(emulator->ready[i]);
+    }
+    rewind_destroy(emulator->rewind);
+    free(emulator);
+    return NULL;
+  }
+
+  return emulator;
+}
+
+void emulator_stop(emulator_t* emulator) {
+  atomic_store(&emulator->quit, true);
+  notify(emulator->wake[1]);
+  pthread_join(emulator->thread, NULL);
+
+  for (int i = 0; i < 2; i++) {
+    close(emulator->wake[i]);
+    close(emulator->ready[i]);
+  }
+  rewind_destroy(emulator->rewind);
+  free(emulator);
+}
+
+bool emulator_send(emulator_t* emulator, emulator_command_t command,
+                   uint8_t arg) {
+  uint32_t tail = atomic_load_explicit(&emulator->tail, memory_order_relaxed);
+  uint32_t head = atomic_load_explicit(&emulator->head, memory_order_acquire);
+  if (tail - head == QUEUE_SIZE) return false;
+
+  emulator->queue[tail % QUEUE_SIZE] =
+      (message_t){command, arg, input_now_ns()};
+  atomic_store_explicit(&emulator->tail, tail + 1, memory_order_release);
+  notify(emulator->wake[1]);
+  return true;
+}
+
+int emulator_frame_fd(const emulator_t* emulator) {
+  return emulator->ready[0];
+}
+
+const emulator_frame_t* emulator_frame(emulator_t* emulator) {
+  // Clear the pipe first, so a frame published after the check below still
+  // leaves it readable.
+  drain(emulator->ready[0]);
+  if (!(atomic_load(&emulator->middle) & FRESH)) return NULL;
+
+  uint8_t old = atomic_exchange_explicit(&emulator->middle, emulator->front,
+                                         memory_order_acq_rel);
+  emulator->front = old & ~FRESH;
+  return &emulator->frames[emulator->front];
+}
@@ -0,0 +1,68 @@
+#ifndef __EMULATOR_H__
+#define __EMULATOR_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "chip8.h"
+#include "engine.h"
+#include "input.h"
+#include "pacer.h"
+#include "rewind.h"
+#include "telemetry.h"
+
+// Runs a machine in real time on its own thread, so that a slow terminal
+// never holds up emulation. The front end sends it input through a lock-free
+// single producer, single consumer queue and picks up finished frames from a
+// lock-free triple buffer, always getting the newest one.
+typedef struct emulator emulator_t;
+
+typedef enum emulator_command {
+  EMULATOR_KEY,     // press key `arg`, holding it for a while
+  EMULATOR_RESET,   // start over from the freshly loaded ROM
+  EMULATOR_STEP,    // pause and run a single instruction
+  EMULATOR_RESUME,  // run in real time again
+  EMULATOR_REWIND,  // pause and go back `arg` frames or steps
+  EMULATOR_SAVE,    // write the machine to the save state file
+  EMULATOR_LOAD,    // and read it back
+} emulator_command_t;
+
+// A machine as it was at the end of a frame.
+typedef struct emulator_frame {
+  chip8_t machine;
+  uint32_t dirty_rows;  // changed since the front end last took a frame
+  chip8_stop_t stop;    // how the last run ended, CHIP8_STOP_BUDGET if it ran
+  bool paused;          // by a step or a fault
+  pacer_stats_t pacing;
+  input_stats_t input;
+  telemetry_t telemetry;  // emulate and sleep phases, and missed frames
+  rewind_stats_t rewind;
+  uint32_t saves;        // to the save state file
+  uint32_t loads;        // from it
+  uint32_t save_errors;  // saves and loads that failed
+} emulator_frame_t;
+
+// Start running `chip8` on `engine`, both of which belong to the emulation
+// thread until emulator_stop. Resets put the machine back as it was handed
+// over, keys are held for hold_ms after each press (see input_t), and the
+// last REWIND_DEFAULT_FRAMES frames are kept to rewind through. Saves and
+// loads go to state_path, if not NULL, which only takes states of the same
+// ROM. Returns NULL if the thread or its channels cannot be set up.
+emulator_t* emulator_start(chip8_t* chip8, engine_t* engine, uint32_t hold_ms,
+                           const char* state_path);
+void emulator_stop(emulator_t* emulator);
+
+// Queue a command for the emulation thread. Returns false, dropping it, if
+// the queue is full. Only one thread may send.
+bool emulator_send(emulator_t* emulator, emulator_command_t command,
+                   uint8_t arg);
+
+// Readable whenever a new frame may be waiting, for poll().
+int emulator_frame_fd(const emulator_t* emulator);
+
+// The newest finished frame, or NULL if there has been none since the last
+// call. It stays valid until a later call returns another one. Only one
+// thread may take frames.
+const emulator_frame_t* emulator_frame(emulator_t* emulator);
+
+#endif  // __EMULATOR_H__
@@ -0,0 +1,83 @@
+#include "engine.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const char* names[] = {
+  [ENGINE_INTERPRETER] = "interpreter",
+  [ENGINE_CACHE] = "cache",
+  [ENGINE_JIT] = "jit",
+};
+
+int engine_kind(const char* name) {
+  for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+    if (strcmp(name, names[i]) == 0) return i;
+  }
+  return -1;
+}
+
+status_t engine_init(engine_t* engine, int kind) {
+  engine->kind = kind;
+  engine->cache = NULL;
+  engine->jit = NULL;
+
+  if (kind == ENGINE_CACHE) {
+    engine->cache = malloc(sizeof(chip8_cache_t));
+    if (engine->cache == NULL) return ERR;
+  } else if (kind == ENGINE_JIT) {
+    engine->jit = chip8_jit_create();
+    if (engine->jit == NULL) return ERR;
+  }
+
+  return OK;
+}
+
+void engine_destroy(engine_t* engine) {
+  free(engine->cache);
+  if (engine->jit) chip8_jit_destroy(engine->jit);
+  engine->cache = NULL;
+  engine->jit = NULL;
+}
+
+void engine_reset(engine_t* engine, const chip8_t* ch8) {
+  if (engine->kind == ENGINE_CACHE) {
+    chip8_cache_init(engine->cache, ch8);
+  } else if (engine->kind == ENGINE_JIT) {
+    chip8_jit_invalidate(engine->jit, 0, CHIP8_MEMORY_SIZE);
+  }
+}
+
+chip8_stop_t engine_run_cycles(engine_t* engine, chip8_t* ch8, uint32_t budget,
+                               uint32_t* cycles_run) {
+#ifdef CHIP8_PROFILE
+  // The profiler lives in the interpreter's step, so every engine runs
+  // through it.
+  (void)engine;
+  return chip8_run_cycles(ch8, budget, cycles_run);
+#else
+  if (engine->kind == ENGINE_CACHE) {
+    return chip8_cache_run(engine->cache, ch8, budget, cycles_run);
+  } else if (engine->kind == ENGINE_JIT) {
+    return chip8_jit_run(engine->jit, ch8, budget, cycles_run);
+  }
+  return chip8_run_cycles(ch8, budget, cycles_run);
+#endif
+}
+
+// FX0A would spin on itself for the rest of the batch, so let that time pass:
+// keys only change between batches.
+chip8_stop_t engine_run(engine_t* engine, chip8_t* ch8, uint32_t budget) {
+  chip8_stop_t stop = CHIP8_STOP_BUDGET;
+
+  while (budget > 0) {
+    uint32_t ran;
+    stop = engine_run_cycles(engine, ch8, budget, &ran);
+    budget -= ran;
+    if (stop == CHIP8_STOP_IDLE || stop == CHIP8_STOP_WAIT_KEY) {
+      budget -= chip8_fast_forward(ch8, budget);
+    }
+    if (stop != CHIP8_STOP_FRAME && stop != CHIP8_STOP_IDLE) break;
+  }
+
+  return stop;
+}
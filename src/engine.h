@@ -0,0 +1,39 @@
+#ifndef __ENGINE_H__
+#define __ENGINE_H__
+
+#include <stdint.h>
+
+#include "cache.h"
+#include "chip8.h"
+#include "jit.h"
+
+enum { ENGINE_INTERPRETER, ENGINE_CACHE, ENGINE_JIT };
+
+// One of the execution engines, picked at startup and shared by the
+// interactive and headless front ends.
+typedef struct engine {
+  int kind;
+  chip8_cache_t* cache;
+  chip8_jit_t* jit;
+} engine_t;
+
+// Returns the engine kind called `name`, or -1 if there is none.
+int engine_kind(const char* name);
+
+// Returns ERR if the engine cannot be set up on this host.
+status_t engine_init(engine_t* engine, int kind);
+void engine_destroy(engine_t* engine);
+
+// Forget everything derived from chip8->mem. Call after loading a ROM or
+// resetting the machine.
+void engine_reset(engine_t* engine, const chip8_t* chip8);
+
+// chip8_run_cycles on the engine.
+chip8_stop_t engine_run_cycles(engine_t* engine, chip8_t* chip8,
+                               uint32_t budget, uint32_t* cycles_run);
+
+// Run a batch of cycles. Drawing does not end it early and idle loops are
+// skipped over, so it only stops short on a fault or a key wait.
+chip8_stop_t engine_run(engine_t* engine, chip8_t* chip8, uint32_t budget);
+
+#endif  // __ENGINE_H__
@@ -0,0 +1,314 @@
+#include "farm.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "engine.h"
+
+#define FARM_CACHE_LINE 64
+
+// A worker's share of the machines still to run in the current batch, as a
+// range [head, tail) packed into one word so that the owner popping from
+// the head and thieves taking from the tail agree through a single CAS.
+typedef struct worker {
+  alignas(FARM_CACHE_LINE) _Atomic uint64_t range;
+  chip8_farm_t* farm;
+  uint32_t id;
+  pthread_t thread;
+  uint64_t steals;
+} worker_t;
+
+struct chip8_farm {
+  uint32_t size;
+  uint32_t threads;
+  chip8_t* machines;
+  engine_t* engines;
+  chip8_farm_stats_t* stats;
+  worker_t* workers;
+
+  // Batch hand-off: the caller bumps generation and works as worker 0, the
+  // other workers run it and report back through finished.
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t done;
+  uint64_t generation;
+  uint32_t finished;
+  uint32_t frames;
+  bool quit;
+  alignas(FARM_CACHE_LINE) _Atomic uint32_t remaining;
+
+  uint64_t batches;
+  uint64_t wall_ns;
+};
+
+static uint64_t range_pack(uint32_t head, uint32_t tail) {
+  return ((uint64_t)tail << 32) | head;
+}
+
+static uint32_t range_head(uint64_t range) { return (uint32_t)range; }
+static uint32_t range_tail(uint64_t range) { return range >> 32; }
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Take the next machine from the front of the worker's own range.
+static bool pop(worker_t* worker, uint32_t* index) {
+  uint64_t range = atomic_load(&worker->range);
+  for (;;) {
+    uint32_t head = range_head(range), tail = range_tail(range);
+    if (head >= tail) return false;
+    if (atomic_compare_exchange_weak(&worker->range, &range,
+                                     range_pack(head + 1, tail))) {
+      *index = head;
+      return true;
+    }
+  }
+}
+
+// Move the back half of the victim's range over to the thief.
+static bool steal(worker_t* thief, worker_t* victim) {
+  uint64_t range = atomic_load(&victim->range);
+  for (;;) {
+    uint32_t head = range_head(range), tail = range_tail(range);
+    if (head >= tail) return false;
+    uint32_t split = tail - (tail - head + 1) / 2;
+    if (atomic_compare_exchange_weak(&victim->range, &range,
+                                     range_pack(head, split))) {
+      // Only the owner refills its own range, and only once it is empty,
+      // so thieves never see a half-written one.
+      atomic_store(&thief->range, range_pack(split, tail));
+      thief->steals++;
+      return true;
+    }
+  }
+}
+
+static void run_machine(chip8_farm_t* farm, uint32_t index) {
+  chip8_t* ch8 = &farm->machines[index];
+  chip8_farm_stats_t* stats = &farm->stats[index];
+
+  if (stats->stop == CHIP8_STOP_BUDGET) {
+    uint64_t start = now_ns();
+    uint64_t cycle = ch8->cycle;
+    chip8_stop_t stop = engine_run(&farm->engines[index], ch8,
+                                   chip8_frame_cycles(ch8, farm->frames));
+    if (stop == CHIP8_STOP_ILLEGAL || stop == CHIP8_STOP_STACK_FAULT) {
+      stats->stop = stop;
+    }
+    stats->cycles += ch8->cycle - cycle;
+    stats->busy_ns += now_ns() - start;
+  }
+
+  atomic_fetch_sub_explicit(&farm->remaining, 1, memory_order_release);
+}
+
+static void run_batch(worker_t* worker) {
+  chip8_farm_t* farm = worker->farm;
+  uint32_t index;
+
+  while (atomic_load_explicit(&farm->remaining, memory_order_acquire) > 0) {
+    if (pop(worker, &index)) {
+      run_machine(farm, index);
+      continue;
+    }
+
+    bool stolen = false;
+    for (uint32_t i = 1; i < farm->threads && !stolen; i++) {
+      stolen = steal(worker, &farm->workers[(worker->id + i) % farm->threads]);
+    }
+    // Everything left is already being run by someone else.
+    if (!stolen) sched_yield();
+  }
+}
+
+static void* worker_main(void* arg) {
+  worker_t* worker = arg;
+  chip8_farm_t* farm = worker->farm;
+  uint64_t seen = 0;
+
+  pthread_mutex_lock(&farm->lock);
+  for (;;) {
+    while (farm->generation == seen && !farm->quit) {
+      pthread_cond_wait(&farm->start, &farm->lock);
+    }
+    if (farm->quit) break;
+    seen = farm->generation;
+    pthread_mutex_unlock(&farm->lock);
+
+    run_batch(worker);
+
+    pthread_mutex_lock(&farm->lock);
+    if (++farm->finished == farm->threads - 1) {
+      pthread_cond_signal(&farm->done);
+    }
+  }
+  pthread_mutex_unlock(&farm->lock);
+  return NULL;
+}
+
+chip8_farm_t* chip8_farm_create(uint32_t machines, uint32_t threads,
+                                int engine_kind) {
+  if (machines == 0 || threads == 0) return NULL;
+
+  chip8_farm_t* farm = calloc(1, sizeof(chip8_farm_t));
+  if (farm == NULL) return NULL;
+
+  farm->size = machines;
+  farm->threads = threads;
+  farm->machines = aligned_alloc(CHIP8_CACHE_LINE, machines * sizeof(chip8_t));
+  farm->engines = calloc(machines, sizeof(engine_t));
+  farm->stats = calloc(machines, sizeof(chip8_farm_stats_t));
+  farm->workers = aligned_alloc(FARM_CACHE_LINE, threads * sizeof(worker_t));
+  if (!farm->machines || !farm->engines || !farm->stats || !farm->workers) {
+    free(farm->machines);
+    free(farm->engines);
+    free(farm->stats);
+    free(farm->workers);
+    free(farm);
+    return NULL;
+  }
+
+  for (uint32_t i = 0; i < machines; i++) {
+    chip8_init(&farm->machines[i]);
+    if (engine_init(&farm->engines[i], engine_kind) != OK) {
+      farm->size = i;
+      farm->threads = 0;
+      chip8_farm_destroy(farm);
+      return NULL;
+    }
+    engine_reset(&farm->engines[i], &farm->machines[i]);
+    farm->stats[i].stop = CHIP8_STOP_BUDGET;
+  }
+
+  pthread_mutex_init(&farm->lock, NULL);
+  pthread_cond_init(&farm->start, NULL);
+  pthread_cond_init(&farm->done, NULL);
+
+  for (uint32_t i = 0; i < threads; i++) {
+    worker_t* worker = &farm->workers[i];
+    atomic_init(&worker->range, 0);
+    worker->farm = farm;
+    worker->id = i;
+    worker->steals = 0;
+    if (i > 0 && pthread_create(&worker->thread, NULL, worker_main, worker)) {
+      // Stop the threads already started; the farm would wait on this one.
+      farm->threads = i;
+      chip8_farm_destroy(farm);
+      return NULL;
+    }
+  }
+
+  return farm;
+}
+
+void chip8_farm_destroy(chip8_farm_t* farm) {
+  if (farm->threads > 0) {
+    pthread_mutex_lock(&farm->lock);
+    farm->quit = true;
+    pthread_cond_broadcast(&farm->start);
+    pthread_mutex_unlock(&farm->lock);
+
+    for (uint32_t i = 1; i < farm->threads; i++) {
+      pthread_join(farm->workers[i].thread, NULL);
+    }
+
+    pthread_mutex_destroy(&farm->lock);
+    pthread_cond_destroy(&farm->start);
+    pthread_cond_destroy(&farm->done);
+  }
+
+  for (uint32_t i = 0; i < farm->size; i++) engine_destroy(&farm->engines[i]);
+  free(farm->machines);
+  free(farm->engines);
+  free(farm->stats);
+  free(farm->workers);
+  free(farm);
+}
+
+uint32_t chip8_farm_size(const chip8_farm_t* farm) { return farm->size; }
+
+chip8_t* chip8_farm_machine(chip8_farm_t* farm, uint32_t index) {
+  return &farm->machines[index];
+}
+
+void chip8_farm_reset(chip8_farm_t* farm, uint32_t index) {
+  engine_reset(&farm->engines[index], &farm->machines[index]);
+  farm->stats[index].stop = CHIP8_STOP_BUDGET;
+}
+
+void chip8_farm_run(chip8_farm_t* farm, uint32_t frames) {
+  uint64_t start = now_ns();
+
+  // Hand out even, contiguous shares before anyone starts.
+  for (uint32_t i = 0; i < farm->threads; i++) {
+    uint32_t head = (uint64_t)farm->size * i / farm->threads;
+    uint32_t tail = (uint64_t)farm->size * (i + 1) / farm->threads;
+    atomic_store(&farm->workers[i].range, range_pack(head, tail));
+  }
+  atomic_store(&farm->remaining, farm->size);
+
+  pthread_mutex_lock(&farm->lock);
+  farm->frames = frames;
+  farm->finished = 0;
+  farm->generation++;
+  pthread_cond_broadcast(&farm->start);
+  pthread_mutex_unlock(&farm->lock);
+
+  run_batch(&farm->workers[0]);
+
+  pthread_mutex_lock(&farm->lock);
+  while (farm->finished < farm->threads - 1) {
+    pthread_cond_wait(&farm->done, &farm->lock);
+  }
+  pthread_mutex_unlock(&farm->lock);
+
+  farm->batches++;
+  farm->wall_ns += now_ns() - start;
+}
+
+const chip8_farm_stats_t* chip8_farm_stats(const chip8_farm_t* farm,
+                                           uint32_t index) {
+  return &farm->stats[index];
+}
+
+static double per_second(uint64_t count, uint64_t ns) {
+  return ns ? count * 1e9 / ns : 0.0;
+}
+
+void chip8_farm_report(const chip8_farm_t* farm, FILE* out, bool per_machine) {
+  uint64_t cycles = 0, busy_ns = 0, steals = 0;
+  uint32_t faulted = 0;
+
+  for (uint32_t i = 0; i < farm->size; i++) {
+    cycles += farm->stats[i].cycles;
+    busy_ns += farm->stats[i].busy_ns;
+    faulted += farm->stats[i].stop != CHIP8_STOP_BUDGET;
+  }
+  for (uint32_t i = 0; i < farm->threads; i++) {
+    steals += farm->workers[i].steals;
+  }
+
+  fprintf(out, "Farm: %u machines on %u threads, %llu batches\n", farm->size,
+          farm->threads, (unsigned long long)farm->batches);
+  fprintf(out, "  %llu instructions, %.2f M/s aggregate, %.2f M/s per thread\n",
+          (unsigned long long)cycles, per_second(cycles, farm->wall_ns) / 1e6,
+          per_second(cycles, busy_ns) / 1e6);
+  fprintf(out, "  %llu steals, %u machines faulted\n",
+          (unsigned long long)steals, faulted);
+
+  if (!per_machine) return;
+  for (uint32_t i = 0; i < farm->size; i++) {
+    const chip8_farm_stats_t* stats = &farm->stats[i];
+    fprintf(out, "  %6u: %12llu instructions, %8.2f M/s%s\n", i,
+            (unsigned long long)stats->cycles,
+            per_second(stats->cycles, stats->busy_ns) / 1e6,
+            stats->stop != CHIP8_STOP_BUDGET ? ", faulted" : "");
+  }
+}
@@ -0,0 +1,47 @@
+#ifndef __FARM_H__
+#define __FARM_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chip8.h"
+
+// A pool of independent machines run in frame-sized batches across a fixed
+// set of threads. Each thread starts a batch with an even share of the
+// machines and steals from the others once it runs out, so slow machines do
+// not hold the rest back. Nothing is shared between machines, so they can
+// be driven from any thread between runs.
+typedef struct chip8_farm chip8_farm_t;
+
+typedef struct chip8_farm_stats {
+  uint64_t cycles;   // instructions run
+  uint64_t busy_ns;  // thread time spent running them
+  chip8_stop_t stop;  // last fault, or CHIP8_STOP_BUDGET
+} chip8_farm_stats_t;
+
+// Machines start out as after chip8_init, each with its own engine of
+// engine_kind. Returns NULL if they cannot be allocated, the engine is not
+// supported or a thread cannot be started.
+chip8_farm_t* chip8_farm_create(uint32_t machines, uint32_t threads,
+                                int engine_kind);
+void chip8_farm_destroy(chip8_farm_t* farm);
+
+uint32_t chip8_farm_size(const chip8_farm_t* farm);
+chip8_t* chip8_farm_machine(chip8_farm_t* farm, uint32_t index);
+
+// Call after writing to a machine's memory from outside, such as loading a
+// ROM. Also clears its fault, so it runs again.
+void chip8_farm_reset(chip8_farm_t* farm, uint32_t index);
+
+// Run every machine for `frames` 60 Hz frames and wait for all of them.
+// Machines that faulted stay on the faulting instruction and are skipped.
+void chip8_farm_run(chip8_farm_t* farm, uint32_t frames);
+
+const chip8_farm_stats_t* chip8_farm_stats(const chip8_farm_t* farm,
+                                           uint32_t index);
+
+// Aggregate and per-machine instructions per second.
+void chip8_farm_report(const chip8_farm_t* farm, FILE* out, bool per_machine);
+
+#endif  // __FARM_H__
@@ -0,0 +1,195 @@
+#include "headless.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Longest batch of frames run in one go when the input does not change.
+#define HEADLESS_MAX_BATCH (60 * 60)
+
+typedef struct key_event {
+  uint64_t frame;
+  uint64_t held;
+  uint8_t key;
+} key_event_t;
+
+typedef struct script {
+  key_event_t* events;
+  size_t count;
+} script_t;
+
+static status_t parse_script(FILE* in, script_t* script) {
+  char line[256];
+  size_t capacity = 0;
+  int line_no = 0;
+
+  script->events = NULL;
+  script->count = 0;
+
+  while (in && fgets(line, sizeof(line), in)) {
+    unsigned long long frame, held = 1;
+    unsigned key;
+    char extra;
+    line_no++;
+
+    char* start = line;
+    while (*start == ' ' || *start == '\t') start++;
+    if (*start == '#' || *start == '\n' || *start == '\0') continue;
+
+    int fields = sscanf(start, "%llu %x %llu %c", &frame, &key, &held, &extra);
+    if (fields < 2 || fields > 3 || key > 0x0F || held == 0 ||
+        (script->count > 0 && frame < script->events[script->count - 1].frame)) {
+      fprintf(stderr, "Error: bad input script line %d: %s", line_no, line);
+      free(script->events);
+      return ERR;
+    }
+
+    if (script->count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      key_event_t* events = realloc(script->events, capacity * sizeof(*events));
+      if (events == NULL) {
+        free(script->events);
+        return ERR;
+      }
+      script->events = events;
+    }
+    script->events[script->count++] = (key_event_t){frame, held, key};
+  }
+
+  return OK;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint64_t min_u64(uint64_t a, uint64_t b) { return a < b ? a : b; }
+
+status_t headless_run(engine_t* engine, chip8_t* ch8,
+                      const headless_config_t* config,
+                      headless_stats_t* stats) {
+  script_t script;
+  if (parse_script(config->script, &script) != OK) return ERR;
+
+  const uint64_t start_cycle = ch8->cycle;
+  const uint64_t start_tick = chip8_ticks(ch8);
+  const double start_time = now();
+  size_t next = 0;  // first script event not started yet
+  uint16_t keys = 0;
+  uint64_t key_end = 0;
+  uint64_t frame = 0, cycles = 0;
+
+  for (;;) {
+    if (config->max_frames && frame >= config->max_frames) {
+      stats->end = HEADLESS_FRAME_LIMIT;
+      break;
+    }
+    if (config->max_cycles && cycles >= config->max_cycles) {
+      stats->end = HEADLESS_CYCLE_LIMIT;
+      break;
+    }
+
+    while (next < script.count && script.events[next].frame <= frame) {
+      keys = 1u << script.events[next].key;
+      key_end = script.events[next].frame + script.events[next].held;
+      next++;
+    }
+    if (frame >= key_end) keys = 0;
+    ch8->keys = keys;
+
+    // Everything up to the next input change runs as one batch.
+    uint64_t batch = HEADLESS_MAX_BATCH;
+    if (keys) batch = min_u64(batch, key_end - frame);
+    if (next < script.count) {
+      batch = min_u64(batch, script.events[next].frame - frame);
+    }
+    if (config->max_frames) {
+      batch = min_u64(batch, config->max_frames - frame);
+    }
+
+    uint32_t budget = chip8_frame_cycles(ch8, batch);
+    if (config->max_cycles) {
+      budget = min_u64(budget, config->max_cycles - cycles);
+    }
+
+    // Idle loops are skipped over, unless nothing left in the script can
+    // ever end them.
+    bool stuck = false;
+    chip8_stop_t stop = CHIP8_STOP_BUDGET;
+    while (budget > 0) {
+      uint32_t ran;
+      stop = engine_run_cycles(engine, ch8, budget, &ran);
+      budget -= ran;
+      if (stop == CHIP8_STOP_IDLE || stop == CHIP8_STOP_WAIT_KEY) {
+        chip8_idle_t idle = chip8_idle(ch8);
+        stuck = idle == CHIP8_IDLE_FOREVER ||
+                (idle == CHIP8_IDLE_KEY && next == script.count &&
+                 keys == 0);
+        if (stuck) break;
+        budget -= chip8_fast_forward(ch8, budget);
+      } else if (stop != CHIP8_STOP_FRAME) {
+        break;
+      }
+    }
+
+    frame = chip8_ticks(ch8) - start_tick;
+    cycles = ch8->cycle - start_cycle;
+
+    if (stop == CHIP8_STOP_ILLEGAL || stop == CHIP8_STOP_STACK_FAULT) {
+      stats->end = HEADLESS_FAULT;
+      stats->fault = stop;
+      break;
+    }
+    if (stuck) {
+      stats->end = HEADLESS_STUCK;
+      break;
+    }
+  }
+
+  stats->frames = frame;
+  stats->cycles = cycles;
+  stats->seconds = now() - start_time;
+  stats->hash = headless_hash(ch8);
+  free(script.events);
+  return OK;
+}
+
+void headless_report(const headless_stats_t* stats, FILE* out) {
+  static const char* ends[] = {
+    [HEADLESS_FRAME_LIMIT] = "frame limit",
+    [HEADLESS_CYCLE_LIMIT] = "cycle limit",
+    [HEADLESS_STUCK] = "stuck",
+    [HEADLESS_FAULT] = "fault",
+  };
+  double seconds = stats->seconds > 0 ? stats->seconds : 1e-9;
+
+  fprintf(out, "frames:      %llu\n", (unsigned long long)stats->frames);
+  fprintf(out, "cycles:      %llu\n", (unsigned long long)stats->cycles);
+  fprintf(out, "seconds:     %.6f\n", stats->seconds);
+  fprintf(out, "throughput:  %.2f M cycles/s, %.1fx realtime\n",
+          stats->cycles / seconds / 1e6,
+          stats->frames / (double)CHIP8_TIMER_HZ / seconds);
+  if (stats->end == HEADLESS_FAULT) {
+    fprintf(out, "stopped:     %s (%s)\n", ends[stats->end],
+            stats->fault == CHIP8_STOP_ILLEGAL ? "illegal instruction"
+                                               : "stack fault");
+  } else {
+    fprintf(out, "stopped:     %s\n", ends[stats->end]);
+  }
+  fprintf(out, "framebuffer: %016llx\n", (unsigned long long)stats->hash);
+}
+
+uint64_t headless_hash(const chip8_t* ch8) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  // Byte by byte along each row, as the display used to be stored, so
+  // hashes recorded before stay comparable.
+  for (int y = 0; y < CHIP8_FRAMEBUFFER_Y_LEN; y++) {
+    for (int shift = 56; shift >= 0; shift -= 8) {
+      hash ^= (chip8_row(ch8, y) >> shift) & 0xFF;
+      hash *= 0x100000001b3ULL;
+    }
+  }
+  return hash;
+}
@@ -0,0 +1,51 @@
+#ifndef __HEADLESS_H__
+#define __HEADLESS_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chip8.h"
+#include "engine.h"
+
+// Why a headless run ended.
+enum {
+  HEADLESS_FRAME_LIMIT,
+  HEADLESS_CYCLE_LIMIT,
+  HEADLESS_STUCK,  // idle with nothing left in the script to wake it up
+  HEADLESS_FAULT,
+};
+
+typedef struct headless_config {
+  uint64_t max_frames;  // 0 for no limit
+  uint64_t max_cycles;  // 0 for no limit
+  FILE* script;         // input script, or NULL
+} headless_config_t;
+
+typedef struct headless_stats {
+  uint64_t frames;
+  uint64_t cycles;
+  double seconds;
+  int end;             // HEADLESS_*
+  chip8_stop_t fault;  // when end is HEADLESS_FAULT
+  uint64_t hash;       // of the final framebuffer
+} headless_stats_t;
+
+// Run without a terminal, pacing or rendering until a limit is hit, the
+// program faults or it gets stuck. The input script has one key press per
+// line:
+//
+//   # frame  key  [frames held, default 1]
+//   120      5
+//   300      A    10
+//
+// with frames counted from the start of the run, in increasing order.
+// Returns ERR if the script cannot be parsed.
+status_t headless_run(engine_t* engine, chip8_t* chip8,
+                      const headless_config_t* config,
+                      headless_stats_t* stats);
+void headless_report(const headless_stats_t* stats, FILE* out);
+
+// FNV-1a hash of the framebuffer, to compare runs with.
+uint64_t headless_hash(const chip8_t* chip8);
+
+#endif  // __HEADLESS_H__
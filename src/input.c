@@ -0,0 +1,50 @@
+#include "input.h"
+
+#include <time.h>
+
+void input_init(input_t* input, uint32_t hold_ms) {
+  input->hold_ns = (uint64_t)hold_ms * 1000000u;
+  input->keys = 0;
+  input->stats = (input_stats_t){0};
+}
+
+uint64_t input_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void input_press(input_t* input, uint8_t key, uint64_t time_ns,
+                 uint64_t now_ns) {
+  if (key >= CHIP8_KEY_COUNT) return;
+  input->keys |= 1u << key;
+  input->pressed_ns[key] = now_ns;
+
+  uint64_t latency = now_ns > time_ns ? now_ns - time_ns : 0;
+  input->stats.presses++;
+  input->stats.latency_ns += latency;
+  if (latency > input->stats.max_latency_ns) {
+    input->stats.max_latency_ns = latency;
+  }
+}
+
+void input_release(input_t* input, uint64_t now_ns) {
+  uint16_t held = input->keys;
+  while (held) {
+    int key = __builtin_ctz(held);
+    if (now_ns - input->pressed_ns[key] >= input->hold_ns) {
+      input->keys &= ~(1u << key);
+    }
+    held &= held - 1;
+  }
+}
+
+void input_report(const input_stats_t* stats, FILE* out) {
+  fprintf(out, "Input: %llu key presses", (unsigned long long)stats->presses);
+  if (stats->presses > 0) {
+    fprintf(out, ", %.3f ms to reach the machine on average, %.3f ms at worst",
+            stats->latency_ns / (double)stats->presses / 1e6,
+            stats->max_latency_ns / 1e6);
+  }
+  fprintf(out, "\n");
+}
@@ -0,0 +1,43 @@
+#ifndef __INPUT_H__
+#define __INPUT_H__
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chip8.h"
+
+#define INPUT_DEFAULT_HOLD_MS 100
+
+typedef struct input_stats {
+  uint64_t presses;
+  uint64_t latency_ns;      // total from being typed to reaching the machine
+  uint64_t max_latency_ns;  // worst of them
+} input_stats_t;
+
+// The keyboard as the machine sees it. Terminals only report presses, so a
+// key counts as held until hold_ns pass without another press of it, which
+// auto-repeat sends for as long as it is really held.
+typedef struct input {
+  uint64_t hold_ns;
+  uint64_t pressed_ns[CHIP8_KEY_COUNT];  // last press of each key held
+  uint16_t keys;  // held, as chip8_t.keys
+  input_stats_t stats;
+} input_t;
+
+void input_init(input_t* input, uint32_t hold_ms);
+
+// CLOCK_MONOTONIC, which input times are taken from.
+uint64_t input_now_ns(void);
+
+// Key typed at time_ns, reaching the machine at now_ns.
+void input_press(input_t* input, uint8_t key, uint64_t time_ns,
+                 uint64_t now_ns);
+
+// Let go of the keys whose hold ran out by now_ns. Do this before adding
+// new presses, so that each one is seen at least once however short the
+// hold.
+void input_release(input_t* input, uint64_t now_ns);
+
+void input_report(const input_stats_t* stats, FILE* out);
+
+#endif  // __INPUT_H__
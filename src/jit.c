@@ -0,0 +1,389 @@
+#include "jit.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE (256 * 1024)
+#define JIT_MAX_BLOCK_OPS 64
+#define JIT_MAX_EXITS 1024
+#define JIT_PAGE_SHIFT 8
+
+// Worst case emitted bytes for one instruction plus the block epilogue.
+#define JIT_MAX_OP_BYTES 48
+
+enum { BLOCK_UNKNOWN = 0, BLOCK_COMPILED, BLOCK_INTERPRET };
+
+// Compiled blocks are called as fn(chip8, &budget) and return the next ip.
+// Each block subtracts its instruction count from the budget on entry and
+// returns to the caller untouched if the budget would go negative.
+typedef uint16_t (*jit_block_fn)(chip8_t* chip8, int32_t* budget);
+
+typedef struct jit_exit {
+  uint32_t patch;  // offset of the rel32 of a jmp waiting for its target
+  uint16_t target;
+} jit_exit_t;
+
+struct chip8_jit {
+  uint8_t* code;
+  size_t used;
+  uint32_t entry[CHIP8_MEMORY_SIZE];  // code offset of the block at address
+  uint8_t state[CHIP8_MEMORY_SIZE];
+  uint16_t code_pages;  // 256 byte pages of chip8 memory holding compiled code
+  size_t exit_count;
+  jit_exit_t exits[JIT_MAX_EXITS];
+};
+
+#define V_OFFSET(reg) ((int32_t)(offsetof(chip8_t, reg_v) + (reg)))
+#define I_OFFSET ((int32_t)offsetof(chip8_t, reg_i))
+
+static void emit8(chip8_jit_t* jit, uint8_t byte) {
+  jit->code[jit->used++] = byte;
+}
+
+static void emit32(chip8_jit_t* jit, uint32_t val) {
+  memcpy(&jit->code[jit->used], &val, 4);
+  jit->used += 4;
+}
+
+static void patch32(chip8_jit_t* jit, uint32_t at, uint32_t val) {
+  memcpy(&jit->code[at], &val, 4);
+}
+
+// Patch the rel32 at `at` to land on code offset `target`.
+static void patch_rel32(chip8_jit_t* jit, uint32_t at, uint32_t target) {
+  patch32(jit, at, target - (at + 4));
+}
+
+// <opcode> [rdi + disp32]
+static void emit_mem_rdi(chip8_jit_t* jit, uint8_t opcode, uint8_t reg,
+                         int32_t disp) {
+  emit8(jit, opcode);
+  emit8(jit, 0x80 | (reg << 3) | 0x07);
+  emit32(jit, (uint32_t)disp);
+}
+
+static void emit_setcc_cl(chip8_jit_t* jit, uint8_t cc) {
+  emit8(jit, 0x0F);
+  emit8(jit, cc);
+  emit8(jit, 0xC1);
+}
+
+// Leave the block towards `target`: jump straight into its code if it is
+// compiled, otherwise return it to the dispatcher and remember the jump so it
+// can be chained once the target is compiled.
+static void emit_exit(chip8_jit_t* jit, uint16_t target) {
+  if (jit->state[target] == BLOCK_COMPILED) {
+    emit8(jit, 0xE9);  // jmp rel32
+    uint32_t at = jit->used;
+    emit32(jit, 0);
+    patch_rel32(jit, at, jit->entry[target]);
+    return;
+  }
+
+  if (jit->state[target] != BLOCK_INTERPRET &&
+      jit->exit_count < JIT_MAX_EXITS) {
+    emit8(jit, 0xE9);  // jmp rel32, to the return below until chained
+    jit->exits[jit->exit_count++] = (jit_exit_t){jit->used, target};
+    emit32(jit, 0);
+  }
+
+  emit8(jit, 0xB8);  // mov eax, imm32
+  emit32(jit, target);
+  emit8(jit, 0xC3);  // ret
+}
+
+// cmp/jcc skeleton shared by the skip instructions. `jcc` is taken when the
+// skip does not happen.
+static void emit_skip(chip8_jit_t* jit, uint8_t jcc, uint16_t addr) {
+  emit8(jit, 0x0F);
+  emit8(jit, jcc);
+  uint32_t at = jit->used;
+  emit32(jit, 0);
+  emit_exit(jit, addr + 4);
+  patch_rel32(jit, at, jit->used);
+  emit_exit(jit, addr + 2);
+}
+
+// Emit code for one instruction. Returns 0 if it cannot be compiled, 1 if
+// execution continues with the next instruction and 2 if it ended the block.
+static int emit_op(chip8_jit_t* jit, uint16_t instruction, uint16_t addr) {
+  uint8_t x = (instruction >> 8) & 0x0F;
+  uint8_t y = (instruction >> 4) & 0x0F;
+  uint8_t kk = instruction & 0xFF;
+  uint16_t nnn = instruction & 0x0FFF;
+
+  switch (instruction >> 12) {
+    case 0x1:  // 1MMM
+      emit_exit(jit, nnn);
+      return 2;
+    case 0x3:  // 3XKK
+    case 0x4:  // 4XKK
+      emit_mem_rdi(jit, 0x80, 7, V_OFFSET(x));  // cmp byte [vx], kk
+      emit8(jit, kk);
+      emit_skip(jit, (instruction >> 12) == 0x3 ? 0x85 : 0x84, addr);
+      return 2;
+    case 0x5:  // 5XY0
+    case 0x9:  // 9XY0
+      if (instruction & 0x000F) return 0;
+      emit_mem_rdi(jit, 0x8A, 0, V_OFFSET(x));  // mov al, [vx]
+      emit_mem_rdi(jit, 0x3A, 0, V_OFFSET(y));  // cmp al, [vy]
+      emit_skip(jit, (instruction >> 12) == 0x5 ? 0x85 : 0x84, addr);
+      return 2;
+    case 0x6:                                   // 6XKK
+      emit_mem_rdi(jit, 0xC6, 0, V_OFFSET(x));  // mov byte [vx], kk
+      emit8(jit, kk);
+      return 1;
+    case 0x7:                                   // 7XKK
+      emit_mem_rdi(jit, 0x80, 0, V_OFFSET(x));  // add byte [vx], kk
+      emit8(jit, kk);
+      return 1;
+    case 0x8:
+      switch (instruction & 0x000F) {
+        case 0x0:                                   // 8XY0
+          emit_mem_rdi(jit, 0x8A, 0, V_OFFSET(y));  // mov al, [vy]
+          emit_mem_rdi(jit, 0x88, 0, V_OFFSET(x));  // mov [vx], al
+          return 1;
+        case 0x1:                                   // 8XY1
+          emit_mem_rdi(jit, 0x8A, 0, V_OFFSET(y));  // mov al, [vy]
+          emit_mem_rdi(jit, 0x08, 0, V_OFFSET(x));  // or [vx], al
+          return 1;
+        case 0x2:                                   // 8XY2
+          emit_mem_rdi(jit, 0x8A, 0, V_OFFSET(y));  // mov al, [vy]
+          emit_mem_rdi(jit, 0x20, 0, V_OFFSET(x));  // and [vx], al
+          return 1;
+        case 0x4:                                    // 8XY4
+          emit_mem_rdi(jit, 0x8A, 0, V_OFFSET(x));   // mov al, [vx]
+          emit_mem_rdi(jit, 0x02, 0, V_OFFSET(y));   // add al, [vy]
+          emit_setcc_cl(jit, 0x92);                  // setc cl
+          emit_mem_rdi(jit, 0x88, 1, V_OFFSET(15));  // mov [vf], cl
+          emit_mem_rdi(jit, 0x88, 0, V_OFFSET(x));   // mov [vx], al
+          return 1;
+        case 0x5:                                    // 8XY5
+          emit_mem_rdi(jit, 0x8A, 0, V_OFFSET(x));   // mov al, [vx]
+          emit_mem_rdi(jit, 0x3A, 0, V_OFFSET(y));   // cmp al, [vy]
+          emit_setcc_cl(jit, 0x93);                  // setae cl
+          emit_mem_rdi(jit, 0x88, 1, V_OFFSET(15));  // mov [vf], cl
+          emit_mem_rdi(jit, 0x8A, 0, V_OFFSET(x));   // mov al, [vx]
+          emit_mem_rdi(jit, 0x2A, 0, V_OFFSET(y));   // sub al, [vy]
+          emit_mem_rdi(jit, 0x88, 0, V_OFFSET(x));   // mov [vx], al
+          return 1;
+        default:
+          return 0;
+      }
+    case 0xA:  // AMMM
+      emit8(jit, 0x66);
+      emit_mem_rdi(jit, 0xC7, 0, I_OFFSET);  // mov word [i], nnn
+      emit8(jit, nnn & 0xFF);
+      emit8(jit, nnn >> 8);
+      return 1;
+    case 0xF:
+      if (kk != 0x1E) return 0;  // FX1E
+      emit8(jit, 0x0F);
+      emit_mem_rdi(jit, 0xB6, 0, V_OFFSET(x));  // movzx eax, byte [vx]
+      emit8(jit, 0x66);
+      emit_mem_rdi(jit, 0x01, 0, I_OFFSET);  // add [i], ax
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+static uint16_t fetch(const chip8_t* ch8, uint16_t addr) {
+  return (ch8->mem[addr] << 8) | ch8->mem[addr + 1];
+}
+
+static void flush(chip8_jit_t* jit) {
+  jit->used = 0;
+  jit->exit_count = 0;
+  jit->code_pages = 0;
+  memset(jit->state, BLOCK_UNKNOWN, sizeof(jit->state));
+}
+
+// Point pending exits to `target` at its freshly compiled code, or forget
+// them if it turned out to be uncompilable.
+static void resolve_exits(chip8_jit_t* jit, uint16_t target) {
+  for (size_t i = 0; i < jit->exit_count;) {
+    if (jit->exits[i].target == target) {
+      if (jit->state[target] == BLOCK_COMPILED) {
+        patch_rel32(jit, jit->exits[i].patch, jit->entry[target]);
+      }
+      jit->exits[i] = jit->exits[--jit->exit_count];
+    } else {
+      i++;
+    }
+  }
+}
+
+static void compile(chip8_jit_t* jit, const chip8_t* ch8, uint16_t start) {
+  if (JIT_CODE_SIZE - jit->used < JIT_MAX_BLOCK_OPS * JIT_MAX_OP_BYTES) {
+    flush(jit);
+  }
+
+  uint32_t entry = jit->used;
+
+  emit8(jit, 0x81);  // sub dword [rsi], count
+  emit8(jit, 0x2E);
+  uint32_t count_at = jit->used;
+  emit32(jit, 0);
+  emit8(jit, 0x0F);  // jl bail
+  emit8(jit, 0x8C);
+  uint32_t bail_at = jit->used;
+  emit32(jit, 0);
+
+  // Mark the block before emitting its body so a jump back to its own start
+  // is chained to it.
+  jit->state[start] = BLOCK_COMPILED;
+  jit->entry[start] = entry;
+
+  uint16_t addr = start;
+  uint32_t count = 0;
+  int result = 1;
+
+  while (count < JIT_MAX_BLOCK_OPS && addr < CHIP8_MEMORY_SIZE - 1) {
+    // Idle jumps raise an event, so they go through the interpreter.
+    if (chip8_idle_jump(ch8, addr)) break;
+    result = emit_op(jit, fetch(ch8, addr), addr);
+    if (result == 0) break;
+    count++;
+    addr += 2;
+    if (result == 2) break;
+  }
+
+  if (count == 0) {
+    jit->used = entry;
+    jit->state[start] = BLOCK_INTERPRET;
+    resolve_exits(jit, start);
+    return;
+  }
+
+  if (result != 2) emit_exit(jit, addr);
+
+  patch32(jit, count_at, count);
+  patch_rel32(jit, bail_at, jit->used);
+  emit8(jit, 0x81);  // add dword [rsi], count
+  emit8(jit, 0x06);
+  emit32(jit, count);
+  emit8(jit, 0xB8);  // mov eax, start
+  emit32(jit, start);
+  emit8(jit, 0xC3);  // ret
+
+  for (uint16_t page = start >> JIT_PAGE_SHIFT;
+       page <= (uint16_t)((addr - 1) >> JIT_PAGE_SHIFT); page++) {
+    jit->code_pages |= 1 << page;
+  }
+
+  resolve_exits(jit, start);
+}
+
+chip8_jit_t* chip8_jit_create(void) {
+  chip8_jit_t* jit = malloc(sizeof(chip8_jit_t));
+  if (jit == NULL) return NULL;
+
+  jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit->code == MAP_FAILED) {
+    free(jit);
+    return NULL;
+  }
+
+  flush(jit);
+  return jit;
+}
+
+void chip8_jit_destroy(chip8_jit_t* jit) {
+  munmap(jit->code, JIT_CODE_SIZE);
+  free(jit);
+}
+
+void chip8_jit_invalidate(chip8_jit_t* jit, uint16_t addr, uint16_t len) {
+  if (len == 0) return;
+
+  // Blocks are chained into each other, so drop all of them.
+  uint32_t last = (uint32_t)addr + len - 1;
+  for (uint32_t page = addr >> JIT_PAGE_SHIFT; page <= last >> JIT_PAGE_SHIFT;
+       page++) {
+    if (page < 16 && (jit->code_pages & (1 << page))) {
+      flush(jit);
+      return;
+    }
+  }
+}
+
+// Run until the budget is spent or an instruction raises an event, leaving
+// the unspent part of the budget behind.
+static chip8_stop_t run(chip8_jit_t* jit, chip8_t* ch8, int32_t* budget) {
+  while (*budget > 0) {
+    uint16_t ip = ch8->ip;
+
+    if (ip >= CHIP8_MEMORY_SIZE - 1) {
+      (*budget)--;
+      return chip8_run_instruction(ch8);
+    }
+
+    if (jit->state[ip] == BLOCK_UNKNOWN) compile(jit, ch8, ip);
+
+    // Compiled blocks only hold instructions that never raise events.
+    if (jit->state[ip] == BLOCK_COMPILED) {
+      int32_t before = *budget;
+      jit_block_fn fn;
+      void* entry = &jit->code[jit->entry[ip]];
+      memcpy(&fn, &entry, sizeof(fn));
+
+      ch8->ip = fn(ch8, budget);
+      chip8_tick(ch8, before - *budget);
+      if (*budget != before) continue;
+      // Not enough budget left for the whole block, step through it instead.
+    }
+
+    chip8_op_t op;
+    chip8_decode(fetch(ch8, ip), &op);
+    uint16_t addr = ch8->reg_i;
+    chip8_stop_t stop = chip8_run_instruction(ch8);
+    if (op.writes) chip8_jit_invalidate(jit, addr, op.writes);
+    (*budget)--;
+    if (stop != CHIP8_STOP_BUDGET) return stop;
+  }
+
+  return CHIP8_STOP_BUDGET;
+}
+
+chip8_stop_t chip8_jit_run(chip8_jit_t* jit, chip8_t* ch8, uint32_t budget,
+                           uint32_t* cycles_run) {
+  uint32_t count = budget;
+  chip8_stop_t stop = CHIP8_STOP_BUDGET;
+
+  ch8->event = CHIP8_STOP_BUDGET;
+  while (count > 0 && stop == CHIP8_STOP_BUDGET) {
+    int32_t slice = count > INT32_MAX ? INT32_MAX : (int32_t)count;
+    int32_t left = slice;
+    stop = run(jit, ch8, &left);
+    count -= (uint32_t)(slice - left);
+  }
+
+  if (cycles_run) *cycles_run = budget - count;
+  return stop;
+}
+
+#else
+
+chip8_jit_t* chip8_jit_create(void) { return NULL; }
+void chip8_jit_destroy(chip8_jit_t* jit) { (void)jit; }
+
+void chip8_jit_invalidate(chip8_jit_t* jit, uint16_t addr, uint16_t len) {
+  (void)jit;
+  (void)addr;
+  (void)len;
+}
+
+chip8_stop_t chip8_jit_run(chip8_jit_t* jit, chip8_t* chip8, uint32_t budget,
+                           uint32_t* cycles_run) {
+  (void)jit;
+  return chip8_run_cycles(chip8, budget, cycles_run);
+}
+
+#endif
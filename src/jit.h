@@ -0,0 +1,25 @@
+#ifndef __JIT_H__
+#define __JIT_H__
+
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Basic-block JIT compiler to x86-64. Straight-line runs of register and
+// branch instructions starting at ip are compiled to native code that works
+// on the chip8_t fields directly, and blocks jump straight into each other
+// once both are compiled. Everything else runs through chip8_run_instruction.
+typedef struct chip8_jit chip8_jit_t;
+
+// Returns NULL when the host cannot run generated code.
+chip8_jit_t* chip8_jit_create(void);
+void chip8_jit_destroy(chip8_jit_t* jit);
+
+// Drop compiled code covering [addr, addr + len). Call after writing to
+// chip8->mem from outside the core, or with the whole memory after a reset.
+void chip8_jit_invalidate(chip8_jit_t* jit, uint16_t addr, uint16_t len);
+// Same contract as chip8_run_cycles.
+chip8_stop_t chip8_jit_run(chip8_jit_t* jit, chip8_t* chip8, uint32_t budget,
+                           uint32_t* cycles_run);
+
+#endif  // __JIT_H__
@@ -1,11 +1,22 @@
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "cache.h"
 #include "chip8.h"
+#include "emulator.h"
+#include "engine.h"
+#include "farm.h"
+#include "headless.h"
 #include "miniterm.h"
+#include "renderer.h"
+#include "savestate.h"
+#include "snapshot.h"
+#include "telemetry.h"
 
 #define KEY_0 ','
 #define KEY_1 '7'
@@ -24,188 +35,555 @@
 #define KEY_E ';'
 #define KEY_F '/'
 
-enum { RENDER_DEBUG, RENDER_FRAMEBUFFER };
-
-void render(const chip8_t *ch8, int render_mode);
-void render_framebuffer(const chip8_t *ch8);
-void render_debug(const chip8_t *ch8);
-bool process_input(chip8_t *ch8, int *render_mode);
-
-char *rom = NULL;
-bool is_paused = false;
+#define FARM_DEFAULT_FRAMES 600
+
+enum { RENDER_DEBUG, RENDER_FRAMEBUFFER, RENDER_HALF_BLOCKS };
+
+// Interactive front end state, everything that is not the machine itself.
+typedef struct ui {
+  const char *rom;
+  int render_mode;
+  bool redraw;  // draw the next frame even if the machine left it unchanged
+  telemetry_t telemetry;  // this thread's phases, the emulator's copied in
+  telemetry_sink_t metrics;
+  uint64_t next_dump_ns;  // of metrics, if they have somewhere to go
+} ui_t;
+
+int run_headless(engine_t *engine, chip8_t *ch8,
+                 const headless_config_t *config);
+int run_farm(const char *rom, int kind, uint32_t cpu_hz, uint32_t machines,
+             uint32_t threads, uint64_t frames, const char *state_path);
+bool resume_states(const char *path, const uint8_t *base, chip8_t **machines,
+                   uint32_t count);
+bool suspend_states(const char *path, const uint8_t *base,
+                    const chip8_t *const *machines, uint32_t count);
+void render(renderer_t *renderer, const emulator_frame_t *frame,
+            const telemetry_t *telemetry, int render_mode,
+            uint32_t dirty_rows);
+void render_debug(const renderer_t *renderer, const emulator_frame_t *frame,
+                  const telemetry_t *telemetry);
+void gather_telemetry(ui_t *ui, const emulator_frame_t *frame);
+bool process_input(emulator_t *emulator, ui_t *ui);
+bool handle_key(emulator_t *emulator, ui_t *ui, char c);
+void write_profile(FILE *out);
+
+static const char *stop_names[] = {
+  [CHIP8_STOP_BUDGET] = "none",
+  [CHIP8_STOP_WAIT_KEY] = "waiting for key",
+  [CHIP8_STOP_FRAME] = "frame",
+  [CHIP8_STOP_ILLEGAL] = "illegal instruction",
+  [CHIP8_STOP_STACK_FAULT] = "stack fault",
+  [CHIP8_STOP_IDLE] = "idle",
+};
+
+static void usage(const char *argv0) {
+  printf(
+      "Usage: %s [-e interpreter|cache|jit] [-f cpu_hz] [-k hold_ms]\n"
+      "          [-m metrics_file|unix:metrics_socket] [-s state_file]\n"
+      "          [-H [-n frames] [-c cycles] [-i input_script]]\n"
+      "          [-F machines [-T threads] [-n frames]] [rom]\n",
+      argv0);
+}
 
 int main(int argc, char **argv) {
-  if (argc != 2) {
-    printf("Usage: %s [rom]\n", argv[0]);
+  engine_t engine;
+  int kind = ENGINE_INTERPRETER;
+  uint32_t cpu_hz = CHIP8_DEFAULT_CPU_HZ;
+  bool headless = false;
+  headless_config_t config = {.max_frames = 0, .max_cycles = 0, .script = NULL};
+  const char *script_path = NULL;
+  uint32_t machines = 0, threads = 1;
+  uint32_t hold_ms = INPUT_DEFAULT_HOLD_MS;
+  const char *metrics_path = NULL;
+  const char *state_path = NULL;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "e:f:k:m:s:Hn:c:i:F:T:")) != -1) {
+    switch (opt) {
+      case 'e':
+        kind = engine_kind(optarg);
+        if (kind < 0) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'H':
+        headless = true;
+        break;
+      case 'n':
+        config.max_frames = strtoull(optarg, NULL, 10);
+        break;
+      case 'c':
+        config.max_cycles = strtoull(optarg, NULL, 10);
+        break;
+      case 'i':
+        script_path = optarg;
+        break;
+      case 'f':
+        cpu_hz = strtoul(optarg, NULL, 10);
+        if (cpu_hz == 0) {
+          usage(argv[0]);
+          return 1;
+        }
+        break;
+      case 'k':
+        hold_ms = strtoul(optarg, NULL, 10);
+        break;
+      case 'm':
+        metrics_path = optarg;
+        break;
+      case 's':
+        state_path = optarg;
+        break;
+      case 'F':
+        machines = strtoul(optarg, NULL, 10);
+        break;
+      case 'T':
+        threads = strtoul(optarg, NULL, 10);
+        break;
+      default:
+        usage(argv[0]);
+        return 1;
+    }
+  }
+
+  if (argc - optind != 1) {
+    usage(argv[0]);
     return 1;
   }
 
-  rom = argv[1];
+  if (machines > 0) {
+#ifdef CHIP8_PROFILE
+    // The profile is shared by every machine and not locked.
+    if (threads > 1) {
+      printf("Profiling runs the farm on one thread\n");
+      threads = 1;
+    }
+#endif
+    uint64_t frames =
+        config.max_frames ? config.max_frames : FARM_DEFAULT_FRAMES;
+    return run_farm(argv[optind], kind, cpu_hz, machines, threads, frames,
+                    state_path);
+  }
 
-  srand(time(NULL));
+  ui_t ui = {.rom = argv[optind],
+             .render_mode = RENDER_FRAMEBUFFER,
+             .redraw = true,
+             .metrics = {.fd = -1}};
+  telemetry_init(&ui.telemetry);
+  if (metrics_path && !telemetry_sink_open(&ui.metrics, metrics_path)) {
+    printf("Error: could not open %s\n", metrics_path);
+    return 1;
+  }
 
+  // Headless runs keep the default seed, so their results can be compared.
   chip8_t ch8;
+  chip8_t *machine = &ch8;
+  uint8_t base[CHIP8_MEMORY_SIZE];
   chip8_init(&ch8);
-  chip8_load_rom(&ch8, rom);
+  if (!headless) chip8_seed(&ch8, time(NULL));
+  chip8_set_cpu_hz(&ch8, cpu_hz);
+  if (chip8_load_rom(&ch8, ui.rom) != OK) {
+    printf("Error: could not load %s\n", ui.rom);
+    return 1;
+  }
+  memcpy(base, ch8.mem, CHIP8_MEMORY_SIZE);
+
+  // Headless runs carry on from where the last one left off, and leave
+  // their state for the next.
+  if (headless && state_path && !resume_states(state_path, base, &machine, 1)) {
+    return 1;
+  }
+
+  if (engine_init(&engine, kind) != OK) {
+    printf("Error: the engine is not supported on this host\n");
+    return 1;
+  }
+  engine_reset(&engine, &ch8);
+
+  if (headless) {
+    if (script_path) {
+      config.script = fopen(script_path, "r");
+      if (config.script == NULL) {
+        printf("Error: could not open %s\n", script_path);
+        return 1;
+      }
+    }
+    int status = run_headless(&engine, &ch8, &config);
+    write_profile(stdout);
+    if (state_path && !suspend_states(state_path, base,
+                                      (const chip8_t *const *)&machine, 1)) {
+      status = 1;
+    }
+    if (config.script) fclose(config.script);
+    engine_destroy(&engine);
+    return status;
+  }
 
   mterm_init();
+  renderer_t renderer;
+  renderer_init(&renderer, STDOUT_FILENO);
+
+  // Emulation runs on its own thread, this one handles the terminal: input
+  // goes out as soon as it is typed and the newest frame is drawn as soon as
+  // it is ready, however long drawing the previous one took.
+  emulator_t *emulator = emulator_start(&ch8, &engine, hold_ms, state_path);
+  if (emulator == NULL) {
+    mterm_teardown();
+    printf("Error: could not start the emulation thread\n");
+    return 1;
+  }
 
-  int render_mode = RENDER_FRAMEBUFFER;
+  const emulator_frame_t *frame = NULL;
   bool running = true;
+  ui.next_dump_ns = input_now_ns() + TELEMETRY_DUMP_MS * 1000000ull;
 
   while (running) {
-    running = process_input(&ch8, &render_mode);
+    struct pollfd fds[2] = {
+        {.fd = STDIN_FILENO, .events = POLLIN},
+        {.fd = emulator_frame_fd(emulator), .events = POLLIN},
+    };
+    poll(fds, 2, ui.metrics.fd >= 0 ? TELEMETRY_DUMP_MS : -1);
+
+    uint64_t start = input_now_ns();
+    if (fds[0].revents & POLLIN) {
+      running = process_input(emulator, &ui);
+      histogram_record(&ui.telemetry.phases[TELEMETRY_INPUT],
+                       input_now_ns() - start);
+    }
 
-    if (!is_paused) {
-      for (int i = 0; i < 10; i++) {
-        chip8_run_instruction(&ch8);
+    const emulator_frame_t *newest = emulator_frame(emulator);
+    uint32_t dirty_rows = 0;
+    if (newest != NULL) {
+      frame = newest;
+      dirty_rows = frame->dirty_rows;
+      // Stopped on a fault, show it.
+      if (frame->stop == CHIP8_STOP_ILLEGAL ||
+          frame->stop == CHIP8_STOP_STACK_FAULT) {
+        ui.render_mode = RENDER_DEBUG;
       }
     }
 
-    render(&ch8, render_mode);
+    if (frame != NULL && (newest != NULL || ui.redraw)) {
+      gather_telemetry(&ui, frame);
+      start = input_now_ns();
+      render(&renderer, frame, &ui.telemetry, ui.render_mode, dirty_rows);
+      histogram_record(&ui.telemetry.phases[TELEMETRY_RENDER],
+                       input_now_ns() - start);
+      ui.redraw = false;
+    }
 
-    usleep(1.0 / 60.0 * 1000.0 * 1000.0);
+    if (ui.metrics.fd >= 0 && input_now_ns() >= ui.next_dump_ns) {
+      if (frame != NULL) gather_telemetry(&ui, frame);
+      uint64_t now = input_now_ns();
+      telemetry_dump(&ui.metrics, &ui.telemetry, now);
+      ui.next_dump_ns = now + TELEMETRY_DUMP_MS * 1000000ull;
+    }
   }
-}
 
-void render(const chip8_t *ch8, int render_mode) {
-  mterm_clear_screen();
-  mterm_set_cursor_pos(0, 0);
+  // Frames go away with the emulator.
+  if (frame != NULL) gather_telemetry(&ui, frame);
+  pacer_stats_t pacing = frame != NULL ? frame->pacing : (pacer_stats_t){0};
+  input_stats_t input = frame != NULL ? frame->input : (input_stats_t){0};
+  emulator_stop(emulator);
+  mterm_teardown();
+
+  renderer_report(&renderer, stderr);
+  pacer_report(&pacing, stderr);
+  input_report(&input, stderr);
+  telemetry_report(&ui.telemetry, stderr);
+  if (ui.metrics.fd >= 0) {
+    telemetry_dump(&ui.metrics, &ui.telemetry, input_now_ns());
+    telemetry_sink_close(&ui.metrics);
+  }
+  if (engine.kind == ENGINE_CACHE) chip8_cache_report(engine.cache, stderr);
+  write_profile(stderr);
+  engine_destroy(&engine);
+}
 
-  if (render_mode == RENDER_DEBUG) {
-    render_debug(ch8);
-  } else if (render_mode == RENDER_FRAMEBUFFER) {
-    render_framebuffer(ch8);
+// Report the guest profile in builds that have one, and save its call tree
+// for flame graphs.
+void write_profile(FILE *out) {
+#ifdef CHIP8_PROFILE
+  chip8_profile_report(out);
+  if (chip8_profile_write_folded(CHIP8_PROFILE_PATH) != OK) {
+    fprintf(out, "Error: could not write %s\n", CHIP8_PROFILE_PATH);
+  } else {
+    fprintf(out, "Call tree written to %s\n", CHIP8_PROFILE_PATH);
   }
+#else
+  (void)out;
+#endif
+}
 
-  fflush(stdout);
+int run_headless(engine_t *engine, chip8_t *ch8,
+                 const headless_config_t *config) {
+  headless_stats_t stats;
+
+  if (headless_run(engine, ch8, config, &stats) != OK) return 1;
+
+  headless_report(&stats, stdout);
+  if (engine->kind == ENGINE_CACHE) chip8_cache_report(engine->cache, stdout);
+  return stats.end == HEADLESS_FAULT ? 1 : 0;
 }
 
-void render_framebuffer(const chip8_t *ch8) {
-  const uint8_t *framebuffer_end = &ch8->framebuffer[CHIP8_FRAMEBUFFER_SIZE];
-  const uint8_t *framebuffer_ptr = &ch8->framebuffer[0];
-  uint8_t row = 0, col = 0;
+// Run `machines` copies of the ROM side by side, each with its own seed, and
+// report how fast they went. With a save state file they pick up from it,
+// if it is there, and are suspended to it at the end.
+int run_farm(const char *rom, int kind, uint32_t cpu_hz, uint32_t machines,
+             uint32_t threads, uint64_t frames, const char *state_path) {
+  chip8_farm_t *farm = chip8_farm_create(machines, threads, kind);
+  if (farm == NULL) {
+    printf("Error: could not set up %u machines on %u threads\n", machines,
+           threads);
+    return 1;
+  }
 
-  if (ch8->tone_clock) fprintf(stdout, "\a");
+  // The ROM is read once, and every other machine starts as a clone.
+  chip8_t *first = chip8_farm_machine(farm, 0);
+  chip8_set_cpu_hz(first, cpu_hz);
+  if (chip8_load_rom(first, rom) != OK) {
+    printf("Error: could not load %s\n", rom);
+    chip8_farm_destroy(farm);
+    return 1;
+  }
+  uint8_t base[CHIP8_MEMORY_SIZE];
+  memcpy(base, first->mem, CHIP8_MEMORY_SIZE);
+  chip8_t **all = malloc(machines * sizeof(chip8_t *));
+  if (all == NULL) {
+    printf("Error: out of memory\n");
+    chip8_farm_destroy(farm);
+    return 1;
+  }
+  for (uint32_t i = 0; i < machines; i++) {
+    all[i] = chip8_farm_machine(farm, i);
+    if (i > 0) chip8_clone(all[i], first);
+    chip8_seed(all[i], i + 1);
+  }
+  bool ok = state_path == NULL || resume_states(state_path, base, all, machines);
+  for (uint32_t i = 0; i < machines; i++) chip8_farm_reset(farm, i);
 
-  while (framebuffer_ptr != framebuffer_end) {
-    uint8_t byte = *framebuffer_ptr;
+  if (ok) {
+    // One frame per batch, as a front end driving them live would.
+    for (uint64_t frame = 0; frame < frames; frame++) chip8_farm_run(farm, 1);
+    chip8_farm_report(farm, stdout, machines <= 16);
+  }
+  if (ok && state_path) {
+    ok = suspend_states(state_path, base, (const chip8_t *const *)all,
+                        machines);
+  }
 
-    for (int i = 7; i >= 0; i--) {
-      uint8_t bit = (byte >> i) & 0x01;
-      fprintf(stdout, "\x1b[%dm  ", bit ? 42 : 49);
+  free(all);
+  chip8_farm_destroy(farm);
+  return ok ? 0 : 1;
+}
 
-      col++;
-      if (col == CHIP8_FRAMEBUFFER_X_LEN && row < CHIP8_FRAMEBUFFER_MAX_Y) {
-        row++;
-        col = 0;
-        fprintf(stdout, "\r\n");
-      }
-    }
+// Load every machine from the save state file at path, unless there is no
+// such file yet. Returns false, with an error printed, if it cannot be read
+// or holds other states than these.
+bool resume_states(const char *path, const uint8_t *base, chip8_t **machines,
+                   uint32_t count) {
+  chip8_savestate_t states;
+
+  if (access(path, F_OK) != 0) return true;
+  if (chip8_savestate_open(&states, path) != OK) {
+    printf("Error: %s is not a save state file\n", path);
+    return false;
+  }
+  bool ok = states.count == count &&
+            memcmp(states.base, base, CHIP8_MEMORY_SIZE) == 0;
+  if (!ok) {
+    printf("Error: %s holds %u states of another ROM or count\n", path,
+           states.count);
+  }
+  for (uint32_t i = 0; ok && i < count; i++) {
+    ok = chip8_savestate_load(&states, i, machines[i]) == OK;
+    if (!ok) printf("Error: state %u in %s is damaged\n", i, path);
+  }
+  chip8_savestate_close(&states);
+  return ok;
+}
 
-    framebuffer_ptr++;
+bool suspend_states(const char *path, const uint8_t *base,
+                    const chip8_t *const *machines, uint32_t count) {
+  if (chip8_savestate_save(path, base, machines, count) != OK) {
+    printf("Error: could not write %s\n", path);
+    return false;
+  }
+  return true;
+}
+
+// The display goes through the renderer, which only sends what changed, as
+// either full or half blocks. The debug view is redrawn in full, after which
+// the renderer starts over.
+void render(renderer_t *renderer, const emulator_frame_t *frame,
+            const telemetry_t *telemetry, int render_mode,
+            uint32_t dirty_rows) {
+  if (render_mode != RENDER_DEBUG) {
+    renderer_set_mode(renderer, render_mode == RENDER_FRAMEBUFFER
+                                    ? RENDERER_BLOCKS
+                                    : RENDERER_HALF_BLOCKS);
+    renderer_draw(renderer, &frame->machine, dirty_rows);
+    return;
   }
 
-  fprintf(stdout, "\x1b[49m  ");
+  mterm_clear_screen();
+  mterm_set_cursor_pos(0, 0);
+  render_debug(renderer, frame, telemetry);
+  fflush(stdout);
+  renderer_invalidate(renderer);
 }
 
-void render_debug(const chip8_t *ch8) {
+void render_debug(const renderer_t *renderer, const emulator_frame_t *frame,
+                  const telemetry_t *telemetry) {
+  const chip8_t *ch8 = &frame->machine;
+  const pacer_stats_t *pacing = &frame->pacing;
+
   printf("---- Chip8 Debug ----\r\n");
   printf("  ip: %04X\r\n", ch8->ip);
   printf("  reg_i: %04X\r\n", ch8->reg_i);
   for (int i = 0; i < CHIP8_REGISTER_COUNT; i++)
     printf("  reg_v[%d]: %02X\r\n", i, ch8->reg_v[i]);
-  printf("  timer: %02X\r\n", ch8->timer);
-  printf("  tone_clock: %02X\r\n", ch8->tone_clock);
-  printf("  keypress: %02X\r\n", ch8->keypress);
+  printf("  timer: %02X\r\n", chip8_timer(ch8));
+  printf("  tone_clock: %02X\r\n", chip8_tone(ch8));
+  printf("  cycle: %llu\r\n", (unsigned long long)ch8->cycle);
+  printf("  keys: %04X\r\n", ch8->keys);
+  printf("  event: %s\r\n", stop_names[ch8->event]);
+  printf("  render: %u bytes in %u writes last frame\r\n",
+         renderer->frame_bytes, renderer->frame_syscalls);
+  printf("  pacing: %llu skipped, %.3f ms max late\r\n",
+         (unsigned long long)pacing->skipped, pacing->max_late_ns / 1e6);
+  printf("  input: %.3f ms max latency\r\n", frame->input.max_latency_ns / 1e6);
+  printf("  host ms   p50    p99    max\r\n");
+  for (int phase = 0; phase < TELEMETRY_PHASES; phase++) {
+    const histogram_t *histogram = &telemetry->phases[phase];
+    printf("  %-7s %6.3f %6.3f %6.3f\r\n", telemetry_phase_name(phase),
+           histogram_percentile(histogram, 50) / 1e6,
+           histogram_percentile(histogram, 99) / 1e6,
+           histogram->max_ns / 1e6);
+  }
+  printf("  missed: %llu frames\r\n", (unsigned long long)telemetry->missed);
+  printf("  rewind: %u frames, %u keyframes, %zu KB\r\n", frame->rewind.frames,
+         frame->rewind.keyframes, frame->rewind.bytes / 1024);
+  printf("  states: %u saved, %u loaded, %u failed\r\n", frame->saves,
+         frame->loads, frame->save_errors);
   printf("---------------------\r\n");
+  chip8_code_report(ch8, stdout);
+}
 
-  for (int i = -2; i < 6; i++) {
-    uint16_t ip = ch8->ip + i * 2;
+// Bring the emulation thread's phases, as of `frame`, in with this thread's.
+void gather_telemetry(ui_t *ui, const emulator_frame_t *frame) {
+  ui->telemetry.phases[TELEMETRY_EMULATE] =
+      frame->telemetry.phases[TELEMETRY_EMULATE];
+  ui->telemetry.phases[TELEMETRY_SLEEP] =
+      frame->telemetry.phases[TELEMETRY_SLEEP];
+  ui->telemetry.missed = frame->telemetry.missed;
+}
+
+// Handle everything typed since the last call, so a burst of keys all goes
+// out at once.
+bool process_input(emulator_t *emulator, ui_t *ui) {
+  char keys[32];
+  int bytes_read;
 
-    printf("%s %04X: %02X%02X\r\n", i == 0 ? ">" : " ", ip, ch8->mem[ip + i],
-           ch8->mem[ip + i + 1]);
+  while ((bytes_read = read(STDIN_FILENO, keys, sizeof(keys))) > 0) {
+    for (int i = 0; i < bytes_read; i++) {
+      if (!handle_key(emulator, ui, keys[i])) return false;
+    }
   }
+  return true;
 }
 
-bool process_input(chip8_t *ch8, int *render_mode) {
-  char c;
-  int bytes_read = read(STDIN_FILENO, &c, 1);
-  if (bytes_read == 0) { /* timeout */ }
-
-  ch8->keypress = CHIP8_NO_KEY_PRESSED;
+bool handle_key(emulator_t *emulator, ui_t *ui, char c) {
+  int key = -1;
 
   switch (c) {
     case KEY_0:
-      ch8->keypress = 0x00;
+      key = 0x00;
       break;
     case KEY_1:
-      ch8->keypress = 0x01;
+      key = 0x01;
       break;
     case KEY_2:
-      ch8->keypress = 0x02;
+      key = 0x02;
       break;
     case KEY_3:
-      ch8->keypress = 0x03;
+      key = 0x03;
       break;
     case KEY_4:
-      ch8->keypress = 0x04;
+      key = 0x04;
       break;
     case KEY_5:
-      ch8->keypress = 0x05;
+      key = 0x05;
       break;
     case KEY_6:
-      ch8->keypress = 0x06;
+      key = 0x06;
       break;
     case KEY_7:
-      ch8->keypress = 0x07;
+      key = 0x07;
       break;
     case KEY_8:
-      ch8->keypress = 0x08;
+      key = 0x08;
       break;
     case KEY_9:
-      ch8->keypress = 0x09;
+      key = 0x09;
       break;
     case KEY_A:
-      ch8->keypress = 0x0A;
+      key = 0x0A;
       break;
     case KEY_B:
-      ch8->keypress = 0x0B;
+      key = 0x0B;
       break;
     case KEY_C:
-      ch8->keypress = 0x0C;
+      key = 0x0C;
       break;
     case KEY_D:
-      ch8->keypress = 0x0D;
+      key = 0x0D;
       break;
     case KEY_E:
-      ch8->keypress = 0x0E;
+      key = 0x0E;
       break;
     case KEY_F:
-      ch8->keypress = 0x0F;
+      key = 0x0F;
       break;
 
     case 'd':  // Switch render mode
-      *render_mode = (*render_mode + 1) % (RENDER_FRAMEBUFFER + 1);
+      ui->render_mode = (ui->render_mode + 1) % (RENDER_HALF_BLOCKS + 1);
+      ui->redraw = true;
       break;
 
     case 'r':  // Reset
-      chip8_init(ch8);
-      chip8_load_rom(ch8, rom);
+      emulator_send(emulator, EMULATOR_RESET, 0);
       break;
 
     case '1':  // Run one instruction and wait
-      is_paused = true;
-      chip8_run_instruction(ch8);
+      emulator_send(emulator, EMULATOR_STEP, 0);
       break;
 
     case '2':  // Run (resume)
-      is_paused = false;
+      emulator_send(emulator, EMULATOR_RESUME, 0);
+      break;
+
+    case 'b':  // Go back one frame, or one step while stepping
+      emulator_send(emulator, EMULATOR_REWIND, 1);
+      break;
+
+    case 'B':  // Go back one second
+      emulator_send(emulator, EMULATOR_REWIND, CHIP8_TIMER_HZ);
+      break;
+
+    case 'S':  // Save state
+      emulator_send(emulator, EMULATOR_SAVE, 0);
+      break;
+
+    case 'L':  // Load state
+      emulator_send(emulator, EMULATOR_LOAD, 0);
       break;
 
     case 'q':  // Quit
       return false;
   }
 
+  if (key >= 0) emulator_send(emulator, EMULATOR_KEY, key);
   return true;
 }
@@ -9,6 +9,7 @@
   fflush(stdout);
 
 static struct termios orig_termios;
+static bool is_active = false;
 
 void mterm_init(void) {
   tcgetattr(STDIN_FILENO, &orig_termios);
@@ -19,6 +20,7 @@ void mterm_init(void) {
   raw_termios.c_cc[VMIN] = 0;
   raw_termios.c_cc[VTIME] = 0;
   tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw_termios);
+  is_active = true;
 
   mterm_clear_screen();
   mterm_show_cursor(false);
@@ -26,6 +28,9 @@ void mterm_init(void) {
 }
 
 void mterm_teardown(void) {
+  if (!is_active) return;
+  is_active = false;
+
   mterm_clear_screen();
   mterm_set_cursor_pos(0, 0);
   mterm_show_cursor(true);
@@ -33,6 +38,7 @@ void mterm_teardown(void) {
 }
 
 void mterm_clear_screen(void) {
+  write(STDOUT_FILENO, "\x1b[0m", 4);  // Default colors, to erase with
   write(STDOUT_FILENO, "\x1b[2J", 4);  // Erase entire screen
   write(STDOUT_FILENO, "\x1b[3J", 4);  // Erase scrollback
 }
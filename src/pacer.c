@@ -0,0 +1,87 @@
+#include "pacer.h"
+
+#include <errno.h>
+#include <poll.h>
+
+#define NS_PER_SECOND 1000000000L
+#define NS_PER_MS 1000000L
+
+static int64_t ns_between(const struct timespec* from,
+                          const struct timespec* to) {
+  return (to->tv_sec - from->tv_sec) * NS_PER_SECOND +
+         (to->tv_nsec - from->tv_nsec);
+}
+
+static struct timespec add_ns(struct timespec time, int64_t ns) {
+  ns += time.tv_nsec;
+  time.tv_sec += ns / NS_PER_SECOND;
+  time.tv_nsec = ns % NS_PER_SECOND;
+  return time;
+}
+
+void pacer_init(pacer_t* pacer, uint32_t hz) {
+  clock_gettime(CLOCK_MONOTONIC, &pacer->deadline);
+  pacer->period_ns = NS_PER_SECOND / hz;
+  pacer->stats = (pacer_stats_t){0};
+}
+
+uint32_t pacer_frames_due(pacer_t* pacer, uint32_t max_frames) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  int64_t behind = ns_between(&pacer->deadline, &now);
+  if (behind < 0) return 0;
+
+  uint64_t frames = behind / pacer->period_ns + 1;
+  if (frames > max_frames) {
+    // The backlog is dropped, so pacing starts over with the next frame a
+    // period from now.
+    pacer->stats.skipped += frames - max_frames;
+    pacer->deadline = add_ns(now, pacer->period_ns);
+    frames = max_frames;
+  } else {
+    pacer->deadline = add_ns(pacer->deadline, frames * pacer->period_ns);
+  }
+
+  pacer->stats.frames += frames;
+  return frames;
+}
+
+bool pacer_wait(pacer_t* pacer, int fd, int64_t frames) {
+  struct pollfd pollfd = {.fd = fd, .events = POLLIN};
+
+  if (frames < 0) return poll(&pollfd, 1, -1) > 0;
+
+  struct timespec target = add_ns(
+      pacer->deadline, (frames > 0 ? frames - 1 : 0) * pacer->period_ns);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t ns = ns_between(&now, &target);
+  if (ns <= 0) return poll(&pollfd, 1, 0) > 0;
+
+  // poll() only counts whole milliseconds, so it waits for input up to the
+  // last one before the deadline and clock_nanosleep() sleeps off the rest.
+  if (poll(&pollfd, 1, ns / NS_PER_MS) > 0) return true;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) ==
+         EINTR) {
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t late = ns_between(&target, &now);
+  pacer->stats.sleeps++;
+  pacer->stats.late_ns += late;
+  if (late > pacer->stats.max_late_ns) pacer->stats.max_late_ns = late;
+  return false;
+}
+
+void pacer_report(const pacer_stats_t* stats, FILE* out) {
+  fprintf(out, "Pacer: %llu frames, %llu skipped",
+          (unsigned long long)stats->frames,
+          (unsigned long long)stats->skipped);
+  if (stats->sleeps > 0) {
+    fprintf(out, ", woke %.3f ms late on average, %.3f ms at worst",
+            stats->late_ns / (double)stats->sleeps / NS_PER_MS,
+            stats->max_late_ns / (double)NS_PER_MS);
+  }
+  fprintf(out, "\n");
+}
@@ -0,0 +1,40 @@
+#ifndef __PACER_H__
+#define __PACER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef struct pacer_stats {
+  uint64_t frames;       // handed out by pacer_frames_due
+  uint64_t skipped;      // dropped after falling too far behind
+  uint64_t sleeps;       // waits that ran until their deadline
+  uint64_t late_ns;      // total time those woke up after it
+  uint64_t max_late_ns;  // worst of them
+} pacer_stats_t;
+
+// Paces frames against absolute deadlines on CLOCK_MONOTONIC, one period
+// apart, so time spent working never pushes later frames back.
+typedef struct pacer {
+  struct timespec deadline;  // when the next frame is due
+  int64_t period_ns;
+  pacer_stats_t stats;
+} pacer_t;
+
+// The first frame is due straight away.
+void pacer_init(pacer_t* pacer, uint32_t hz);
+
+// Frames whose deadline has passed since the last call, moving the deadline
+// past them. Falling further behind than max_frames (a stall, or a suspended
+// terminal) drops the backlog instead of running it all at once.
+uint32_t pacer_frames_due(pacer_t* pacer, uint32_t max_frames);
+
+// Sleep until the next frame is due, or `frames` frames later, returning
+// early if fd becomes readable. Negative frames wait for fd alone. Returns
+// whether fd is readable.
+bool pacer_wait(pacer_t* pacer, int fd, int64_t frames);
+
+void pacer_report(const pacer_stats_t* stats, FILE* out);
+
+#endif  // __PACER_H__
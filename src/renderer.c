@@ -0,0 +1,211 @@
+#include "renderer.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#define COLOR_ON 42      // green background
+#define COLOR_OFF 49     // default background
+#define COLOR_FG_ON 32   // green foreground, for half blocks
+
+// Unchanged cells between two changed ones that are cheaper to write over
+// again than to skip with a cursor move, which takes at least six bytes.
+#define MAX_GAP 2
+
+// Half block cells by their upper and lower pixel: a space, a lower or
+// upper half block, or a full block.
+static const struct {
+  uint8_t length;
+  char text[4];
+} half_blocks[4] = {
+  {1, " "},
+  {3, "\u2584"},
+  {3, "\u2580"},
+  {3, "\u2588"},
+};
+
+static void put(renderer_t* renderer, const char* text, size_t length) {
+  memcpy(&renderer->buffer[renderer->length], text, length);
+  renderer->length += length;
+}
+
+static void put_number(renderer_t* renderer, int number) {
+  char digits[12];
+  int count = 0;
+  do {
+    digits[count++] = '0' + number % 10;
+    number /= 10;
+  } while (number > 0);
+  while (count > 0) renderer->buffer[renderer->length++] = digits[--count];
+}
+
+static void move_to(renderer_t* renderer, int line, int column) {
+  put(renderer, "\x1b[", 2);
+  put_number(renderer, line + 1);
+  renderer->buffer[renderer->length++] = ';';
+  put_number(renderer, renderer->mode == RENDERER_BLOCKS ? 2 * column + 1
+                                                         : column + 1);
+  renderer->buffer[renderer->length++] = 'H';
+  renderer->line = line;
+  renderer->column = column;
+}
+
+static void set_color(renderer_t* renderer, int color) {
+  if (renderer->color == color) return;
+  put(renderer, "\x1b[", 2);
+  put_number(renderer, color);
+  renderer->buffer[renderer->length++] = 'm';
+  renderer->color = color;
+}
+
+static bool lit(uint64_t row, int x) {
+  return (row >> (CHIP8_FRAMEBUFFER_MAX_X - x)) & 1;
+}
+
+static void put_cell(renderer_t* renderer, bool on) {
+  set_color(renderer, on ? COLOR_ON : COLOR_OFF);
+  put(renderer, "  ", 2);
+  renderer->column++;
+}
+
+static void draw_row(renderer_t* renderer, int y, uint64_t row) {
+  uint64_t changed = row ^ renderer->shown[y];
+
+  while (changed) {
+    int x = __builtin_clzll(changed);
+    int gap = x - renderer->column;
+    if (renderer->line != y || gap < 0 || gap > MAX_GAP) {
+      move_to(renderer, y, x);
+    }
+    // Cells written over again are unchanged, so row has them right.
+    while (renderer->column < x) put_cell(renderer, lit(row, renderer->column));
+    put_cell(renderer, lit(row, x));
+    changed &= ~(1ull << (CHIP8_FRAMEBUFFER_MAX_X - x));
+  }
+
+  renderer->shown[y] = row;
+}
+
+static void put_half_block(renderer_t* renderer, uint64_t upper,
+                           uint64_t lower) {
+  int x = renderer->column;
+  int glyph = lit(upper, x) << 1 | lit(lower, x);
+  put(renderer, half_blocks[glyph].text, half_blocks[glyph].length);
+  renderer->column++;
+}
+
+// Rows y and y + 1 as one line of half blocks. Only the cells that changed
+// are sent, skipping the others like draw_row does.
+static void draw_half_rows(renderer_t* renderer, int y, uint64_t upper,
+                           uint64_t lower) {
+  uint64_t changed = (upper ^ renderer->shown[y]) |
+                     (lower ^ renderer->shown[y + 1]);
+
+  if (changed) set_color(renderer, COLOR_FG_ON);
+  while (changed) {
+    int x = __builtin_clzll(changed);
+    int gap = x - renderer->column;
+    if (renderer->line != y / 2 || gap < 0 || gap > MAX_GAP) {
+      move_to(renderer, y / 2, x);
+    }
+    while (renderer->column <= x) put_half_block(renderer, upper, lower);
+    changed &= ~(1ull << (CHIP8_FRAMEBUFFER_MAX_X - x));
+  }
+
+  renderer->shown[y] = upper;
+  renderer->shown[y + 1] = lower;
+}
+
+static void flush(renderer_t* renderer) {
+  size_t sent = 0;
+
+  renderer->frame_bytes = renderer->length;
+  renderer->frame_syscalls = 0;
+  while (sent < renderer->length) {
+    ssize_t written = write(renderer->fd, &renderer->buffer[sent],
+                            renderer->length - sent);
+    renderer->frame_syscalls++;
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      // No telling how much arrived, so start over next frame.
+      renderer->valid = false;
+      break;
+    }
+    sent += written;
+  }
+
+  renderer->frames++;
+  renderer->bytes += renderer->length;
+  renderer->syscalls += renderer->frame_syscalls;
+}
+
+void renderer_init(renderer_t* renderer, int fd) {
+  renderer->fd = fd;
+  renderer->mode = RENDERER_BLOCKS;
+  renderer->frames = 0;
+  renderer->bytes = 0;
+  renderer->syscalls = 0;
+  renderer->frame_bytes = 0;
+  renderer->frame_syscalls = 0;
+  renderer_invalidate(renderer);
+}
+
+void renderer_set_mode(renderer_t* renderer, int mode) {
+  if (renderer->mode == mode) return;
+  renderer->mode = mode;
+  renderer_invalidate(renderer);
+}
+
+void renderer_invalidate(renderer_t* renderer) {
+  renderer->valid = false;
+  renderer->color = -1;
+}
+
+void renderer_draw(renderer_t* renderer, const chip8_t* ch8,
+                   uint32_t dirty_rows) {
+  renderer->length = 0;
+  renderer->line = -1;
+  renderer->column = -1;
+
+  if (!renderer->valid) {
+    // Reset the colors first, as erasing fills with the current background.
+    put(renderer, "\x1b[0m\x1b[H\x1b[2J", 11);
+    renderer->color = COLOR_OFF;
+    memset(renderer->shown, 0, sizeof(renderer->shown));
+    dirty_rows = CHIP8_FRAMEBUFFER_ALL_ROWS;
+    renderer->valid = true;
+  }
+
+  if (chip8_tone(ch8)) put(renderer, "\a", 1);
+
+  if (renderer->mode == RENDERER_BLOCKS) {
+    while (dirty_rows) {
+      int y = __builtin_ctz(dirty_rows);
+      draw_row(renderer, y, chip8_row(ch8, y));
+      dirty_rows &= dirty_rows - 1;
+    }
+  } else {
+    // One bit per pair of rows, on the upper one.
+    uint32_t pairs = (dirty_rows | dirty_rows >> 1) & 0x55555555u;
+    while (pairs) {
+      int y = __builtin_ctz(pairs);
+      draw_half_rows(renderer, y, chip8_row(ch8, y), chip8_row(ch8, y + 1));
+      pairs &= pairs - 1;
+    }
+  }
+
+  flush(renderer);
+}
+
+void renderer_report(const renderer_t* renderer, FILE* out) {
+  fprintf(out, "Renderer: %llu frames, %llu bytes in %llu writes",
+          (unsigned long long)renderer->frames,
+          (unsigned long long)renderer->bytes,
+          (unsigned long long)renderer->syscalls);
+  if (renderer->frames > 0) {
+    fprintf(out, ", %.1f bytes and %.2f writes per frame",
+            renderer->bytes / (double)renderer->frames,
+            renderer->syscalls / (double)renderer->frames);
+  }
+  fprintf(out, "\n");
+}
@@ -0,0 +1,68 @@
+#ifndef __RENDERER_H__
+#define __RENDERER_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "chip8.h"
+
+// Worst case for one cell: a cursor move, a color change and the cell.
+#define RENDERER_CELL_MAX \
+  (sizeof("\x1b[32;128H") - 1 + sizeof("\x1b[42m") - 1 + 2)
+#define RENDERER_BUFFER_SIZE                                              \
+  (CHIP8_FRAMEBUFFER_X_LEN * CHIP8_FRAMEBUFFER_Y_LEN * RENDERER_CELL_MAX + \
+   64)
+
+enum {
+  RENDERER_BLOCKS,       // two blank columns per pixel, lit ones colored
+  RENDERER_HALF_BLOCKS,  // one column per pixel and one line per two rows
+};
+
+// Draws the display into a terminal, in one of the modes above. It remembers
+// what the terminal shows and only sends the cells that changed since, with
+// the cursor moves and color changes they need, as one write per frame.
+typedef struct renderer {
+  int fd;
+  int mode;
+  bool valid;  // shown is what the terminal has on screen
+  uint64_t shown[CHIP8_FRAMEBUFFER_Y_LEN];
+
+  // Where the terminal cursor is left while building a frame, -1 if
+  // unknown. Columns count cells of the current mode. The color carries over
+  // from one frame to the next.
+  int line;
+  int column;
+  int color;
+
+  size_t length;
+  char buffer[RENDERER_BUFFER_SIZE];
+
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t syscalls;
+  uint32_t frame_bytes;  // sent for the last frame
+  uint32_t frame_syscalls;
+} renderer_t;
+
+void renderer_init(renderer_t* renderer, int fd);
+
+// Switch modes, redrawing everything next frame if that changes the layout.
+void renderer_set_mode(renderer_t* renderer, int mode);
+
+// Forget what the terminal shows, after something else has written to it.
+// The next frame clears the screen and draws everything.
+void renderer_invalidate(renderer_t* renderer);
+
+// Bring the terminal up to date with the machine's display, looking only at
+// `dirty_rows` (see chip8_dirty_rows) unless a full redraw is due. Rings the
+// bell while the sound timer runs. Writes nothing if nothing changed. The
+// terminal is left in the last color drawn with, so anything else written to
+// it should reset the colors first, as mterm_clear_screen does.
+void renderer_draw(renderer_t* renderer, const chip8_t* chip8,
+                   uint32_t dirty_rows);
+
+// Print how much was sent, per frame and in total.
+void renderer_report(const renderer_t* renderer, FILE* out);
+
+#endif  // __RENDERER_H__
@@ -0,0 +1,227 @@
+#include "rewind.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// States are handled as whole words. chip8_t holds 64-bit fields, so its
+// size is a multiple of theirs.
+#define STATE_WORDS (sizeof(chip8_t) / sizeof(uint64_t))
+#define RUN_HEADER 4  // words left alone (u16), then words changed (u16)
+
+// Runs of changed words are at least one unchanged word apart.
+#define MAX_DELTA_SIZE \
+  (sizeof(chip8_t) + (STATE_WORDS + 1) / 2 * RUN_HEADER)
+#define MAX_RECORD_SIZE (sizeof(chip8_t) + MAX_DELTA_SIZE)
+
+// A recorded frame, in the arena at offset: a full copy of the machine for
+// keyframes, then the delta from the frame before.
+typedef struct entry {
+  uint32_t offset;
+  uint32_t size;
+  bool keyframe;
+} entry_t;
+
+struct rewind {
+  uint8_t* arena;
+  size_t arena_size;
+  size_t write;  // where the next frame goes
+  size_t used;   // by the frames kept
+
+  // Frames from oldest to newest, a ring of `capacity`.
+  entry_t* entries;
+  uint32_t capacity;
+  uint32_t first;
+  uint32_t count;
+  uint32_t keyframes;
+  uint32_t since_keyframe;  // frames recorded after the newest keyframe
+
+  uint64_t last[STATE_WORDS];       // the newest frame
+  uint8_t record[MAX_RECORD_SIZE];  // being encoded, before it has a place
+};
+
+rewind_t* rewind_create(size_t bytes, uint32_t frames) {
+  if (bytes < MAX_RECORD_SIZE || frames < 2) return NULL;
+
+  rewind_t* rewind = malloc(sizeof(rewind_t));
+  if (rewind == NULL) return NULL;
+  rewind->arena = malloc(bytes);
+  rewind->entries = malloc(frames * sizeof(entry_t));
+  if (rewind->arena == NULL || rewind->entries == NULL) {
+    rewind_destroy(rewind);
+    return NULL;
+  }
+
+  rewind->arena_size = bytes;
+  rewind->capacity = frames;
+  rewind_clear(rewind);
+  return rewind;
+}
+
+void rewind_destroy(rewind_t* rewind) {
+  free(rewind->arena);
+  free(rewind->entries);
+  free(rewind);
+}
+
+void rewind_clear(rewind_t* rewind) {
+  rewind->write = 0;
+  rewind->used = 0;
+  rewind->first = 0;
+  rewind->count = 0;
+  rewind->keyframes = 0;
+  rewind->since_keyframe = 0;
+  memset(rewind->last, 0, sizeof(rewind->last));
+}
+
+static entry_t* entry(const rewind_t* rewind, uint32_t index) {
+  return &rewind->entries[(rewind->first + index) % rewind->capacity];
+}
+
+static void drop_oldest(rewind_t* rewind) {
+  entry_t* oldest = entry(rewind, 0);
+  rewind->used -= oldest->size;
+  rewind->keyframes -= oldest->keyframe;
+  rewind->first = (rewind->first + 1) % rewind->capacity;
+  rewind->count--;
+}
+
+// Room for `size` bytes at the write position, dropping the oldest frames
+// in the way. Frames lie in the arena in the order they were recorded,
+// wrapping around to the start, so the ones past the write position are
+// always the oldest.
+static uint8_t* reserve(rewind_t* rewind, size_t size) {
+  if (rewind->write + size > rewind->arena_size) {
+    while (rewind->count > 0 && entry(rewind, 0)->offset >= rewind->write) {
+      drop_oldest(rewind);
+    }
+    rewind->write = 0;
+  }
+  while (rewind->count > 0 &&
+         entry(rewind, 0)->offset < rewind->write + size &&
+         entry(rewind, 0)->offset + entry(rewind, 0)->size > rewind->write) {
+    drop_oldest(rewind);
+  }
+  if (rewind->count == rewind->capacity) drop_oldest(rewind);
+  return rewind->arena + rewind->write;
+}
+
+// XOR of two states, as runs of changed words between runs of unchanged
+// ones, which are left out.
+static size_t encode(uint8_t* out, const uint64_t* state,
+                     const uint64_t* last) {
+  uint8_t* start = out;
+  size_t i = 0;
+
+  while (i < STATE_WORDS) {
+    size_t same = i;
+    while (i < STATE_WORDS && state[i] == last[i]) i++;
+    if (i == STATE_WORDS) break;
+    size_t changed = i;
+    while (i < STATE_WORDS && state[i] != last[i]) i++;
+
+    uint16_t run[2] = {changed - same, i - changed};
+    memcpy(out, run, RUN_HEADER);
+    out += RUN_HEADER;
+    for (size_t word = changed; word < i; word++) {
+      uint64_t delta = state[word] ^ last[word];
+      memcpy(out, &delta, sizeof(delta));
+      out += sizeof(delta);
+    }
+  }
+
+  return out - start;
+}
+
+// XOR a delta onto a state, turning either of the two it was made from
+// into the other.
+static void apply(uint64_t* state, const uint8_t* in, size_t size) {
+  const uint8_t* end = in + size;
+  size_t word = 0;
+
+  while (in < end) {
+    uint16_t run[2];
+    memcpy(run, in, RUN_HEADER);
+    in += RUN_HEADER;
+    word += run[0];
+    for (uint16_t i = 0; i < run[1]; i++) {
+      uint64_t delta;
+      memcpy(&delta, in, sizeof(delta));
+      in += sizeof(delta);
+      state[word++] ^= delta;
+    }
+  }
+}
+
+void rewind_record(rewind_t* rewind, const chip8_t* ch8) {
+  uint64_t state[STATE_WORDS];
+  memcpy(state, ch8, sizeof(chip8_t));
+
+  // Encoded first, so only the room it takes is made.
+  bool keyframe = rewind->since_keyframe + 1 >= REWIND_KEYFRAME_INTERVAL;
+  size_t size = 0;
+  if (keyframe) {
+    memcpy(rewind->record, state, sizeof(state));
+    size = sizeof(state);
+  }
+  size += encode(rewind->record + size, state, rewind->last);
+  memcpy(reserve(rewind, size), rewind->record, size);
+
+  *entry(rewind, rewind->count) =
+      (entry_t){.offset = rewind->write, .size = size, .keyframe = keyframe};
+  rewind->count++;
+  rewind->write += size;
+  rewind->used += size;
+  rewind->keyframes += keyframe;
+  rewind->since_keyframe = keyframe ? 0 : rewind->since_keyframe + 1;
+  memcpy(rewind->last, state, sizeof(state));
+}
+
+uint32_t rewind_back(rewind_t* rewind, chip8_t* ch8, uint32_t frames) {
+  if (rewind->count <= 1 || frames == 0) return 0;
+  if (frames > rewind->count - 1) frames = rewind->count - 1;
+  uint32_t newest = rewind->count - 1;
+  uint32_t target = newest - frames;
+
+  // Walk back from the newest frame, or from the first keyframe at or after
+  // the target if that is closer.
+  uint32_t from = newest;
+  for (uint32_t i = target; i < target + frames; i++) {
+    const entry_t* key = entry(rewind, i);
+    if (key->keyframe) {
+      memcpy(rewind->last, rewind->arena + key->offset, sizeof(chip8_t));
+      from = i;
+      break;
+    }
+  }
+  for (uint32_t i = from; i > target; i--) {
+    const entry_t* delta = entry(rewind, i);
+    size_t skip = delta->keyframe ? sizeof(chip8_t) : 0;
+    apply(rewind->last, rewind->arena + delta->offset + skip,
+          delta->size - skip);
+  }
+
+  // Later frames are gone for good, their space goes to the next ones.
+  for (uint32_t i = newest; i > target; i--) {
+    rewind->used -= entry(rewind, i)->size;
+    rewind->keyframes -= entry(rewind, i)->keyframe;
+  }
+  rewind->count = target + 1;
+  rewind->write = entry(rewind, target)->offset + entry(rewind, target)->size;
+  rewind->since_keyframe = 0;
+  for (uint32_t i = target; !entry(rewind, i)->keyframe && i > 0; i--) {
+    rewind->since_keyframe++;
+  }
+
+  memcpy(ch8, rewind->last, sizeof(chip8_t));
+  ch8->dirty_rows = CHIP8_FRAMEBUFFER_ALL_ROWS;
+  chip8_profile_forget(ch8);
+  return frames;
+}
+
+rewind_stats_t rewind_stats(const rewind_t* rewind) {
+  return (rewind_stats_t){
+      .frames = rewind->count > 0 ? rewind->count - 1 : 0,
+      .keyframes = rewind->keyframes,
+      .bytes = rewind->used,
+  };
+}
@@ -0,0 +1,47 @@
+#ifndef __REWIND_H__
+#define __REWIND_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+#define REWIND_DEFAULT_BYTES (4u << 20)
+#define REWIND_DEFAULT_FRAMES (5 * 60 * CHIP8_TIMER_HZ)  // five minutes
+#define REWIND_KEYFRAME_INTERVAL CHIP8_TIMER_HZ
+
+typedef struct rewind_stats {
+  uint32_t frames;     // that can be stepped back through
+  uint32_t keyframes;  // among them
+  size_t bytes;        // of history kept
+} rewind_stats_t;
+
+// History of a machine, one state per recorded frame, in a ring buffer of
+// fixed size that drops the oldest frames as it fills up. Each frame is kept
+// as the XOR of the whole machine with the one before, run-length encoded,
+// which leaves little more than the registers and rows that changed. XOR
+// works both ways, so the same delta steps back or forward, and every
+// REWIND_KEYFRAME_INTERVAL frames a full copy is kept as well, for long jumps
+// back to start from.
+typedef struct rewind rewind_t;
+
+// Keep up to `frames` frames in up to `bytes` of memory. Returns NULL if
+// there is not enough memory for it.
+rewind_t* rewind_create(size_t bytes, uint32_t frames);
+void rewind_destroy(rewind_t* rewind);
+
+// Forget all history.
+void rewind_clear(rewind_t* rewind);
+
+// Add chip8 as it is now as the newest frame.
+void rewind_record(rewind_t* rewind, const chip8_t* chip8);
+
+// Put chip8 back as it was `frames` recorded frames ago, or as far back as
+// the history goes, dropping the frames after it, and mark every row dirty.
+// Returns the frames gone back, 0 if there is no earlier frame.
+uint32_t rewind_back(rewind_t* rewind, chip8_t* chip8, uint32_t frames);
+
+rewind_stats_t rewind_stats(const rewind_t* rewind);
+
+#endif  // __REWIND_H__
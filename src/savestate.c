@@ -0,0 +1,152 @@
+#include "savestate.h"
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "snapshot.h"
+
+#define TEMP_SUFFIX ".tmp"
+#define FNV_OFFSET 0x811c9dc5u
+#define FNV_PRIME 0x01000193u
+
+static const uint8_t magic[4] = {'C', '8', 'S', 'F'};
+
+static void put(uint8_t* out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) out[i] = value >> (8 * i);
+}
+
+static uint64_t get(const uint8_t* in, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) value |= (uint64_t)in[i] << (8 * i);
+  return value;
+}
+
+static uint32_t checksum(const uint8_t* data, size_t size) {
+  uint32_t hash = FNV_OFFSET;
+  for (size_t i = 0; i < size; i++) {
+    hash ^= data[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+// Where the snapshots start.
+static size_t index_end(uint32_t count) {
+  return CHIP8_SAVESTATE_HEADER_SIZE + CHIP8_MEMORY_SIZE +
+         (size_t)count * CHIP8_SAVESTATE_INDEX_SIZE;
+}
+
+status_t chip8_savestate_save(const char* path, const uint8_t* base,
+                              const chip8_t* const* machines, uint32_t count) {
+  uint8_t snapshot[CHIP8_SNAPSHOT_MAX_SIZE];
+  size_t index_size = (size_t)count * CHIP8_SAVESTATE_INDEX_SIZE;
+  // The base image and index are checksummed together, as they lie in the
+  // file.
+  uint8_t* index = malloc(CHIP8_MEMORY_SIZE + index_size);
+  char* temp = malloc(strlen(path) + sizeof(TEMP_SUFFIX));
+  if (index == NULL || temp == NULL) {
+    free(index);
+    free(temp);
+    return ERR;
+  }
+  strcpy(temp, path);
+  strcat(temp, TEMP_SUFFIX);
+  FILE* file = fopen(temp, "wb");
+  if (file == NULL) {
+    free(index);
+    free(temp);
+    return ERR;
+  }
+
+  // Snapshots first, the header and index once their sizes are known.
+  memcpy(index, base, CHIP8_MEMORY_SIZE);
+  uint64_t offset = index_end(count);
+  bool ok = fseek(file, offset, SEEK_SET) == 0;
+  for (uint32_t i = 0; ok && i < count; i++) {
+    size_t size = chip8_snapshot(machines[i], base, snapshot, sizeof(snapshot));
+    uint8_t* entry = &index[CHIP8_MEMORY_SIZE + i * CHIP8_SAVESTATE_INDEX_SIZE];
+    put(entry, offset, 8);
+    put(entry + 8, size, 4);
+    put(entry + 12, checksum(snapshot, size), 4);
+    ok = fwrite(snapshot, 1, size, file) == size;
+    offset += size;
+  }
+
+  uint8_t header[CHIP8_SAVESTATE_HEADER_SIZE];
+  memcpy(header, magic, sizeof(magic));
+  put(header + 4, CHIP8_SAVESTATE_VERSION, 2);
+  put(header + 6, CHIP8_SAVESTATE_HEADER_SIZE, 2);
+  put(header + 8, count, 4);
+  put(header + 12, checksum(index, CHIP8_MEMORY_SIZE + index_size), 4);
+  ok = ok && fseek(file, 0, SEEK_SET) == 0 &&
+       fwrite(header, 1, sizeof(header), file) == sizeof(header) &&
+       fwrite(index, 1, CHIP8_MEMORY_SIZE + index_size, file) ==
+           CHIP8_MEMORY_SIZE + index_size;
+  ok = fclose(file) == 0 && ok;
+  ok = ok && rename(temp, path) == 0;
+  if (!ok) remove(temp);
+
+  free(index);
+  free(temp);
+  return ok ? OK : ERR;
+}
+
+status_t chip8_savestate_open(chip8_savestate_t* states, const char* path) {
+  memset(states, 0, sizeof(*states));
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return ERR;
+  struct stat st;
+  void* data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= index_end(0)) {
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  // The mapping stays when the file is closed.
+  close(fd);
+  if (data == MAP_FAILED) return ERR;
+  states->data = data;
+  states->size = st.st_size;
+
+  const uint8_t* header = data;
+  uint32_t count = get(header + 8, 4);
+  if (memcmp(header, magic, sizeof(magic)) != 0 ||
+      get(header + 4, 2) != CHIP8_SAVESTATE_VERSION ||
+      get(header + 6, 2) != CHIP8_SAVESTATE_HEADER_SIZE ||
+      count > (states->size - index_end(0)) / CHIP8_SAVESTATE_INDEX_SIZE ||
+      checksum(header + CHIP8_SAVESTATE_HEADER_SIZE,
+               index_end(count) - CHIP8_SAVESTATE_HEADER_SIZE) !=
+          get(header + 12, 4)) {
+    chip8_savestate_close(states);
+    return ERR;
+  }
+
+  states->count = count;
+  states->base = header + CHIP8_SAVESTATE_HEADER_SIZE;
+  return OK;
+}
+
+void chip8_savestate_close(chip8_savestate_t* states) {
+  if (states->data != NULL) munmap((void*)states->data, states->size);
+  memset(states, 0, sizeof(*states));
+}
+
+status_t chip8_savestate_load(const chip8_savestate_t* states, uint32_t index,
+                              chip8_t* ch8) {
+  if (index >= states->count) return ERR;
+
+  const uint8_t* entry = states->base + CHIP8_MEMORY_SIZE +
+                         (size_t)index * CHIP8_SAVESTATE_INDEX_SIZE;
+  uint64_t offset = get(entry, 8);
+  uint32_t size = get(entry + 8, 4);
+  if (offset > states->size || size > states->size - offset) return ERR;
+  const uint8_t* snapshot = states->data + offset;
+  if (checksum(snapshot, size) != get(entry + 12, 4)) return ERR;
+
+  return chip8_restore(ch8, states->base, snapshot, size);
+}
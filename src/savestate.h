@@ -0,0 +1,52 @@
+#ifndef __SAVESTATE_H__
+#define __SAVESTATE_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Save state files hold one or many machines, all of the same ROM, as
+// snapshots (see snapshot.h) packed one after the other. They are made to be
+// mapped into memory and restored from in place: every number sits at a
+// fixed offset, the index gives each state's place in the file, and the
+// memory image snapshots are relative to is stored once, up front. All
+// numbers are little endian:
+//
+//   "C8SF", version (u16), header size (u16), states (u32),
+//   FNV-1a checksum (u32) of the base image and index
+//   the base image (CHIP8_MEMORY_SIZE bytes)
+//   the index, per state: offset in the file (u64), size (u32) and
+//   FNV-1a checksum (u32) of its snapshot
+//   the snapshots
+#define CHIP8_SAVESTATE_VERSION 1
+#define CHIP8_SAVESTATE_HEADER_SIZE 16
+#define CHIP8_SAVESTATE_INDEX_SIZE 16  // per state
+
+// A save state file mapped into memory.
+typedef struct chip8_savestate {
+  const uint8_t* data;
+  size_t size;
+  uint32_t count;       // states in it
+  const uint8_t* base;  // memory image the snapshots are relative to
+} chip8_savestate_t;
+
+// Write `count` machines to path, relative to the CHIP8_MEMORY_SIZE bytes at
+// base. The file is written next to path and renamed over it once complete,
+// so an existing file is never left half written. Returns ERR if it cannot
+// be written.
+status_t chip8_savestate_save(const char* path, const uint8_t* base,
+                              const chip8_t* const* machines, uint32_t count);
+
+// Map the file at path and check its header and index. Returns ERR if it
+// cannot be read or is not a save state file of this version.
+status_t chip8_savestate_open(chip8_savestate_t* states, const char* path);
+void chip8_savestate_close(chip8_savestate_t* states);
+
+// Restore the state at index into chip8, with every row dirty. Returns ERR,
+// leaving the machine as it was, if there is no such state or its checksum
+// does not match.
+status_t chip8_savestate_load(const chip8_savestate_t* states, uint32_t index,
+                              chip8_t* chip8);
+
+#endif  // __SAVESTATE_H__
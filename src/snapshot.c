@@ -0,0 +1,145 @@
+#include "snapshot.h"
+
+#include <stddef.h>
+#include <string.h>
+
+// Where ip sits, after the magic, version and masks; sp, after ip, reg_i and
+// keys, reg_v, timer and tone_clock; and cpu_hz, after sp and rng.
+#define IP_OFFSET 12
+#define SP_OFFSET (IP_OFFSET + 6 + CHIP8_REGISTER_COUNT + 2)
+#define CPU_HZ_OFFSET (SP_OFFSET + 1 + 4)
+
+static const uint8_t magic[4] = {'C', '8', 'S', 'S'};
+
+static uint8_t* put(uint8_t* out, uint64_t value, int bytes) {
+  for (int i = 0; i < bytes; i++) *out++ = value >> (8 * i);
+  return out;
+}
+
+static uint64_t get(const uint8_t** in, int bytes) {
+  uint64_t value = 0;
+  for (int i = 0; i < bytes; i++) value |= (uint64_t)(*in)[i] << (8 * i);
+  *in += bytes;
+  return value;
+}
+
+static size_t snapshot_size(uint16_t pages, uint32_t rows, uint8_t sp) {
+  return CHIP8_SNAPSHOT_HEADER_SIZE + __builtin_popcount(rows) * 8 + sp * 2 +
+         __builtin_popcount(pages) * CHIP8_SNAPSHOT_PAGE_SIZE;
+}
+
+size_t chip8_snapshot(const chip8_t* ch8, const uint8_t* base,
+                      uint8_t* buffer, size_t size) {
+  uint16_t pages = 0;
+  uint32_t rows = 0;
+
+  for (int page = 0; page < CHIP8_SNAPSHOT_PAGES; page++) {
+    size_t offset = page * CHIP8_SNAPSHOT_PAGE_SIZE;
+    if (memcmp(&ch8->mem[offset], &base[offset], CHIP8_SNAPSHOT_PAGE_SIZE)) {
+      pages |= 1u << page;
+    }
+  }
+  for (int y = 0; y < CHIP8_FRAMEBUFFER_Y_LEN; y++) {
+    if (chip8_row(ch8, y)) rows |= 1u << y;
+  }
+  size_t length = snapshot_size(pages, rows, ch8->sp);
+  if (length > size) return 0;
+
+  uint8_t* out = buffer;
+  memcpy(out, magic, sizeof(magic));
+  out += sizeof(magic);
+  out = put(out, CHIP8_SNAPSHOT_VERSION, 2);
+  out = put(out, pages, 2);
+  out = put(out, rows, 4);
+
+  out = put(out, ch8->ip, 2);
+  out = put(out, ch8->reg_i, 2);
+  out = put(out, ch8->keys, 2);
+  memcpy(out, ch8->reg_v, CHIP8_REGISTER_COUNT);
+  out += CHIP8_REGISTER_COUNT;
+  out = put(out, ch8->timer, 1);
+  out = put(out, ch8->tone_clock, 1);
+  out = put(out, ch8->sp, 1);
+  out = put(out, ch8->rng, 4);
+  out = put(out, ch8->cpu_hz, 4);
+  out = put(out, ch8->cycle, 8);
+  out = put(out, ch8->timer_tick, 8);
+  out = put(out, ch8->tone_tick, 8);
+
+  for (int y = 0; y < CHIP8_FRAMEBUFFER_Y_LEN; y++) {
+    if (rows & (1u << y)) out = put(out, chip8_row(ch8, y), 8);
+  }
+  for (int i = 0; i < ch8->sp; i++) out = put(out, ch8->stack[i], 2);
+  for (int page = 0; page < CHIP8_SNAPSHOT_PAGES; page++) {
+    if (!(pages & (1u << page))) continue;
+    memcpy(out, &ch8->mem[page * CHIP8_SNAPSHOT_PAGE_SIZE],
+           CHIP8_SNAPSHOT_PAGE_SIZE);
+    out += CHIP8_SNAPSHOT_PAGE_SIZE;
+  }
+
+  return length;
+}
+
+status_t chip8_restore(chip8_t* ch8, const uint8_t* base,
+                       const uint8_t* buffer, size_t size) {
+  const uint8_t* in = buffer;
+
+  // Check all of it before touching the machine.
+  if (size < CHIP8_SNAPSHOT_HEADER_SIZE) return ERR;
+  if (memcmp(in, magic, sizeof(magic)) != 0) return ERR;
+  in += sizeof(magic);
+  if (get(&in, 2) != CHIP8_SNAPSHOT_VERSION) return ERR;
+  uint16_t pages = get(&in, 2);
+  uint32_t rows = get(&in, 4);
+  uint32_t sp = buffer[SP_OFFSET];
+  if (sp > CHIP8_STACK_SIZE || size != snapshot_size(pages, rows, sp)) {
+    return ERR;
+  }
+  // A machine that runs nowhere or at no speed at all (chip8_ticks divides
+  // by cpu_hz) is no machine to hand back.
+  const uint8_t* ip = &buffer[IP_OFFSET];
+  const uint8_t* cpu_hz = &buffer[CPU_HZ_OFFSET];
+  if (get(&ip, 2) >= CHIP8_MEMORY_SIZE || get(&cpu_hz, 4) == 0) return ERR;
+
+  ch8->ip = get(&in, 2);
+  ch8->reg_i = get(&in, 2);
+  ch8->keys = get(&in, 2);
+  memcpy(ch8->reg_v, in, CHIP8_REGISTER_COUNT);
+  in += CHIP8_REGISTER_COUNT;
+  ch8->timer = get(&in, 1);
+  ch8->tone_clock = get(&in, 1);
+  ch8->sp = get(&in, 1);
+  ch8->rng = get(&in, 4);
+  ch8->cpu_hz = get(&in, 4);
+  ch8->cycle = get(&in, 8);
+  ch8->timer_tick = get(&in, 8);
+  ch8->tone_tick = get(&in, 8);
+  ch8->event = CHIP8_STOP_BUDGET;
+  chip8_profile_forget(ch8);
+  // Whatever the host shows is from before.
+  ch8->dirty_rows = CHIP8_FRAMEBUFFER_ALL_ROWS;
+
+  for (int y = 0; y < CHIP8_FRAMEBUFFER_Y_LEN; y++) {
+    chip8_set_row(ch8, y, rows & (1u << y) ? get(&in, 8) : 0);
+  }
+  for (int i = 0; i < ch8->sp; i++) ch8->stack[i] = get(&in, 2);
+  for (int page = 0; page < CHIP8_SNAPSHOT_PAGES; page++) {
+    size_t offset = page * CHIP8_SNAPSHOT_PAGE_SIZE;
+    if (pages & (1u << page)) {
+      memcpy(&ch8->mem[offset], in, CHIP8_SNAPSHOT_PAGE_SIZE);
+      in += CHIP8_SNAPSHOT_PAGE_SIZE;
+    } else {
+      memcpy(&ch8->mem[offset], &base[offset], CHIP8_SNAPSHOT_PAGE_SIZE);
+    }
+  }
+
+  return OK;
+}
+
+void chip8_clone(chip8_t* dst, const chip8_t* src) {
+  memcpy(dst, src, offsetof(chip8_t, stack));
+  memcpy(dst->stack, src->stack, src->sp * sizeof(src->stack[0]));
+  memcpy(dst->mem, src->mem, sizeof(src->mem));
+  memcpy(dst->framebuffer, src->framebuffer, sizeof(src->framebuffer));
+  chip8_profile_forget(dst);
+}
@@ -0,0 +1,46 @@
+#ifndef __SNAPSHOT_H__
+#define __SNAPSHOT_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "chip8.h"
+
+// Snapshots are a byte format of their own, independent of how chip8_t is
+// laid out, so they stay readable across builds. All numbers are little
+// endian:
+//
+//   "C8SS", version (u16), memory page mask (u16), display row mask (u32)
+//   ip, reg_i, keys (u16), reg_v (16 bytes), timer, tone_clock, sp (u8),
+//   rng, cpu_hz (u32), cycle, timer_tick, tone_tick (u64)
+//   the rows in the row mask (u64 each)
+//   stack[0] to stack[sp - 1] (u16 each)
+//   the pages in the page mask (CHIP8_SNAPSHOT_PAGE_SIZE bytes each)
+//
+// Memory is stored relative to a base image, normally memory as it was
+// right after loading the ROM: only the pages that differ from it are kept.
+#define CHIP8_SNAPSHOT_VERSION 2
+#define CHIP8_SNAPSHOT_PAGE_SIZE 256
+#define CHIP8_SNAPSHOT_PAGES (CHIP8_MEMORY_SIZE / CHIP8_SNAPSHOT_PAGE_SIZE)
+#define CHIP8_SNAPSHOT_HEADER_SIZE 69
+#define CHIP8_SNAPSHOT_MAX_SIZE                                  \
+  (CHIP8_SNAPSHOT_HEADER_SIZE + CHIP8_FRAMEBUFFER_Y_LEN * 8 + \
+   CHIP8_STACK_SIZE * 2 + CHIP8_MEMORY_SIZE)
+
+// Save chip8 into buffer, relative to the CHIP8_MEMORY_SIZE bytes at base.
+// Returns the bytes written, or 0 if they do not fit in `size`;
+// CHIP8_SNAPSHOT_MAX_SIZE always does.
+size_t chip8_snapshot(const chip8_t* chip8, const uint8_t* base,
+                      uint8_t* buffer, size_t size);
+
+// Load a snapshot taken against the same base, with every row dirty.
+// Returns ERR, leaving the machine as it was, if it is truncated, of
+// another version, calls deeper than this build's stack allows, or has ip
+// outside memory or a cpu_hz of 0.
+status_t chip8_restore(chip8_t* chip8, const uint8_t* base,
+                       const uint8_t* buffer, size_t size);
+
+// Copy a machine, without the unused part of its stack.
+void chip8_clone(chip8_t* dst, const chip8_t* src);
+
+#endif  // __SNAPSHOT_H__
@@ -0,0 +1,145 @@
+#include "telemetry.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define SUB_BUCKETS (1u << HISTOGRAM_SUB_BITS)
+#define SOCKET_PREFIX "unix:"
+
+static const char* phase_names[] = {
+  [TELEMETRY_INPUT] = "input",
+  [TELEMETRY_EMULATE] = "emulate",
+  [TELEMETRY_RENDER] = "render",
+  [TELEMETRY_SLEEP] = "sleep",
+};
+
+void telemetry_init(telemetry_t* telemetry) {
+  memset(telemetry, 0, sizeof(*telemetry));
+}
+
+const char* telemetry_phase_name(int phase) { return phase_names[phase]; }
+
+// Values below SUB_BUCKETS get a bucket each. Above that, every power of
+// two is split into SUB_BUCKETS by the bits after the leading one.
+static uint32_t bucket_of(uint64_t ns) {
+  if (ns < SUB_BUCKETS) return ns;
+  uint32_t exponent = 63 - __builtin_clzll(ns);
+  uint32_t sub = (ns >> (exponent - HISTOGRAM_SUB_BITS)) & (SUB_BUCKETS - 1);
+  return ((exponent - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS) | sub;
+}
+
+// The largest value that falls into a bucket.
+static uint64_t bucket_top(uint32_t bucket) {
+  if (bucket < SUB_BUCKETS) return bucket;
+  uint32_t exponent = (bucket >> HISTOGRAM_SUB_BITS) + HISTOGRAM_SUB_BITS - 1;
+  uint64_t sub = bucket & (SUB_BUCKETS - 1);
+  uint64_t width = 1ull << (exponent - HISTOGRAM_SUB_BITS);
+  return ((SUB_BUCKETS + sub) << (exponent - HISTOGRAM_SUB_BITS)) + width - 1;
+}
+
+void histogram_record(histogram_t* histogram, uint64_t ns) {
+  if (ns > HISTOGRAM_MAX_NS) ns = HISTOGRAM_MAX_NS;
+  histogram->buckets[bucket_of(ns)]++;
+  histogram->count++;
+  histogram->total_ns += ns;
+  if (ns > histogram->max_ns) histogram->max_ns = ns;
+}
+
+uint64_t histogram_percentile(const histogram_t* histogram,
+                              double percentile) {
+  if (histogram->count == 0) return 0;
+
+  uint64_t rank = percentile / 100 * histogram->count + 0.5;
+  if (rank == 0) rank = 1;
+  uint64_t seen = 0;
+  for (uint32_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    seen += histogram->buckets[bucket];
+    if (seen >= rank) {
+      uint64_t top = bucket_top(bucket);
+      return top < histogram->max_ns ? top : histogram->max_ns;
+    }
+  }
+  return histogram->max_ns;
+}
+
+void telemetry_report(const telemetry_t* telemetry, FILE* out) {
+  for (int phase = 0; phase < TELEMETRY_PHASES; phase++) {
+    const histogram_t* histogram = &telemetry->phases[phase];
+    if (histogram->count == 0) continue;
+    fprintf(out, "%-8s %llu times, p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+            phase_names[phase], (unsigned long long)histogram->count,
+            histogram_percentile(histogram, 50) / 1e6,
+            histogram_percentile(histogram, 99) / 1e6,
+            histogram->max_ns / 1e6);
+  }
+  fprintf(out, "Missed deadlines: %llu frames\n",
+          (unsigned long long)telemetry->missed);
+}
+
+size_t telemetry_format(const telemetry_t* telemetry, uint64_t time_ns,
+                        char* buffer, size_t size) {
+  size_t length = 0;
+
+#define APPEND(...)                                                       \
+  do {                                                                    \
+    int n = snprintf(buffer + length, size - length, __VA_ARGS__);        \
+    length = n < 0 || (size_t)n >= size - length ? size - 1 : length + n; \
+  } while (0)
+
+  APPEND("{\"time_ns\":%llu,\"missed\":%llu", (unsigned long long)time_ns,
+         (unsigned long long)telemetry->missed);
+  for (int phase = 0; phase < TELEMETRY_PHASES; phase++) {
+    const histogram_t* histogram = &telemetry->phases[phase];
+    APPEND(
+        ",\"%s\":{\"count\":%llu,\"total_ns\":%llu,\"p50_ns\":%llu,"
+        "\"p90_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}",
+        phase_names[phase], (unsigned long long)histogram->count,
+        (unsigned long long)histogram->total_ns,
+        (unsigned long long)histogram_percentile(histogram, 50),
+        (unsigned long long)histogram_percentile(histogram, 90),
+        (unsigned long long)histogram_percentile(histogram, 99),
+        (unsigned long long)histogram_percentile(histogram, 99.9),
+        (unsigned long long)histogram->max_ns);
+  }
+  APPEND("}\n");
+
+#undef APPEND
+  return length;
+}
+
+bool telemetry_sink_open(telemetry_sink_t* sink, const char* path) {
+  memset(sink, 0, sizeof(*sink));
+
+  if (strncmp(path, SOCKET_PREFIX, strlen(SOCKET_PREFIX)) == 0) {
+    path += strlen(SOCKET_PREFIX);
+    if (strlen(path) >= sizeof(sink->addr.sun_path)) return false;
+    sink->socket = true;
+    sink->addr.sun_family = AF_UNIX;
+    strcpy(sink->addr.sun_path, path);
+    sink->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  } else {
+    sink->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_NONBLOCK, 0644);
+  }
+  return sink->fd >= 0;
+}
+
+void telemetry_sink_close(telemetry_sink_t* sink) {
+  if (sink->fd >= 0) close(sink->fd);
+  sink->fd = -1;
+}
+
+void telemetry_dump(telemetry_sink_t* sink, const telemetry_t* telemetry,
+                    uint64_t time_ns) {
+  char line[1024];
+  size_t length = telemetry_format(telemetry, time_ns, line, sizeof(line));
+
+  // The socket is not connected, so a listener that comes and goes picks up
+  // again with the next dump. Dumps that cannot go out are dropped.
+  ssize_t sent = sink->socket ? sendto(sink->fd, line, length, 0,
+                                       (struct sockaddr*)&sink->addr,
+                                       sizeof(sink->addr))
+                              : write(sink->fd, line, length);
+  (void)sent;
+}
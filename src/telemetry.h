@@ -0,0 +1,76 @@
+#ifndef __TELEMETRY_H__
+#define __TELEMETRY_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/un.h>
+
+// Buckets are 1/16 of a power of two wide, so any recorded time is known to
+// within 6.25%, from 1 ns up to HISTOGRAM_MAX_NS.
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_MAX_BITS 40  // about 18 minutes
+#define HISTOGRAM_MAX_NS ((1ull << HISTOGRAM_MAX_BITS) - 1)
+#define HISTOGRAM_BUCKETS \
+  ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+#define TELEMETRY_DUMP_MS 1000
+
+// Where host time goes each frame. Input and render run on the front end's
+// thread, emulate and sleep on the emulation thread.
+enum {
+  TELEMETRY_INPUT,    // process_input
+  TELEMETRY_EMULATE,  // one batch of frames on the engine
+  TELEMETRY_RENDER,   // render
+  TELEMETRY_SLEEP,    // pacer_wait, until the next frame or input
+  TELEMETRY_PHASES,
+};
+
+// Log-linear histogram of durations, as HdrHistogram keeps them: constant
+// relative precision over the whole range in a fixed amount of memory.
+typedef struct histogram {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t max_ns;
+  uint32_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+typedef struct telemetry {
+  histogram_t phases[TELEMETRY_PHASES];
+  uint64_t missed;  // frames that started after the next one was already due
+} telemetry_t;
+
+void telemetry_init(telemetry_t* telemetry);
+const char* telemetry_phase_name(int phase);
+
+void histogram_record(histogram_t* histogram, uint64_t ns);
+
+// Time that `percentile` (0 to 100) of the recorded ones took at most, to
+// within a bucket. 0 for an empty histogram.
+uint64_t histogram_percentile(const histogram_t* histogram, double percentile);
+
+// p50, p99 and max of every phase, one line each.
+void telemetry_report(const telemetry_t* telemetry, FILE* out);
+
+// Everything recorded so far as a single line of JSON, truncated to fit
+// `size`. Returns its length.
+size_t telemetry_format(const telemetry_t* telemetry, uint64_t time_ns,
+                        char* buffer, size_t size);
+
+// Destination for periodic metrics dumps: a file they are appended to, or,
+// for paths starting with "unix:", a Unix datagram socket each one is sent
+// to as a message. Sends never block, and dumps nobody is listening for are
+// dropped.
+typedef struct telemetry_sink {
+  int fd;
+  bool socket;
+  struct sockaddr_un addr;
+} telemetry_sink_t;
+
+bool telemetry_sink_open(telemetry_sink_t* sink, const char* path);
+void telemetry_sink_close(telemetry_sink_t* sink);
+void telemetry_dump(telemetry_sink_t* sink, const telemetry_t* telemetry,
+                    uint64_t time_ns);
+
+#endif  // __TELEMETRY_H__
@@ -0,0 +1,63 @@
+// Runs the recompiled ROM side by side with the interpreter, which it has
+// to match instruction for instruction. Built against the output of
+// chip8-aot, named by AOT_SOURCE.
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define CHIP8_AOT_NO_MAIN
+#include AOT_SOURCE
+
+#define AOT_TEST_CYCLES 1000000
+#define AOT_TEST_BUDGET 997  // odd, so batches end partway into blocks
+
+static void assert_same_machine(const chip8_t* a, const chip8_t* b) {
+  assert(a->ip == b->ip);
+  assert(a->reg_i == b->reg_i);
+  assert(memcmp(a->reg_v, b->reg_v, sizeof(a->reg_v)) == 0);
+  assert(a->cycle == b->cycle);
+  assert(chip8_timer(a) == chip8_timer(b));
+  assert(a->sp == b->sp);
+  assert(memcmp(a->stack, b->stack, a->sp * sizeof(a->stack[0])) == 0);
+  assert(memcmp(a->mem, b->mem, sizeof(a->mem)) == 0);
+  assert(memcmp(a->framebuffer, b->framebuffer, sizeof(a->framebuffer)) == 0);
+}
+
+static void test_rom() {
+  static aot_t aot;
+  static chip8_t native, interpreted;
+  chip8_init(&native);
+  aot_init(&aot, &native);
+  chip8_init(&interpreted);
+  memcpy(&interpreted.mem[CHIP8_PROGRAM_START_ADDRESS], rom, sizeof(rom));
+
+  uint32_t left = AOT_TEST_CYCLES, blocks = 0;
+  while (left > 0) {
+    uint32_t budget = left < AOT_TEST_BUDGET ? left : AOT_TEST_BUDGET;
+    uint32_t native_ran, interpreted_ran;
+    uint64_t cycle = native.cycle;
+    chip8_stop_t stop = aot_run(&aot, &native, budget, &native_ran);
+    assert(chip8_run_cycles(&interpreted, budget, &interpreted_ran) == stop);
+    assert(native_ran == interpreted_ran);
+    assert(native.cycle - cycle == native_ran);
+    assert_same_machine(&native, &interpreted);
+    assert(stop != CHIP8_STOP_ILLEGAL && stop != CHIP8_STOP_STACK_FAULT);
+
+    left -= native_ran;
+    if (stop == CHIP8_STOP_IDLE || stop == CHIP8_STOP_WAIT_KEY) {
+      uint32_t skipped = chip8_fast_forward(&native, left);
+      assert(chip8_fast_forward(&interpreted, left) == skipped);
+      left -= skipped;
+    }
+    blocks++;
+  }
+  assert_same_machine(&native, &interpreted);
+  assert(blocks > 1);
+}
+
+int main() {
+  test_rom();
+
+  printf("\33[1;32m🎉 AOT tests passed! 🎉\33[m\n");
+}
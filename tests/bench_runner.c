@@ -0,0 +1,280 @@
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "../src/chip8.h"
+#include "../src/engine.h"
+#include "../src/headless.h"
+#include "../src/renderer.h"
+#include "../src/savestate.h"
+#include "../src/snapshot.h"
+
+// Each measurement repeats its work in rounds until it has run this long.
+#define BENCH_MIN_NS 100000000ull
+#define BENCH_FRAMES 3600
+#define BENCH_PROGRAM_END 0x0600  // programs jump back to the start here
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void set_instruction_at(chip8_t* ch8, uint16_t addr, uint16_t instr) {
+  ch8->mem[addr] = instr >> 8;
+  ch8->mem[addr + 1] = instr & 0xFF;
+}
+
+// One representative instruction of each family, repeated from 0x200 up to
+// BENCH_PROGRAM_END, with jumps aimed at the next instruction so they run
+// straight through like the rest. Calls cannot nest that deep, so 2NNN runs
+// in a loop of a call, its return and a jump back, timed together.
+typedef struct opcode_bench {
+  const char* name;
+  uint16_t instruction;  // NNN is replaced by the next address when set
+  bool next_address;
+} opcode_bench_t;
+
+static const opcode_bench_t opcodes[] = {
+    {"00E0", 0x00E0, false}, {"1NNN", 0x1000, true},
+    {"2NNN", 0x2000, false},
+    {"3XKK", 0x3001, false}, {"4XKK", 0x4000, false},
+    {"5XY0", 0x5010, false}, {"6XKK", 0x6A05, false},
+    {"7XKK", 0x7A01, false}, {"8XY0", 0x8120, false},
+    {"8XY1", 0x8121, false}, {"8XY2", 0x8122, false},
+    {"8XY4", 0x8124, false}, {"8XY5", 0x8125, false},
+    {"8XY6", 0x8126, false}, {"8XYE", 0x812E, false},
+    {"9XY0", 0x9010, false}, {"ANNN", 0xAA00, false},
+    {"BNNN", 0xB000, true},  {"CXKK", 0xC1FF, false},
+    {"DXYN", 0xD125, false}, {"EX9E", 0xE19E, false},
+    {"EXA1", 0xE1A1, false}, {"FX07", 0xF107, false},
+    {"FX0A", 0xF10A, false}, {"FX15", 0xF115, false},
+    {"FX18", 0xF118, false}, {"FX1E", 0xF01E, false},
+    {"FX29", 0xF129, false}, {"FX33", 0xF133, false},
+    {"FX55", 0xF355, false}, {"FX65", 0xF365, false},
+};
+
+static void load_opcode(chip8_t* ch8, const opcode_bench_t* bench) {
+  chip8_init(ch8);
+  for (uint16_t addr = CHIP8_PROGRAM_START_ADDRESS; addr < BENCH_PROGRAM_END;
+       addr += 2) {
+    uint16_t instruction = bench->instruction;
+    if (bench->next_address) instruction |= addr + 2;
+    set_instruction_at(ch8, addr, instruction);
+  }
+  set_instruction_at(ch8, BENCH_PROGRAM_END, 0x1200);
+  if (bench->instruction == 0x2000) {
+    set_instruction_at(ch8, 0x200, 0x2204);
+    set_instruction_at(ch8, 0x202, 0x1200);
+    set_instruction_at(ch8, 0x204, 0x00EE);
+  }
+  ch8->reg_i = 0x0A00;   // clear of the program, for FX33, FX55 and FX65
+  ch8->reg_v[1] = 0x03;  // odd x for DXYN, a held key for EX9E and FX0A
+  ch8->keys = 1 << 0x03;
+}
+
+static void bench_opcodes(FILE* out) {
+  chip8_t ch8;
+
+  fprintf(out, "  \"ns_per_instruction\": {\n");
+  for (size_t i = 0; i < sizeof(opcodes) / sizeof(opcodes[0]); i++) {
+    load_opcode(&ch8, &opcodes[i]);
+    uint64_t count = 0, start = now_ns(), elapsed;
+    do {
+      for (int n = 0; n < 10000; n++) chip8_run_instruction(&ch8);
+      count += 10000;
+      elapsed = now_ns() - start;
+    } while (elapsed < BENCH_MIN_NS);
+    fprintf(out, "    \"%s\": %.2f%s\n", opcodes[i].name,
+            (double)elapsed / count,
+            i + 1 < sizeof(opcodes) / sizeof(opcodes[0]) ? "," : "");
+  }
+  fprintf(out, "  },\n");
+}
+
+// ns per 15 row sprite drawn with chip8_draw at x.
+static double bench_draw(uint8_t x) {
+  chip8_t ch8;
+  uint8_t sprite[15];
+  memset(sprite, 0xA5, sizeof(sprite));
+  chip8_init(&ch8);
+
+  uint64_t count = 0, start = now_ns(), elapsed;
+  do {
+    for (int n = 0; n < 10000; n++) {
+      chip8_draw(&ch8, x, n & CHIP8_FRAMEBUFFER_MAX_Y, sprite, sizeof(sprite));
+    }
+    count += 10000;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS);
+  return (double)elapsed / count;
+}
+
+static void bench_setup(FILE* out) {
+  static chip8_t ch8;
+  uint64_t count = 0, start = now_ns(), elapsed;
+  do {
+    for (int n = 0; n < 1000; n++) chip8_init(&ch8);
+    count += 1000;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS);
+  fprintf(out, "  \"state_bytes\": %zu,\n", sizeof(chip8_t));
+  fprintf(out, "  \"init_ns\": %.1f,\n", (double)elapsed / count);
+
+  count = 0;
+  start = now_ns();
+  do {
+    for (int n = 0; n < 100; n++) chip8_load_rom(&ch8, "./rocket.ch8");
+    count += 100;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS);
+  fprintf(out, "  \"load_rom_ns\": %.1f,\n", (double)elapsed / count);
+
+  // Resets restore the snapshot taken right after loading.
+  static chip8_t clone;
+  static uint8_t base[CHIP8_MEMORY_SIZE];
+  static uint8_t snapshot[CHIP8_SNAPSHOT_MAX_SIZE];
+  memcpy(base, ch8.mem, CHIP8_MEMORY_SIZE);
+  size_t size = chip8_snapshot(&ch8, base, snapshot, sizeof(snapshot));
+
+  count = 0;
+  start = now_ns();
+  do {
+    for (int n = 0; n < 1000; n++) chip8_restore(&ch8, base, snapshot, size);
+    count += 1000;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS);
+  fprintf(out, "  \"restore_ns\": %.1f,\n", (double)elapsed / count);
+
+  count = 0;
+  start = now_ns();
+  do {
+    for (int n = 0; n < 1000; n++) chip8_clone(&clone, &ch8);
+    count += 1000;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS);
+  fprintf(out, "  \"clone_ns\": %.1f,\n", (double)elapsed / count);
+
+  // Loading a state from a mapped file, checksum included, or null if the
+  // file cannot be written or mapped here.
+  const chip8_t* machines[] = {&ch8};
+  chip8_savestate_t states;
+  if (chip8_savestate_save("./bench.state", base, machines, 1) != OK ||
+      chip8_savestate_open(&states, "./bench.state") != OK) {
+    remove("./bench.state");
+    fprintf(out, "  \"load_state_ns\": null,\n");
+    return;
+  }
+  count = 0;
+  start = now_ns();
+  do {
+    for (int n = 0; n < 1000; n++) chip8_savestate_load(&states, 0, &ch8);
+    count += 1000;
+    elapsed = now_ns() - start;
+  } while (elapsed < BENCH_MIN_NS);
+  chip8_savestate_close(&states);
+  remove("./bench.state");
+  fprintf(out, "  \"load_state_ns\": %.1f,\n", (double)elapsed / count);
+}
+
+// Bytes the renderer sends per frame of rocket.ch8, in either mode.
+static double bench_render(int mode) {
+  static renderer_t renderer;
+  chip8_t ch8;
+  engine_t engine;
+  int fd = open("/dev/null", O_WRONLY);
+
+  chip8_init(&ch8);
+  chip8_load_rom(&ch8, "./rocket.ch8");
+  engine_init(&engine, ENGINE_INTERPRETER);
+  engine_reset(&engine, &ch8);
+  renderer_init(&renderer, fd);
+  renderer_set_mode(&renderer, mode);
+
+  for (int frame = 0; frame < BENCH_FRAMES; frame++) {
+    engine_run(&engine, &ch8, chip8_frame_cycles(&ch8, 1));
+    renderer_draw(&renderer, &ch8, chip8_take_dirty_rows(&ch8));
+  }
+
+  engine_destroy(&engine);
+  close(fd);
+  return (double)renderer.bytes / renderer.frames;
+}
+
+// Headless throughput of a ROM on an engine, over repeated runs of up to
+// BENCH_FRAMES frames. A ROM that ends up in an endless loop stops there, as
+// number.ch8 does straight after drawing, so how the runs ended is reported
+// alongside.
+static void bench_headless(const char* rom, const char* name, FILE* out) {
+  static const char* ends[] = {
+      [HEADLESS_FRAME_LIMIT] = "frame limit",
+      [HEADLESS_CYCLE_LIMIT] = "cycle limit",
+      [HEADLESS_STUCK] = "stuck",
+      [HEADLESS_FAULT] = "fault",
+  };
+  static chip8_t ch8;
+  engine_t engine;
+  headless_stats_t stats;
+  headless_config_t config = {
+      .max_frames = BENCH_FRAMES, .max_cycles = 0, .script = NULL};
+  uint64_t frames = 0, cycles = 0;
+  double seconds = 0;
+
+  // Engines the host does not support, like the JIT where writable code
+  // cannot be mapped, get null.
+  if (engine_init(&engine, engine_kind(name)) != OK) {
+    fprintf(out, "\"%s\": null", name);
+    return;
+  }
+  uint64_t start = now_ns();
+  do {
+    chip8_init(&ch8);
+    chip8_load_rom(&ch8, rom);
+    engine_reset(&engine, &ch8);
+    headless_run(&engine, &ch8, &config, &stats);
+    frames += stats.frames;
+    cycles += stats.cycles;
+    seconds += stats.seconds;
+  } while (now_ns() - start < BENCH_MIN_NS);
+  engine_destroy(&engine);
+
+  fprintf(out,
+          "\"%s\": {\"frames_per_sec\": %.0f, \"cycles_per_sec\": %.0f, "
+          "\"end\": \"%s\"}",
+          name, frames / seconds, cycles / seconds, ends[stats.end]);
+}
+
+int main(int argc, char** argv) {
+  static const char* roms[] = {"rocket.ch8", "number.ch8"};
+  static const char* engines[] = {"interpreter", "cache", "jit"};
+  FILE* out = stdout;
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"commit\": \"%s\",\n", argc > 1 ? argv[1] : "");
+  bench_opcodes(out);
+  fprintf(out, "  \"draw_ns\": {\"aligned\": %.2f, \"unaligned\": %.2f},\n",
+          bench_draw(8), bench_draw(3));
+  bench_setup(out);
+  fprintf(out,
+          "  \"render_bytes_per_frame\": {\"blocks\": %.1f, "
+          "\"half_blocks\": %.1f},\n",
+          bench_render(RENDERER_BLOCKS), bench_render(RENDERER_HALF_BLOCKS));
+
+  fprintf(out, "  \"headless_fps\": {\n");
+  for (int r = 0; r < 2; r++) {
+    char path[64];
+    snprintf(path, sizeof(path), "./%s", roms[r]);
+    fprintf(out, "    \"%s\": {\n", roms[r]);
+    for (int e = 0; e < 3; e++) {
+      fprintf(out, "      ");
+      bench_headless(path, engines[e], out);
+      fprintf(out, "%s\n", e < 2 ? "," : "");
+    }
+    fprintf(out, "    }%s\n", r < 1 ? "," : "");
+  }
+  fprintf(out, "  }\n");
+  fprintf(out, "}\n");
+}
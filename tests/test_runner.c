@@ -1,8 +1,24 @@
 #include <assert.h>
+#include <poll.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../src/batch.h"
+#include "../src/cache.h"
 #include "../src/chip8.h"
+#include "../src/emulator.h"
+#include "../src/farm.h"
+#include "../src/headless.h"
+#include "../src/input.h"
+#include "../src/jit.h"
+#include "../src/pacer.h"
+#include "../src/renderer.h"
+#include "../src/rewind.h"
+#include "../src/savestate.h"
+#include "../src/snapshot.h"
+#include "../src/telemetry.h"
 
 static uint16_t get_instruction_at(chip8_t* ch8, uint16_t addr) {
   return (ch8->mem[addr] << 8) | ch8->mem[addr + 1];
@@ -117,21 +133,21 @@ static void test_run_instruction() {
   chip8_init(&ch8);
   set_instruction_at(&ch8, 0x0200, 0xE19E);
   ch8.reg_v[1] = 4;
-  ch8.keypress = 4;
+  ch8.keys = 1 << 4;
   chip8_run_instruction(&ch8);
   assert(ch8.ip == 0x0204);
 
   chip8_init(&ch8);
   set_instruction_at(&ch8, 0x0200, 0xE19E);
   ch8.reg_v[1] = 0;
-  ch8.keypress = 1;
+  ch8.keys = 1 << 1;
   chip8_run_instruction(&ch8);
   assert(ch8.ip == 0x0202);
 
   chip8_init(&ch8);
   set_instruction_at(&ch8, 0x0200, 0xE19E);
   ch8.reg_v[1] = 0;
-  ch8.keypress = CHIP8_NO_KEY_PRESSED;
+  ch8.keys = 0;
   chip8_run_instruction(&ch8);
   assert(ch8.ip == 0x0202);
 
@@ -139,21 +155,21 @@ static void test_run_instruction() {
   chip8_init(&ch8);
   set_instruction_at(&ch8, 0x0200, 0xE1A1);
   ch8.reg_v[1] = 4;
-  ch8.keypress = 4;
+  ch8.keys = 1 << 4;
   chip8_run_instruction(&ch8);
   assert(ch8.ip == 0x0202);
 
   chip8_init(&ch8);
   set_instruction_at(&ch8, 0x0200, 0xE1A1);
   ch8.reg_v[1] = 0;
-  ch8.keypress = 1;
+  ch8.keys = 1 << 1;
   chip8_run_instruction(&ch8);
   assert(ch8.ip == 0x0204);
 
   chip8_init(&ch8);
   set_instruction_at(&ch8, 0x0200, 0xE1A1);
   ch8.reg_v[1] = 0;
-  ch8.keypress = CHIP8_NO_KEY_PRESSED;
+  ch8.keys = 0;
   chip8_run_instruction(&ch8);
   assert(ch8.ip == 0x0204);
 
@@ -166,10 +182,25 @@ static void test_run_instruction() {
 
   // CXKK - Let VX = random byte (KK = mask)
   chip8_init(&ch8);
-  set_instruction_at(&ch8, 0x0200, 0xCA1A);
+  set_instruction_at(&ch8, 0x0200, 0xCAFF);
+  set_instruction_at(&ch8, 0x0202, 0xCB1A);
   chip8_run_instruction(&ch8);
-  assert(ch8.reg_v[10] == 0x02);
+  assert(ch8.reg_v[10] == 0xE1);  // first byte from CHIP8_DEFAULT_SEED
   assert(ch8.ip == 0x0202);
+  chip8_run_instruction(&ch8);
+  assert((ch8.reg_v[11] & ~0x1A) == 0);
+
+  // Same seed, same sequence.
+  chip8_init(&ch8);
+  chip8_seed(&ch8, 1234);
+  set_instruction_at(&ch8, 0x0200, 0xC0FF);
+  chip8_run_instruction(&ch8);
+  uint8_t first = ch8.reg_v[0];
+  chip8_init(&ch8);
+  chip8_seed(&ch8, 1234);
+  set_instruction_at(&ch8, 0x0200, 0xC0FF);
+  chip8_run_instruction(&ch8);
+  assert(ch8.reg_v[0] == first);
 
   // 7XKK - Let VX = VX + KK
   chip8_init(&ch8);
@@ -189,23 +220,23 @@ static void test_run_instruction() {
   assert(ch8.reg_v[2] == 0x02);
   assert(ch8.ip == 0x0202);
 
-  // 8XY1 - Let VX = VX/VY (VF changed)
+  // 8XY1 - Let VX = VX/VY (VF changed), where / is the manual's OR
   chip8_init(&ch8);
   set_instruction_at(&ch8, 0x0200, 0x8121);
-  ch8.reg_v[1] = 0x04;
-  ch8.reg_v[2] = 0x02;
+  ch8.reg_v[1] = 0x14;
+  ch8.reg_v[2] = 0x06;
   chip8_run_instruction(&ch8);
-  assert(ch8.reg_v[1] == 0x02);
-  assert(ch8.reg_v[2] == 0x02);
+  assert(ch8.reg_v[1] == 0x16);
+  assert(ch8.reg_v[2] == 0x06);
   assert(ch8.ip == 0x0202);
 
+  // VY of 0 leaves VX alone, rather than dividing by it.
   chip8_init(&ch8);
   set_instruction_at(&ch8, 0x0200, 0x8121);
   ch8.reg_v[1] = 0x01;
-  ch8.reg_v[2] = 0x03;
-  chip8_run_instruction(&ch8);
-  assert(ch8.reg_v[1] == 0x00);
-  assert(ch8.reg_v[2] == 0x03);
+  ch8.reg_v[2] = 0x00;
+  assert(chip8_run_instruction(&ch8) == CHIP8_STOP_BUDGET);
+  assert(ch8.reg_v[1] == 0x01);
   assert(ch8.ip == 0x0202);
 
   // 8XY2 - Let VX = VX & VY (VF changed)
@@ -283,14 +314,14 @@ static void test_run_instruction() {
   ch8.reg_v[1] = 0x12;
   ch8.timer = 0x0C;
   chip8_run_instruction(&ch8);
-  // assert(ch8.reg_v[1] == 0x0C); // TODO depends on clock speed
+  assert(ch8.reg_v[1] == 0x0C);
   assert(ch8.ip == 0x0202);
 
   // FX0A - Let VX = hexadecimal key digit (waits for key press)
   chip8_init(&ch8);
   set_instruction_at(&ch8, 0x0200, 0xF10A);
   ch8.reg_v[1] = 0x11;
-  ch8.keypress = CHIP8_NO_KEY_PRESSED;
+  ch8.keys = 0;
   chip8_run_instruction(&ch8);
   assert(ch8.reg_v[1] == 0x11);
   assert(ch8.ip == 0x0200);
@@ -298,11 +329,22 @@ static void test_run_instruction() {
   chip8_init(&ch8);
   set_instruction_at(&ch8, 0x0200, 0xF10A);
   ch8.reg_v[1] = 0x11;
-  ch8.keypress = 7;
+  ch8.keys = 1 << 7;
   chip8_run_instruction(&ch8);
   assert(ch8.reg_v[1] == 0x07);
   assert(ch8.ip == 0x0202);
 
+  // Several keys can be held at once. FX0A takes the lowest.
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0xE19E);
+  set_instruction_at(&ch8, 0x0204, 0xF20A);
+  ch8.reg_v[1] = 0x0C;
+  ch8.keys = 1 << 0x0C | 1 << 0x03;
+  chip8_run_instruction(&ch8);
+  assert(ch8.ip == 0x0204);
+  chip8_run_instruction(&ch8);
+  assert(ch8.reg_v[2] == 0x03);
+
   // FX15 - Set timer = VX (01 = 1/60 second)
   chip8_init(&ch8);
   set_instruction_at(&ch8, 0x0200, 0xF115);
@@ -387,9 +429,9 @@ static void test_run_instruction() {
   // 00E0 - Erase display (all 0s)
   chip8_init(&ch8);
   set_instruction_at(&ch8, 0x0200, 0x00E0);
-  ch8.framebuffer[0x42] = 0xFF;
+  chip8_set_row(&ch8, 0x08, 0xFF00);
   chip8_run_instruction(&ch8);
-  assert(ch8.framebuffer[0x42] == 0);
+  assert(chip8_row(&ch8, 0x08) == 0);
   assert(ch8.ip == 0x0202);
 
   // DXYN - Show n byte MI pattern at VX - VY coordinates.
@@ -402,9 +444,11 @@ static void test_run_instruction() {
   ch8.reg_i = 0x0300;
   ch8.mem[0x300] = 0x33;
   chip8_run_instruction(&ch8);
-  assert(ch8.framebuffer[0] == 0x33);
-  for (int i = 1; i < CHIP8_FRAMEBUFFER_SIZE; i++)
-    assert(ch8.framebuffer[i] == 0);
+  assert(chip8_row(&ch8, 0) == 0x33ull << 56);
+  for (int y = 1; y < CHIP8_FRAMEBUFFER_Y_LEN; y++) {
+    assert(chip8_row(&ch8, y) == 0);
+  }
+  assert(chip8_pixel(&ch8, 2, 0) && !chip8_pixel(&ch8, 1, 0));
   assert(ch8.reg_v[15] == 0);
   assert(ch8.ip == 0x0202);
 
@@ -415,10 +459,10 @@ static void test_run_instruction() {
   ch8.reg_i = 0x0300;
   ch8.mem[0x300] = 0xA3;
   chip8_run_instruction(&ch8);
-  assert(ch8.framebuffer[0] == 0x51);
-  assert(ch8.framebuffer[1] == 0x80);
-  for (int i = 2; i < CHIP8_FRAMEBUFFER_SIZE; i++)
-    assert(ch8.framebuffer[i] == 0);
+  assert(chip8_row(&ch8, 0) == 0xA3ull << 55);
+  for (int y = 1; y < CHIP8_FRAMEBUFFER_Y_LEN; y++) {
+    assert(chip8_row(&ch8, y) == 0);
+  }
   assert(ch8.reg_v[15] == 0);
   assert(ch8.ip == 0x0202);
 
@@ -428,12 +472,9 @@ static void test_run_instruction() {
   ch8.reg_v[2] = 0x00;
   ch8.reg_i = 0x0300;
   ch8.mem[0x300] = 0xA3;
-  ch8.framebuffer[1] = 0x80;
+  chip8_set_row(&ch8, 0, 1ull << 55);  // x = 8
   chip8_run_instruction(&ch8);
-  assert(ch8.framebuffer[0] == 0x51);
-  assert(ch8.framebuffer[1] == 0x00);
-  for (int i = 2; i < CHIP8_FRAMEBUFFER_SIZE; i++)
-    assert(ch8.framebuffer[i] == 0);
+  assert(chip8_row(&ch8, 0) == 0xA2ull << 55);
   assert(ch8.reg_v[15] == 1);
   assert(ch8.ip == 0x0202);
 
@@ -445,15 +486,63 @@ static void test_run_instruction() {
   ch8.mem[0x300] = 0x01;
   ch8.mem[0x301] = 0x24;
   ch8.mem[0x302] = 0xFF;
-  ch8.framebuffer[24] = 0x10;
+  chip8_set_row(&ch8, 3, 1ull << 60);  // x = 3
   chip8_run_instruction(&ch8);
-  assert(ch8.framebuffer[16] == 0x00);
-  assert(ch8.framebuffer[17] == 0x80);
-  assert(ch8.framebuffer[24] == 0x02);
-  assert(ch8.framebuffer[25] == 0x00);
+  assert(chip8_row(&ch8, 2) == 1ull << 55);
+  assert(chip8_row(&ch8, 3) == 1ull << 57);
+  assert(chip8_row(&ch8, 4) == 0);
   assert(ch8.reg_v[15] == 1);
   assert(ch8.ip == 0x0202);
 
+  // Sprites are clipped at the right and bottom edges, after the position
+  // wraps around.
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0xD125);
+  ch8.reg_v[1] = 0x3C;  // x = 60
+  ch8.reg_v[2] = 0x3E;  // y = 62, so 30
+  ch8.reg_i = 0x0300;
+  memset(&ch8.mem[0x300], 0xFF, 5);
+  chip8_run_instruction(&ch8);
+  assert(chip8_row(&ch8, 29) == 0);
+  assert(chip8_row(&ch8, 30) == 0x0F);
+  assert(chip8_row(&ch8, 31) == 0x0F);
+  assert(chip8_row(&ch8, 0) == 0);
+  assert(ch8.reg_v[15] == 0);
+
+  // An odd height exercises both the paired and the single row paths.
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0xD12F);
+  ch8.reg_v[1] = 0x41;  // x = 65, so 1
+  ch8.reg_v[2] = 0x00;
+  ch8.reg_i = 0x0300;
+  for (int i = 0; i < 15; i++) ch8.mem[0x300 + i] = 0x80 >> (i % 8);
+  chip8_set_row(&ch8, 14, 1ull << 56);  // x = 7, under the last row
+  chip8_run_instruction(&ch8);
+  for (int y = 0; y < 14; y++) {
+    assert(chip8_row(&ch8, y) == (0x80ull >> (y % 8)) << 55);
+  }
+  assert(chip8_row(&ch8, 14) == 0);
+  assert(ch8.reg_v[15] == 1);
+
+  // Draws mark the rows they cover, clipped, and 00E0 the rows it blanks.
+  chip8_init(&ch8);
+  assert(chip8_take_dirty_rows(&ch8) == CHIP8_FRAMEBUFFER_ALL_ROWS);
+  assert(!chip8_frame_changed(&ch8));
+  set_instruction_at(&ch8, 0x0200, 0xD125);
+  set_instruction_at(&ch8, 0x0202, 0x00E0);
+  set_instruction_at(&ch8, 0x0204, 0x00E0);
+  ch8.reg_v[1] = 0x00;
+  ch8.reg_v[2] = 0x1D;  // y = 29, rows 29 to 31
+  ch8.reg_i = 0x0300;
+  memset(&ch8.mem[0x300], 0xFF, 5);
+  chip8_run_instruction(&ch8);
+  assert(chip8_frame_changed(&ch8));
+  assert(chip8_take_dirty_rows(&ch8) == 0xE0000000u);
+  chip8_run_instruction(&ch8);
+  assert(chip8_take_dirty_rows(&ch8) == 0xE0000000u);
+  chip8_run_instruction(&ch8);
+  assert(!chip8_frame_changed(&ch8));
+
   // 0MMM - Do machine language subroutine at 0MMM (subroutine must end with D4
   // byte)
   chip8_init(&ch8);
@@ -464,9 +553,1150 @@ static void test_run_instruction() {
   assert(ch8.ip == 0x00D4);
 }
 
+static void test_timers() {
+  chip8_t ch8;
+  uint32_t ran;
+
+  // Timers count down at 60 Hz whatever the CPU speed.
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0x6005);  // V0 = 05
+  set_instruction_at(&ch8, 0x0202, 0xF015);  // timer = V0
+  set_instruction_at(&ch8, 0x0204, 0xF018);  // tone = V0
+  set_instruction_at(&ch8, 0x0206, 0x7101);  // V1 = V1 + 01
+  set_instruction_at(&ch8, 0x0208, 0x1206);  // Go to 206
+  assert(chip8_frame_cycles(&ch8, 1) == 10);
+  assert(chip8_run_cycles(&ch8, 9, NULL) == CHIP8_STOP_BUDGET);
+  assert(chip8_timer(&ch8) == 5);
+  assert(chip8_run_cycles(&ch8, 1, NULL) == CHIP8_STOP_BUDGET);
+  assert(chip8_timer(&ch8) == 4);
+  assert(chip8_tone(&ch8) == 4);
+  assert(chip8_run_frames(&ch8, 3, &ran) == CHIP8_STOP_BUDGET);
+  assert(ran == 30);
+  assert(chip8_timer(&ch8) == 1);
+  assert(chip8_run_frames(&ch8, 100, NULL) == CHIP8_STOP_BUDGET);
+  assert(chip8_timer(&ch8) == 0);
+  assert(chip8_tone(&ch8) == 0);
+  assert(chip8_ticks(&ch8) == 104);
+
+  // Speed changes count cycles and ticks over from zero, with the timers
+  // carried across.
+  ch8.timer = 3;
+  ch8.timer_tick = chip8_ticks(&ch8) - 1;
+  assert(chip8_timer(&ch8) == 2);
+  chip8_set_cpu_hz(&ch8, 500);
+  assert(ch8.cycle == 0 && chip8_ticks(&ch8) == 0);
+  assert(chip8_timer(&ch8) == 2);
+  assert(chip8_frame_cycles(&ch8, 1) == 9);
+  assert(chip8_frame_cycles(&ch8, 2) == 17);
+  assert(chip8_frame_cycles(&ch8, 6) == 50);
+  assert(chip8_run_frames(&ch8, 6, &ran) == CHIP8_STOP_BUDGET);
+  assert(ran == 50);
+  assert(chip8_ticks(&ch8) == 6);
+  assert(chip8_timer(&ch8) == 0);
+  assert(chip8_frame_cycles(&ch8, 0) == 0);
+
+  // Frames run past draws but stop on anything else.
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0xD001);  // Draw 1 byte at V0, V0
+  set_instruction_at(&ch8, 0x0202, 0x1200);  // Go to 200
+  assert(chip8_run_frames(&ch8, 2, &ran) == CHIP8_STOP_BUDGET);
+  assert(ran == 20);
+  set_instruction_at(&ch8, 0x0200, 0xF00A);  // V0 = key
+  assert(chip8_run_frames(&ch8, 2, &ran) == CHIP8_STOP_WAIT_KEY);
+  assert(ran == 20);
+}
+
+static void assert_same_machine(const chip8_t* a, const chip8_t* b) {
+  assert(a->ip == b->ip);
+  assert(a->reg_i == b->reg_i);
+  assert(memcmp(a->reg_v, b->reg_v, sizeof(a->reg_v)) == 0);
+  assert(a->timer == b->timer);
+  assert(a->tone_clock == b->tone_clock);
+  assert(a->cycle == b->cycle);
+  assert(a->rng == b->rng);
+  assert(a->timer_tick == b->timer_tick);
+  assert(a->tone_tick == b->tone_tick);
+  assert(a->sp == b->sp);
+  assert(memcmp(a->stack, b->stack, sizeof(a->stack)) == 0);
+  assert(memcmp(a->mem, b->mem, sizeof(a->mem)) == 0);
+  assert(memcmp(a->framebuffer, b->framebuffer, sizeof(a->framebuffer)) == 0);
+}
+
+// Run `count` cycles through an engine, carrying on past its events.
+static void cache_run_all(chip8_cache_t* cache, chip8_t* ch8, uint32_t count) {
+  while (count > 0) {
+    uint32_t ran;
+    chip8_cache_run(cache, ch8, count, &ran);
+    count -= ran;
+  }
+}
+
+static void jit_run_all(chip8_jit_t* jit, chip8_t* ch8, uint32_t count) {
+  while (count > 0) {
+    uint32_t ran;
+    chip8_jit_run(jit, ch8, count, &ran);
+    count -= ran;
+  }
+}
+
+static void test_run_cycles() {
+  chip8_t ch8;
+  uint32_t ran;
+
+  // Budget exhausted.
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0x7001);  // V0 = V0 + 01
+  set_instruction_at(&ch8, 0x0202, 0x1200);  // Go to 200
+  assert(chip8_run_cycles(&ch8, 1001, &ran) == CHIP8_STOP_BUDGET);
+  assert(ran == 1001);
+  assert(ch8.reg_v[0] == 501 % 256);
+
+  // Drawing ends the batch after the instruction that drew.
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0x6005);  // V0 = 05
+  set_instruction_at(&ch8, 0x0202, 0xD001);  // Draw 1 byte at V0, V0
+  set_instruction_at(&ch8, 0x0204, 0x00E0);  // Erase display
+  assert(chip8_run_cycles(&ch8, 100, &ran) == CHIP8_STOP_FRAME);
+  assert(ran == 2);
+  assert(ch8.ip == 0x0204);
+  assert(chip8_run_cycles(&ch8, 100, &ran) == CHIP8_STOP_FRAME);
+  assert(ran == 1);
+
+  // FX0A waits on the same instruction until a key is pressed.
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0xF30A);  // V3 = key
+  assert(chip8_run_cycles(&ch8, 100, &ran) == CHIP8_STOP_WAIT_KEY);
+  assert(ran == 1);
+  assert(ch8.ip == 0x0200);
+  ch8.keys = 1 << 0x0B;
+  assert(chip8_run_cycles(&ch8, 1, NULL) == CHIP8_STOP_BUDGET);
+  assert(ch8.reg_v[3] == 0x0B);
+
+  // Unknown opcodes stop on themselves instead of exiting.
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0x6001);  // V0 = 01
+  set_instruction_at(&ch8, 0x0202, 0x5011);  // 5XY0 with N != 0
+  assert(chip8_run_cycles(&ch8, 100, &ran) == CHIP8_STOP_ILLEGAL);
+  assert(ran == 2);
+  assert(ch8.ip == 0x0202);
+  assert(chip8_run_instruction(&ch8) == CHIP8_STOP_ILLEGAL);
+
+  // So do accesses through I past the end of memory, and running off it.
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0xAFFE);  // I = FFE
+  set_instruction_at(&ch8, 0x0202, 0xF255);  // MI = V0 : V2
+  assert(chip8_run_cycles(&ch8, 100, NULL) == CHIP8_STOP_ILLEGAL);
+  assert(ch8.ip == 0x0202);
+  assert(ch8.reg_i == 0x0FFE);
+
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0x1FFF);  // Go to FFF
+  assert(chip8_run_cycles(&ch8, 100, &ran) == CHIP8_STOP_ILLEGAL);
+  assert(ran == 2);
+  assert(ch8.ip == 0x0FFF);
+
+  // The debug view lists the code up to the end of memory, and nothing
+  // past it.
+  char* listing;
+  size_t length;
+  set_instruction_at(&ch8, 0x0FFC, 0x00E0);
+  FILE* out = open_memstream(&listing, &length);
+  chip8_code_report(&ch8, out);
+  fclose(out);
+  assert(strcmp(listing,
+                "  0FFB: 0000\r\n"
+                "  0FFD: E000\r\n"
+                "> 0FFF:\r\n"
+                "  1001:\r\n"
+                "  1003:\r\n"
+                "  1005:\r\n"
+                "  1007:\r\n"
+                "  1009:\r\n") == 0);
+  free(listing);
+
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0x60FF);  // V0 = FF
+  set_instruction_at(&ch8, 0x0202, 0xBFFF);  // Go to FFF + V0
+  assert(chip8_run_cycles(&ch8, 100, NULL) == CHIP8_STOP_ILLEGAL);
+  assert(ch8.ip == 0x10FE);
+  out = open_memstream(&listing, &length);
+  chip8_code_report(&ch8, out);
+  fclose(out);
+  assert(strncmp(listing, "  10FA:\r\n", 9) == 0);
+  assert(strstr(listing, "> 10FE:\r\n") != NULL);
+  free(listing);
+
+  // Returning with an empty stack, and recursing without end.
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0x00EE);  // Return from subroutine
+  assert(chip8_run_cycles(&ch8, 100, NULL) == CHIP8_STOP_STACK_FAULT);
+  assert(ch8.ip == 0x0200);
+  assert(ch8.sp == 0);
+
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0x2200);  // Do subroutine at 200
+  assert(chip8_run_cycles(&ch8, 1000, &ran) == CHIP8_STOP_STACK_FAULT);
+  assert(ran == CHIP8_STACK_SIZE + 1);
+  assert(ch8.sp == CHIP8_STACK_SIZE);
+}
+
+static void load_delay_loop(chip8_t* ch8) {
+  chip8_init(ch8);
+  set_instruction_at(ch8, 0x0200, 0x6005);  // V0 = 05
+  set_instruction_at(ch8, 0x0202, 0xF015);  // timer = V0
+  set_instruction_at(ch8, 0x0204, 0xF107);  // V1 = timer
+  set_instruction_at(ch8, 0x0206, 0x3100);  // skip if V1 == 00
+  set_instruction_at(ch8, 0x0208, 0x1204);  // Go to 204
+  set_instruction_at(ch8, 0x020A, 0x7201);  // V2 = V2 + 01
+  set_instruction_at(ch8, 0x020C, 0x1202);  // Go to 202
+}
+
+static void test_idle() {
+  chip8_t expected, actual;
+  uint32_t ran;
+
+  // Jump to self.
+  chip8_init(&actual);
+  set_instruction_at(&actual, 0x0200, 0x1200);  // Go to 200
+  assert(chip8_run_cycles(&actual, 100, &ran) == CHIP8_STOP_IDLE);
+  assert(ran == 1);
+  assert(chip8_idle(&actual) == CHIP8_IDLE_FOREVER);
+  assert(chip8_fast_forward(&actual, 1000) == 1000);
+  assert(actual.cycle == 1001);
+  assert(actual.ip == 0x0200);
+
+  // Key wait, until a key is pressed.
+  chip8_init(&actual);
+  set_instruction_at(&actual, 0x0200, 0xF30A);  // V3 = key
+  assert(chip8_idle(&actual) == CHIP8_IDLE_KEY);
+  actual.keys = 1 << 0x04;
+  assert(chip8_idle(&actual) == CHIP8_IDLE_NONE);
+  assert(chip8_fast_forward(&actual, 1000) == 0);
+
+  // Delay loops are skipped exactly, whatever the budget and CPU speed.
+  uint32_t speeds[] = {600, 500, 1000, 7};
+  for (int s = 0; s < 4; s++) {
+    for (uint32_t budget = 1; budget < 40; budget += 3) {
+      load_delay_loop(&expected);
+      chip8_set_cpu_hz(&expected, speeds[s]);
+      actual = expected;
+
+      bool idled = false;
+      for (uint32_t left = 200 * budget; left > 0; left -= ran) {
+        chip8_run_cycles(&expected, left, &ran);
+      }
+      for (int i = 0; i < 200; i++) {
+        uint32_t left = budget;
+        while (left > 0) {
+          chip8_stop_t stop = chip8_run_cycles(&actual, left, &ran);
+          left -= ran;
+          if (stop == CHIP8_STOP_IDLE) {
+            assert(chip8_idle(&actual) == CHIP8_IDLE_TIMER);
+            ran = chip8_fast_forward(&actual, left);
+            idled |= ran > 0;
+            left -= ran;
+          }
+        }
+      }
+
+      assert_same_machine(&expected, &actual);
+      assert(idled || budget < 3 || speeds[s] < CHIP8_TIMER_HZ);
+    }
+  }
+
+  // The other engines stop on the same loops.
+  static chip8_cache_t cache;
+  chip8_jit_t* jit = chip8_jit_create();
+  uint32_t expected_ran;
+
+  load_delay_loop(&expected);
+  assert(chip8_run_cycles(&expected, 1000, &expected_ran) == CHIP8_STOP_IDLE);
+  assert(expected.ip == 0x0204);
+
+  load_delay_loop(&actual);
+  chip8_cache_init(&cache, &actual);
+  assert(chip8_cache_run(&cache, &actual, 1000, &ran) == CHIP8_STOP_IDLE);
+  assert(ran == expected_ran);
+  assert_same_machine(&expected, &actual);
+
+  if (jit) {
+    load_delay_loop(&actual);
+    assert(chip8_jit_run(jit, &actual, 1000, &ran) == CHIP8_STOP_IDLE);
+    assert(ran == expected_ran);
+    assert_same_machine(&expected, &actual);
+    chip8_jit_destroy(jit);
+  }
+}
+
+static void test_decode_cache() {
+  static chip8_cache_t cache;
+  chip8_t expected, actual;
+
+  // Same results as the interpreter on a real ROM.
+  chip8_init(&expected);
+  assert(chip8_load_rom(&expected, "./rocket.ch8"));
+  actual = expected;
+
+  for (int i = 0; i < 5000; i++) chip8_run_instruction(&expected);
+
+  chip8_cache_init(&cache, &actual);
+  cache_run_all(&cache, &actual, 5000);
+
+  assert_same_machine(&expected, &actual);
+
+  // And stops on the same events.
+  chip8_stop_t stops[200];
+  uint32_t ran[200];
+  chip8_init(&expected);
+  assert(chip8_load_rom(&expected, "./rocket.ch8"));
+  actual = expected;
+
+  for (int i = 0; i < 200; i++) {
+    stops[i] = chip8_run_cycles(&expected, 97, &ran[i]);
+  }
+
+  chip8_cache_init(&cache, &actual);
+  for (int i = 0; i < 200; i++) {
+    uint32_t actual_ran;
+    assert(chip8_cache_run(&cache, &actual, 97, &actual_ran) == stops[i]);
+    assert(actual_ran == ran[i]);
+  }
+
+  assert_same_machine(&expected, &actual);
+
+  // FX55 rewrites an instruction that was already predecoded.
+  chip8_init(&actual);
+  set_instruction_at(&actual, 0x0200, 0x6062);  // V0 = 62
+  set_instruction_at(&actual, 0x0202, 0x6177);  // V1 = 77
+  set_instruction_at(&actual, 0x0204, 0xA20A);  // I = 20A
+  set_instruction_at(&actual, 0x0206, 0xF155);  // MI = V0 : V1
+  set_instruction_at(&actual, 0x0208, 0x6000);  // V0 = 00
+  set_instruction_at(&actual, 0x020A, 0x6200);  // V2 = 00, becomes 6277
+  chip8_cache_init(&cache, &actual);
+  cache_run_all(&cache, &actual, 6);
+  assert(get_instruction_at(&actual, 0x020A) == 0x6277);
+  assert(actual.reg_v[2] == 0x77);
+  assert(actual.ip == 0x020C);
+}
+
+static void test_superinstructions() {
+  static chip8_cache_t cache;
+  chip8_t expected, actual;
+
+  chip8_init(&expected);
+  set_instruction_at(&expected, 0x0200, 0x6001);  // 6XKK run
+  set_instruction_at(&expected, 0x0202, 0x6102);
+  set_instruction_at(&expected, 0x0204, 0x6203);
+  set_instruction_at(&expected, 0x0206, 0xA300);  // ANNN DXYN
+  set_instruction_at(&expected, 0x0208, 0xD015);
+  set_instruction_at(&expected, 0x020A, 0x7001);  // 7XKK 3XKK
+  set_instruction_at(&expected, 0x020C, 0x3010);
+  set_instruction_at(&expected, 0x020E, 0x1206);
+  set_instruction_at(&expected, 0x0210, 0xF315);  // timer = 3
+  set_instruction_at(&expected, 0x0212, 0xF407);  // FX07 3X00 1NNN
+  set_instruction_at(&expected, 0x0214, 0x3400);
+  set_instruction_at(&expected, 0x0216, 0x1212);
+  set_instruction_at(&expected, 0x0218, 0x4000);
+  set_instruction_at(&expected, 0x021A, 0x1200);
+  set_instruction_at(&expected, 0x021C, 0x1208);  // into the middle of a pair
+  expected.mem[0x300] = 0xF0;
+  actual = expected;
+
+  for (int i = 0; i < 3000; i++) chip8_run_instruction(&expected);
+
+  chip8_cache_init(&cache, &actual);
+  for (uint32_t i = 0, left = 3000; left > 0; i++) {
+    uint32_t slice = i % 7 < left ? i % 7 : left;
+    cache_run_all(&cache, &actual, slice);
+    left -= slice;
+  }
+
+  assert_same_machine(&expected, &actual);
+  assert(cache.executed == 3000);
+  for (int i = CHIP8_FUSION_NONE + 1; i < CHIP8_FUSION_COUNT; i++) {
+    assert(cache.fired[i] > 0);
+  }
+}
+
+static void test_jit() {
+  chip8_jit_t* jit = chip8_jit_create();
+  chip8_t expected, actual;
+
+  if (jit == NULL) {
+    printf("JIT not supported on this host, skipping\n");
+    return;
+  }
+
+  // Same results as the interpreter on a real ROM, in uneven slices.
+  chip8_init(&expected);
+  assert(chip8_load_rom(&expected, "./rocket.ch8"));
+  actual = expected;
+
+  for (int i = 0; i < 5000; i++) chip8_run_instruction(&expected);
+
+  for (uint32_t i = 0, left = 5000; left > 0; i++) {
+    uint32_t slice = i % 19 < left ? i % 19 : left;
+    jit_run_all(jit, &actual, slice);
+    left -= slice;
+  }
+
+  assert_same_machine(&expected, &actual);
+
+  // Register and branch instructions compiled into a chained loop.
+  chip8_init(&expected);
+  set_instruction_at(&expected, 0x0200, 0x6001);  // V0 = 01
+  set_instruction_at(&expected, 0x0202, 0x61FF);  // V1 = FF
+  set_instruction_at(&expected, 0x0204, 0x8014);  // V0 = V0 + V1
+  set_instruction_at(&expected, 0x0206, 0x8105);  // V1 = V1 - V0
+  set_instruction_at(&expected, 0x0208, 0x7203);  // V2 = V2 + 03
+  set_instruction_at(&expected, 0x020A, 0x8320);  // V3 = V2
+  set_instruction_at(&expected, 0x020C, 0x8F32);  // VF = VF & V3
+  set_instruction_at(&expected, 0x020E, 0xA300);  // I = 300
+  set_instruction_at(&expected, 0x0210, 0xF21E);  // I = I + V2
+  set_instruction_at(&expected, 0x0212, 0x5230);  // skip if V2 == V3
+  set_instruction_at(&expected, 0x0214, 0x1200);  // never taken
+  set_instruction_at(&expected, 0x0216, 0x9010);  // skip if V0 != V1
+  set_instruction_at(&expected, 0x0218, 0x1204);
+  set_instruction_at(&expected, 0x021A, 0x4290);  // skip if V2 != 90
+  set_instruction_at(&expected, 0x021C, 0x121C);  // jump to self
+  set_instruction_at(&expected, 0x021E, 0x1204);
+  actual = expected;
+
+  for (int i = 0; i < 10000; i++) chip8_run_instruction(&expected);
+  chip8_jit_invalidate(jit, 0, CHIP8_MEMORY_SIZE);
+  jit_run_all(jit, &actual, 10000);
+
+  assert_same_machine(&expected, &actual);
+
+  // FX55 rewrites an instruction inside a compiled block.
+  chip8_init(&actual);
+  set_instruction_at(&actual, 0x0200, 0x6062);  // V0 = 62
+  set_instruction_at(&actual, 0x0202, 0x6177);  // V1 = 77
+  set_instruction_at(&actual, 0x0204, 0x6200);  // V2 = 00, becomes 6277
+  set_instruction_at(&actual, 0x0206, 0xA204);  // I = 204
+  set_instruction_at(&actual, 0x0208, 0xF155);  // MI = V0 : V1
+  set_instruction_at(&actual, 0x020A, 0x1200);  // Go to 200
+  chip8_jit_invalidate(jit, 0, CHIP8_MEMORY_SIZE);
+  jit_run_all(jit, &actual, 9);
+  assert(actual.reg_v[2] == 0x77);
+  assert(actual.ip == 0x0206);
+
+  chip8_jit_destroy(jit);
+}
+
+static void test_headless() {
+  headless_config_t config = {.max_frames = 600, .max_cycles = 0, .script = NULL};
+  headless_stats_t stats, expected;
+  engine_t engine;
+  chip8_t ch8;
+
+  // Every engine ends up in the same place.
+  for (int kind = ENGINE_INTERPRETER; kind <= ENGINE_JIT; kind++) {
+    if (engine_init(&engine, kind) != OK) continue;
+    chip8_init(&ch8);
+    assert(chip8_load_rom(&ch8, "./rocket.ch8"));
+    engine_reset(&engine, &ch8);
+    assert(headless_run(&engine, &ch8, &config, &stats) == OK);
+    engine_destroy(&engine);
+
+    assert(stats.end == HEADLESS_FRAME_LIMIT);
+    assert(stats.frames == 600);
+    assert(stats.cycles == 6000);
+    if (kind == ENGINE_INTERPRETER) expected = stats;
+    assert(stats.hash == expected.hash);
+  }
+
+  // 8XY1 with VY at 0, which once divided by it, on every engine.
+  config.max_frames = 2;
+  for (int kind = ENGINE_INTERPRETER; kind <= ENGINE_JIT; kind++) {
+    if (engine_init(&engine, kind) != OK) continue;
+    chip8_init(&ch8);
+    set_instruction_at(&ch8, 0x0200, 0x6005);  // V0 = 05
+    set_instruction_at(&ch8, 0x0202, 0x6100);  // V1 = 00
+    set_instruction_at(&ch8, 0x0204, 0x8011);  // V0 = V0 | V1
+    set_instruction_at(&ch8, 0x0206, 0x1206);  // Go to 206
+    engine_reset(&engine, &ch8);
+    assert(headless_run(&engine, &ch8, &config, &stats) == OK);
+    engine_destroy(&engine);
+    assert(stats.end != HEADLESS_FAULT);
+    assert(ch8.reg_v[0] == 0x05 && ch8.ip == 0x0206);
+  }
+
+  // Scripted key presses, then stuck on a jump to self.
+  char script[] = "# frame key\n30 7\n";
+  config.max_frames = 0;
+  config.script = fmemopen(script, strlen(script), "r");
+  assert(engine_init(&engine, ENGINE_INTERPRETER) == OK);
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0xF00A);  // V0 = key
+  set_instruction_at(&ch8, 0x0202, 0xF029);  // I = digit V0
+  set_instruction_at(&ch8, 0x0204, 0xD115);  // Draw it
+  set_instruction_at(&ch8, 0x0206, 0x1206);  // Go to 206
+  assert(headless_run(&engine, &ch8, &config, &stats) == OK);
+  fclose(config.script);
+  assert(stats.end == HEADLESS_STUCK);
+  assert(stats.frames == 30);
+  assert(ch8.reg_v[0] == 0x07);
+  assert(ch8.ip == 0x0206);
+  assert(stats.hash != headless_hash(&(chip8_t){0}));
+
+  // Frames out of order.
+  char bad[] = "30 7\n20 1\n";
+  config.script = fmemopen(bad, strlen(bad), "r");
+  assert(headless_run(&engine, &ch8, &config, &stats) == ERR);
+  fclose(config.script);
+  engine_destroy(&engine);
+}
+
+static void test_farm() {
+  const uint32_t machines = 64;
+  chip8_farm_t* farm = chip8_farm_create(machines, 4, ENGINE_CACHE);
+  assert(farm != NULL);
+  assert(chip8_farm_size(farm) == machines);
+
+  for (uint32_t i = 0; i < machines; i++) {
+    chip8_t* ch8 = chip8_farm_machine(farm, i);
+    assert(chip8_load_rom(ch8, "./rocket.ch8"));
+    chip8_seed(ch8, i + 1);
+    chip8_farm_reset(farm, i);
+  }
+  for (int batch = 0; batch < 10; batch++) chip8_farm_run(farm, 10);
+
+  // Wherever a machine ran, it ends up where it would have on its own.
+  engine_t engine;
+  assert(engine_init(&engine, ENGINE_INTERPRETER) == OK);
+  for (uint32_t i = 0; i < machines; i++) {
+    chip8_t expected;
+    chip8_init(&expected);
+    assert(chip8_load_rom(&expected, "./rocket.ch8"));
+    chip8_seed(&expected, i + 1);
+    engine_reset(&engine, &expected);
+    for (int batch = 0; batch < 10; batch++) {
+      engine_run(&engine, &expected, chip8_frame_cycles(&expected, 10));
+    }
+
+    assert_same_machine(&expected, chip8_farm_machine(farm, i));
+    const chip8_farm_stats_t* stats = chip8_farm_stats(farm, i);
+    assert(stats->cycles == expected.cycle);
+    assert(stats->stop == CHIP8_STOP_BUDGET);
+  }
+  engine_destroy(&engine);
+
+  // A faulting machine is parked until it is reset.
+  chip8_t* ch8 = chip8_farm_machine(farm, 0);
+  chip8_init(ch8);
+  set_instruction_at(ch8, 0x0200, 0x0000);  // Illegal
+  chip8_farm_reset(farm, 0);
+  chip8_farm_run(farm, 1);
+  assert(chip8_farm_stats(farm, 0)->stop == CHIP8_STOP_ILLEGAL);
+  uint64_t cycles = chip8_farm_stats(farm, 0)->cycles;
+  chip8_farm_run(farm, 1);
+  assert(chip8_farm_stats(farm, 0)->cycles == cycles);
+
+  chip8_farm_destroy(farm);
+}
+
+static void test_batch() {
+  static const uint16_t program[] = {
+    0x6A05,  // VA = 5
+    0x7B03,  // VB = VB + 3
+    0x8AB4,  // VA = VA + VB
+    0x8FA5,  // VF = VF - VA
+    0x8BA2,  // VB = VB & VA
+    0x8CB1,  // VC = VC | VB
+    0x3C10,  // Skip if VC == 10
+    0x7D01,  // VD = VD + 1
+    0x4D00,  // Skip if VD != 0
+    0x7E01,  // VE = VE + 1
+    0x5AB0,  // Skip if VA == VB
+    0x9AB0,  // Skip if VA != VB
+    0xE19E,  // Skip if V1 == key
+    0xE1A1,  // Skip if V1 != key
+    0xA300,  // I = 300
+    0xF11E,  // I = I + V1
+    0xFA29,  // I = digit VA
+    0xD125,  // Draw it at V1, V2
+    0xC30F,  // V3 = random & 0F
+    0xA400,  // I = 400
+    0xF333,  // MI = decimal V3
+    0x6001,  // V0 = 1
+    0x8032,  // V0 = V0 & V3
+    0x8004,  // V0 = V0 + V0
+    0xB234,  // Go to 234 + V0
+    0x0000,  // Never reached
+    0x7201,  // V2 = V2 + 1
+    0x1200,  // Go to 200
+  };
+  enum { LANES = 70, STEPS = 500 };
+  chip8_t init, expected[LANES], actual;
+
+  chip8_init(&init);
+  for (uint16_t i = 0; i < sizeof(program) / sizeof(program[0]); i++) {
+    set_instruction_at(&init, 0x0200 + 2 * i, program[i]);
+  }
+  chip8_batch_t* batch = chip8_batch_create(LANES, &init);
+  assert(batch != NULL);
+  assert(chip8_batch_size(batch) == LANES);
+
+  // Lanes start apart and drift in and out of step. One runs slightly
+  // different code and one a different ROM.
+  for (uint32_t lane = 0; lane < LANES; lane++) {
+    expected[lane] = init;
+    expected[lane].reg_v[0xB] = lane * 37;
+    expected[lane].reg_v[0x1] = lane & 0x0F;
+    if (lane % 3 == 0) expected[lane].keys = 1 << (lane & 0x0F);
+    chip8_seed(&expected[lane], lane + 1);
+    if (lane == 7) set_instruction_at(&expected[lane], 0x0202, 0x7B07);
+    if (lane == 9) {
+      chip8_init(&expected[lane]);
+      assert(chip8_load_rom(&expected[lane], "./rocket.ch8"));
+    }
+    chip8_batch_load(batch, lane, &expected[lane]);
+  }
+
+  for (int step = 0; step < STEPS; step++) {
+    if (step == STEPS / 2) {
+      expected[4].keys = 1 << 0x04;
+      chip8_batch_set_keys(batch, 4, 1 << 0x04);
+    }
+    chip8_batch_step(batch);
+    for (uint32_t lane = 0; lane < LANES; lane++) {
+      assert(chip8_batch_stop(batch, lane) ==
+             chip8_run_instruction(&expected[lane]));
+    }
+  }
+  for (uint32_t lane = 0; lane < LANES; lane++) {
+    chip8_batch_store(batch, lane, &actual);
+    assert_same_machine(&expected[lane], &actual);
+  }
+
+  // Same for whole slices, including lanes stopping early.
+  uint32_t ran[LANES], expected_ran;
+  set_instruction_at(&expected[5], 0x0222, 0x0000);  // Illegal
+  chip8_batch_load(batch, 5, &expected[5]);
+  chip8_batch_run_cycles(batch, 1000, ran);
+  for (uint32_t lane = 0; lane < LANES; lane++) {
+    assert(chip8_batch_stop(batch, lane) ==
+           chip8_run_cycles(&expected[lane], 1000, &expected_ran));
+    assert(ran[lane] == expected_ran);
+    chip8_batch_store(batch, lane, &actual);
+    assert_same_machine(&expected[lane], &actual);
+  }
+  assert(chip8_batch_stop(batch, 5) == CHIP8_STOP_ILLEGAL);
+  assert(chip8_batch_stop(batch, 0) == CHIP8_STOP_FRAME);
+
+  chip8_batch_destroy(batch);
+}
+
+static void test_input() {
+  input_t input;
+  const uint64_t ms = 1000000;
+  input_init(&input, 100);
+
+  // Keys stay down until the hold runs out, and pressing again extends it.
+  input_press(&input, 0x5, 0, 1 * ms);
+  input_press(&input, 0xA, 0, 3 * ms);
+  assert(input.keys == (1 << 0x5 | 1 << 0xA));
+  input_release(&input, 90 * ms);
+  input_press(&input, 0x5, 90 * ms, 90 * ms);
+  input_release(&input, 102 * ms);
+  assert(input.keys == (1 << 0x5 | 1 << 0xA));
+  input_release(&input, 103 * ms);
+  assert(input.keys == 1 << 0x5);
+  input_release(&input, 190 * ms);
+  assert(input.keys == 0);
+
+  // Out of range keys are ignored.
+  input_press(&input, 0x10, 0, 0);
+  assert(input.keys == 0);
+
+  assert(input.stats.presses == 3);
+  assert(input.stats.max_latency_ns == 3 * ms);
+  assert(input.stats.latency_ns == 4 * ms);
+
+  // Even without a hold, a press is seen once.
+  input_init(&input, 0);
+  input_release(&input, 5 * ms);
+  input_press(&input, 0x1, 5 * ms, 5 * ms);
+  assert(input.keys == 1 << 0x1);
+  input_release(&input, 5 * ms);
+  assert(input.keys == 0);
+}
+
+static void test_pacer() {
+  pacer_t pacer;
+  int fds[2];
+  assert(pipe(fds) == 0);
+
+  pacer_init(&pacer, 60);
+  assert(pacer_frames_due(&pacer, 6) == 1);
+  assert(pacer_frames_due(&pacer, 6) == 0);
+
+  // Sleeping runs right up to the deadline, and not past it by much.
+  assert(!pacer_wait(&pacer, fds[0], 0));
+  assert(pacer.stats.sleeps == 1);
+  assert(pacer.stats.max_late_ns < 10000000);
+  assert(pacer_frames_due(&pacer, 6) == 1);
+
+  // Input cuts it short.
+  assert(write(fds[1], "", 1) == 1);
+  assert(pacer_wait(&pacer, fds[0], 10));
+  assert(pacer.stats.sleeps == 1);
+
+  // A second behind, the backlog is dropped rather than run, and the next
+  // frame is due a period after the stall rather than six.
+  pacer.deadline.tv_sec -= 1;
+  assert(pacer_frames_due(&pacer, 6) == 6);
+  assert(pacer.stats.skipped >= 50);
+  assert(pacer_frames_due(&pacer, 6) == 0);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t ahead = (pacer.deadline.tv_sec - now.tv_sec) * 1000000000LL +
+                  (pacer.deadline.tv_nsec - now.tv_nsec);
+  assert(ahead > 0 && ahead <= pacer.period_ns);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+static void test_snapshot() {
+  static chip8_t ch8, restored, clone;
+  static uint8_t base[CHIP8_MEMORY_SIZE];
+  static uint8_t snapshot[CHIP8_SNAPSHOT_MAX_SIZE];
+  chip8_init(&ch8);
+  assert(chip8_load_rom(&ch8, "./rocket.ch8") == OK);
+  memcpy(base, ch8.mem, CHIP8_MEMORY_SIZE);
+
+  // Fresh from loading, nothing but the registers is stored.
+  size_t size = chip8_snapshot(&ch8, base, snapshot, sizeof(snapshot));
+  assert(size == CHIP8_SNAPSHOT_HEADER_SIZE);
+
+  // Halfway through, a call deep, with something drawn and stored.
+  assert(chip8_run_frames(&ch8, 30, NULL) == CHIP8_STOP_BUDGET);
+  uint16_t ip = ch8.ip, reg_i = ch8.reg_i;
+  ch8.stack[ch8.sp++] = 0x0234;
+  ch8.reg_i = 0x0A00;
+  set_instruction_at(&ch8, 0x0300, 0xF155);
+  ch8.ip = 0x0300;
+  assert(chip8_run_instruction(&ch8) == CHIP8_STOP_BUDGET);
+  ch8.ip = ip;
+  ch8.reg_i = reg_i;
+  size = chip8_snapshot(&ch8, base, snapshot, sizeof(snapshot));
+  assert(size > CHIP8_SNAPSHOT_HEADER_SIZE && size < 1024);
+  assert(chip8_snapshot(&ch8, base, snapshot, size - 1) == 0);
+
+  chip8_init(&restored);
+  memcpy(restored.mem, base, CHIP8_MEMORY_SIZE);
+  assert(chip8_restore(&restored, base, snapshot, size) == OK);
+  assert(restored.ip == ch8.ip && restored.sp == ch8.sp);
+  assert(restored.stack[restored.sp - 1] == 0x0234);
+  assert(restored.cycle == ch8.cycle && restored.rng == ch8.rng);
+  assert(chip8_timer(&restored) == chip8_timer(&ch8));
+  assert(memcmp(restored.mem, ch8.mem, CHIP8_MEMORY_SIZE) == 0);
+  assert(memcmp(restored.framebuffer, ch8.framebuffer,
+                sizeof(ch8.framebuffer)) == 0);
+  assert(restored.dirty_rows == CHIP8_FRAMEBUFFER_ALL_ROWS);
+
+  // Broken snapshots are turned away without touching the machine.
+  restored.ip = 0x0666;
+  assert(chip8_restore(&restored, base, snapshot, size - 1) == ERR);
+  snapshot[4] = CHIP8_SNAPSHOT_VERSION + 1;
+  assert(chip8_restore(&restored, base, snapshot, size) == ERR);
+  snapshot[4] = CHIP8_SNAPSHOT_VERSION;
+  // cpu_hz of 0, at byte 41.
+  uint8_t cpu_hz[4];
+  memcpy(cpu_hz, &snapshot[41], sizeof(cpu_hz));
+  memset(&snapshot[41], 0, sizeof(cpu_hz));
+  assert(chip8_restore(&restored, base, snapshot, size) == ERR);
+  memcpy(&snapshot[41], cpu_hz, sizeof(cpu_hz));
+  // ip past the end of memory, at byte 12.
+  uint8_t ip_high = snapshot[13];
+  snapshot[13] = CHIP8_MEMORY_SIZE >> 8;
+  assert(chip8_restore(&restored, base, snapshot, size) == ERR);
+  snapshot[13] = ip_high;
+  assert(restored.ip == 0x0666);
+  assert(chip8_restore(&restored, base, snapshot, size) == OK);
+  assert(restored.ip == ch8.ip && restored.cpu_hz == ch8.cpu_hz);
+
+  // Clones run on exactly like the original.
+  chip8_clone(&clone, &ch8);
+  assert(chip8_run_frames(&ch8, 10, NULL) == CHIP8_STOP_BUDGET);
+  assert(chip8_run_frames(&clone, 10, NULL) == CHIP8_STOP_BUDGET);
+  assert(clone.cycle == ch8.cycle && clone.ip == ch8.ip);
+  assert(headless_hash(&clone) == headless_hash(&ch8));
+}
+
+static void test_rewind() {
+  static chip8_t ch8, frames[2 * REWIND_KEYFRAME_INTERVAL + 1];
+  chip8_init(&ch8);
+  assert(chip8_load_rom(&ch8, "./rocket.ch8") == OK);
+
+  rewind_t* rewind =
+      rewind_create(REWIND_DEFAULT_BYTES, 2 * REWIND_KEYFRAME_INTERVAL + 1);
+  assert(rewind != NULL);
+  assert(rewind_back(rewind, &ch8, 1) == 0);
+  for (int i = 0; i <= 2 * REWIND_KEYFRAME_INTERVAL; i++) {
+    if (i > 0) assert(chip8_run_frames(&ch8, 1, NULL) == CHIP8_STOP_BUDGET);
+    rewind_record(rewind, &ch8);
+    frames[i] = ch8;
+  }
+  rewind_stats_t stats = rewind_stats(rewind);
+  assert(stats.frames == 2 * REWIND_KEYFRAME_INTERVAL);
+  assert(stats.keyframes == 2);
+
+  // A frame back, and then from a keyframe to the frame before it.
+  int at = 2 * REWIND_KEYFRAME_INTERVAL;
+  assert(rewind_back(rewind, &ch8, 1) == 1);
+  at--;
+  assert(ch8.dirty_rows == CHIP8_FRAMEBUFFER_ALL_ROWS);
+  ch8.dirty_rows = frames[at].dirty_rows;
+  assert(memcmp(&ch8, &frames[at], sizeof(ch8)) == 0);
+  assert(rewind_back(rewind, &ch8, 50) == 50);
+  at -= 50;
+  ch8.dirty_rows = frames[at].dirty_rows;
+  assert(memcmp(&ch8, &frames[at], sizeof(ch8)) == 0);
+
+  // Running on records over the frames gone back, then all the way back.
+  assert(chip8_run_frames(&ch8, 1, NULL) == CHIP8_STOP_BUDGET);
+  rewind_record(rewind, &ch8);
+  assert(rewind_stats(rewind).frames == (uint32_t)at + 1);
+  assert(rewind_back(rewind, &ch8, 1000) == (uint32_t)at + 1);
+  ch8.dirty_rows = frames[0].dirty_rows;
+  assert(memcmp(&ch8, &frames[0], sizeof(ch8)) == 0);
+  rewind_destroy(rewind);
+
+  // Within a small budget the oldest frames make room for new ones.
+  rewind = rewind_create(4 * sizeof(chip8_t), REWIND_DEFAULT_FRAMES);
+  assert(rewind != NULL);
+  for (int i = 0; i < 10 * REWIND_KEYFRAME_INTERVAL; i++) {
+    assert(chip8_run_frames(&ch8, 1, NULL) == CHIP8_STOP_BUDGET);
+    rewind_record(rewind, &ch8);
+    assert(rewind_stats(rewind).bytes <= 4 * sizeof(chip8_t));
+  }
+  stats = rewind_stats(rewind);
+  assert(stats.frames > 0 && stats.frames < 10 * REWIND_KEYFRAME_INTERVAL);
+  chip8_t newest = ch8;
+  assert(rewind_back(rewind, &ch8, stats.frames) == stats.frames);
+  assert(ch8.cycle < newest.cycle);
+  rewind_destroy(rewind);
+}
+
+static void test_savestate() {
+  static chip8_t machines[3], loaded;
+  static uint8_t base[CHIP8_MEMORY_SIZE];
+  const chip8_t* all[3];
+  chip8_savestate_t states;
+  for (int i = 0; i < 3; i++) {
+    chip8_init(&machines[i]);
+    assert(chip8_load_rom(&machines[i], "./rocket.ch8") == OK);
+    if (i == 0) memcpy(base, machines[0].mem, CHIP8_MEMORY_SIZE);
+    chip8_seed(&machines[i], i + 1);
+    assert(chip8_run_frames(&machines[i], 20 * i, NULL) == CHIP8_STOP_BUDGET);
+    all[i] = &machines[i];
+  }
+
+  assert(chip8_savestate_save("./test.state", base, all, 3) == OK);
+  assert(chip8_savestate_open(&states, "./test.state") == OK);
+  assert(states.count == 3);
+  assert(memcmp(states.base, base, CHIP8_MEMORY_SIZE) == 0);
+  for (uint32_t i = 0; i < 3; i++) {
+    chip8_init(&loaded);
+    assert(chip8_savestate_load(&states, i, &loaded) == OK);
+    assert(loaded.ip == machines[i].ip && loaded.cycle == machines[i].cycle);
+    assert(loaded.rng == machines[i].rng);
+    assert(memcmp(loaded.mem, machines[i].mem, CHIP8_MEMORY_SIZE) == 0);
+    assert(headless_hash(&loaded) == headless_hash(&machines[i]));
+  }
+  assert(chip8_savestate_load(&states, 3, &loaded) == ERR);
+  chip8_savestate_close(&states);
+
+  // Damage is caught, in the index when opening and in a state when loading.
+  FILE* file = fopen("./test.state", "r+b");
+  assert(file != NULL);
+  fseek(file, -1, SEEK_END);
+  int last = fgetc(file);
+  fseek(file, -1, SEEK_END);
+  fputc(last ^ 0xFF, file);
+  fclose(file);
+  assert(chip8_savestate_open(&states, "./test.state") == OK);
+  assert(chip8_savestate_load(&states, 0, &loaded) == OK);
+  assert(chip8_savestate_load(&states, 2, &loaded) == ERR);
+  chip8_savestate_close(&states);
+  file = fopen("./test.state", "r+b");
+  fseek(file, CHIP8_SAVESTATE_HEADER_SIZE + 0x200, SEEK_SET);
+  fputc(0, file);
+  fclose(file);
+  assert(chip8_savestate_open(&states, "./test.state") == ERR);
+  assert(chip8_savestate_open(&states, "./missing.state") == ERR);
+  remove("./test.state");
+}
+
+static void test_telemetry() {
+  static telemetry_t telemetry;
+  char line[1024];
+  telemetry_init(&telemetry);
+
+  // 1 to 1000 us: percentiles land within a bucket, 6.25%, of the truth.
+  histogram_t* histogram = &telemetry.phases[TELEMETRY_RENDER];
+  for (uint64_t us = 1; us <= 1000; us++) {
+    histogram_record(histogram, us * 1000);
+  }
+  assert(histogram->count == 1000 && histogram->max_ns == 1000000);
+  uint64_t p50 = histogram_percentile(histogram, 50);
+  uint64_t p99 = histogram_percentile(histogram, 99);
+  assert(p50 >= 500000 && p50 <= 500000 * 1.0625);
+  assert(p99 >= 990000 && p99 <= 990000 * 1.0625);
+  assert(histogram_percentile(histogram, 100) == 1000000);
+  assert(histogram_percentile(&telemetry.phases[TELEMETRY_SLEEP], 50) == 0);
+
+  // Small values are exact, and huge ones are clamped rather than lost.
+  histogram_record(&telemetry.phases[TELEMETRY_INPUT], 7);
+  assert(histogram_percentile(&telemetry.phases[TELEMETRY_INPUT], 50) == 7);
+  histogram_record(&telemetry.phases[TELEMETRY_INPUT], UINT64_MAX);
+  assert(telemetry.phases[TELEMETRY_INPUT].max_ns == HISTOGRAM_MAX_NS);
+
+  telemetry.missed = 3;
+  size_t length = telemetry_format(&telemetry, 42, line, sizeof(line));
+  assert(length == strlen(line) && line[length - 1] == '\n');
+  assert(strstr(line, "{\"time_ns\":42,\"missed\":3,") == line);
+  assert(strstr(line, "\"render\":{\"count\":1000,") != NULL);
+}
+
+// Wait for the emulation thread's next frame, for up to a second.
+static const emulator_frame_t* next_frame(emulator_t* emulator) {
+  struct pollfd fd = {.fd = emulator_frame_fd(emulator), .events = POLLIN};
+  for (int i = 0; i < 100; i++) {
+    const emulator_frame_t* frame = emulator_frame(emulator);
+    if (frame != NULL) return frame;
+    poll(&fd, 1, 10);
+  }
+  assert(false);
+  return NULL;
+}
+
+static void test_emulator() {
+  chip8_t ch8;
+  engine_t engine;
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0x6105);  // LD V1, 5
+  set_instruction_at(&ch8, 0x0202, 0x5011);  // 5XY0 with N != 0
+  assert(engine_init(&engine, ENGINE_INTERPRETER) == OK);
+  engine_reset(&engine, &ch8);
+
+  emulator_t* emulator =
+      emulator_start(&ch8, &engine, INPUT_DEFAULT_HOLD_MS, NULL);
+  assert(emulator != NULL);
+
+  // Frames may be skipped, but never the rows they changed.
+  const emulator_frame_t* frame;
+  uint32_t dirty_rows = 0;
+  do {
+    frame = next_frame(emulator);
+    dirty_rows |= frame->dirty_rows;
+  } while (frame->stop != CHIP8_STOP_ILLEGAL);
+  assert(dirty_rows == CHIP8_FRAMEBUFFER_ALL_ROWS);
+  assert(frame->paused);
+  assert(frame->machine.ip == 0x0202);
+  assert(frame->machine.reg_v[1] == 5);
+
+  // Stepping stays on the fault, and nothing else runs while paused.
+  assert(emulator_send(emulator, EMULATOR_STEP, 0));
+  frame = next_frame(emulator);
+  assert(frame->stop == CHIP8_STOP_ILLEGAL && frame->paused);
+  assert(frame->machine.ip == 0x0202);
+
+  // Resetting goes back to the machine as it was handed over.
+  assert(emulator_send(emulator, EMULATOR_RESET, 0));
+  frame = next_frame(emulator);
+  assert(frame->machine.ip == 0x0200 && frame->machine.reg_v[1] == 0);
+  assert(frame->machine.cycle == 0);
+  emulator_stop(emulator);
+
+  // A second long delay loop is slept through and caught up on in a batch
+  // or two, but each frame of it can still be rewound to.
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0x6F3C);  // LD VF, 60
+  set_instruction_at(&ch8, 0x0202, 0xFF15);  // LD DT, VF
+  set_instruction_at(&ch8, 0x0204, 0xFF07);  // LD VF, DT
+  set_instruction_at(&ch8, 0x0206, 0x3F00);  // SE VF, 0
+  set_instruction_at(&ch8, 0x0208, 0x1204);  // JP 0x204
+  set_instruction_at(&ch8, 0x020A, 0x120A);  // JP 0x20A
+  engine_reset(&engine, &ch8);
+  emulator = emulator_start(&ch8, &engine, INPUT_DEFAULT_HOLD_MS, NULL);
+  assert(emulator != NULL);
+  do {
+    frame = next_frame(emulator);
+  } while (frame->machine.ip != 0x020A);
+  assert(frame->rewind.frames >= 60);
+  assert(emulator_send(emulator, EMULATOR_REWIND, 30));
+  frame = next_frame(emulator);
+  assert(frame->paused && frame->machine.ip != 0x020A);
+  assert(chip8_timer(&frame->machine) > 0);
+
+  emulator_stop(emulator);
+  engine_destroy(&engine);
+}
+
+static size_t read_frame(int fd, char* out, size_t size) {
+  ssize_t length = read(fd, out, size - 1);
+  assert(length >= 0);
+  out[length] = '\0';
+  return length;
+}
+
+static void test_renderer() {
+  static renderer_t renderer;
+  chip8_t ch8;
+  char out[RENDERER_BUFFER_SIZE];
+  int fds[2];
+  assert(pipe(fds) == 0);
+
+  chip8_init(&ch8);
+  renderer_init(&renderer, fds[1]);
+
+  // The first frame clears the screen and draws only the lit cells.
+  chip8_set_row(&ch8, 3, 0xC000000000000001ull);
+  renderer_draw(&renderer, &ch8, chip8_take_dirty_rows(&ch8));
+  assert(renderer.frame_syscalls == 1);
+  assert(read_frame(fds[0], out, sizeof(out)) == renderer.frame_bytes);
+  assert(strcmp(out,
+                "\x1b[0m\x1b[H\x1b[2J"
+                "\x1b[4;1H\x1b[42m    "
+                "\x1b[4;127H  ") == 0);
+
+  // Nothing changed, nothing sent.
+  renderer_draw(&renderer, &ch8, chip8_take_dirty_rows(&ch8));
+  assert(renderer.frame_bytes == 0 && renderer.frame_syscalls == 0);
+
+  // Short gaps are written over rather than skipped, starting in the color
+  // the last frame left off in.
+  chip8_set_row(&ch8, 3, 0x9000000000000001ull);
+  renderer_draw(&renderer, &ch8, 1u << 3);
+  read_frame(fds[0], out, sizeof(out));
+  assert(strcmp(out, "\x1b[4;3H\x1b[49m    \x1b[42m  ") == 0);
+
+  // Starting over redraws everything.
+  renderer_invalidate(&renderer);
+  renderer_draw(&renderer, &ch8, 0);
+  read_frame(fds[0], out, sizeof(out));
+  assert(strncmp(out, "\x1b[0m\x1b[H\x1b[2J", 11) == 0);
+  assert(renderer.frames == 4 && renderer.syscalls == 3);
+
+  // Half blocks pack rows 2 and 3 into line 2, sending only the cells that
+  // changed.
+  renderer_set_mode(&renderer, RENDERER_HALF_BLOCKS);
+  chip8_set_row(&ch8, 2, 0x4000000000000000ull);
+  renderer_draw(&renderer, &ch8, chip8_take_dirty_rows(&ch8));
+  read_frame(fds[0], out, sizeof(out));
+  assert(strcmp(out,
+                "\x1b[0m\x1b[H\x1b[2J"
+                "\x1b[32m\x1b[2;1H\u2584\u2580\x20\u2584"
+                "\x1b[2;64H\u2584") == 0);
+  assert(renderer.frame_bytes < 64);
+
+  // A single changed pixel is a single cell.
+  chip8_set_row(&ch8, 2, 0x4000000000000002ull);
+  renderer_draw(&renderer, &ch8, 1u << 2);
+  read_frame(fds[0], out, sizeof(out));
+  assert(strcmp(out, "\x1b[2;63H\u2580") == 0);
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+#ifdef CHIP8_PROFILE
+static void test_profile() {
+  chip8_t ch8;
+  char line[4096];
+
+  // 0x200 calls 0x6A0, which calls 0x6C0. The profile is shared with the
+  // tests before, so only the lines for these calls are checked.
+  chip8_init(&ch8);
+  set_instruction_at(&ch8, 0x0200, 0x26A0);
+  set_instruction_at(&ch8, 0x06A0, 0x26C0);
+  set_instruction_at(&ch8, 0x06A2, 0x00EE);
+  set_instruction_at(&ch8, 0x06C0, 0x6001);
+  set_instruction_at(&ch8, 0x06C2, 0x00EE);
+  assert(chip8_run_cycles(&ch8, 5, NULL) == CHIP8_STOP_BUDGET);
+  assert(ch8.ip == 0x0202 && ch8.sp == 0);
+
+  assert(chip8_profile_write_folded("./test.folded") == OK);
+  FILE* in = fopen("./test.folded", "r");
+  int found = 0;
+  while (fgets(line, sizeof(line), in)) {
+    if (strcmp(line, "0x200;0x6A0 2\n") == 0 ||
+        strcmp(line, "0x200;0x6A0;0x6C0 2\n") == 0) {
+      found++;
+    }
+  }
+  fclose(in);
+  remove("./test.folded");
+  assert(found == 2);
+
+  // Machines taking turns each keep their own calls, and so does one whose
+  // stack is replaced by a snapshot. a calls 0x7A0 and then 0x7C0, b calls
+  // 0x8A0, and then b is restored to a inside 0x7C0.
+  static chip8_t a, b;
+  static uint8_t snapshot[CHIP8_SNAPSHOT_MAX_SIZE];
+  chip8_init(&a);
+  set_instruction_at(&a, 0x0200, 0x27A0);
+  set_instruction_at(&a, 0x07A0, 0x27C0);
+  set_instruction_at(&a, 0x07A2, 0x00EE);
+  set_instruction_at(&a, 0x07C0, 0x6001);
+  set_instruction_at(&a, 0x07C2, 0x00EE);
+  chip8_init(&b);
+  set_instruction_at(&b, 0x0200, 0x28A0);
+  set_instruction_at(&b, 0x08A0, 0x6001);
+  set_instruction_at(&b, 0x08A2, 0x00EE);
+  assert(chip8_run_cycles(&a, 2, NULL) == CHIP8_STOP_BUDGET);
+  size_t size = chip8_snapshot(&a, a.mem, snapshot, sizeof(snapshot));
+  assert(chip8_run_cycles(&b, 1, NULL) == CHIP8_STOP_BUDGET);
+  assert(chip8_run_cycles(&a, 3, NULL) == CHIP8_STOP_BUDGET);
+  assert(chip8_run_cycles(&b, 2, NULL) == CHIP8_STOP_BUDGET);
+  assert(a.ip == 0x0202 && b.ip == 0x0202);
+  assert(chip8_restore(&b, a.mem, snapshot, size) == OK);
+  assert(chip8_run_cycles(&b, 3, NULL) == CHIP8_STOP_BUDGET);
+  assert(b.ip == 0x0202 && b.sp == 0);
+
+  assert(chip8_profile_write_folded("./test.folded") == OK);
+  in = fopen("./test.folded", "r");
+  found = 0;
+  while (fgets(line, sizeof(line), in)) {
+    if (strcmp(line, "0x200;0x7A0 3\n") == 0 ||
+        strcmp(line, "0x200;0x7A0;0x7C0 4\n") == 0 ||
+        strcmp(line, "0x200;0x8A0 2\n") == 0) {
+      found++;
+    }
+  }
+  fclose(in);
+  remove("./test.folded");
+  assert(found == 3);
+}
+#endif
+
 int main() {
   test_loading_rom();
   test_run_instruction();
+  test_run_cycles();
+  test_timers();
+  test_idle();
+  test_decode_cache();
+  test_superinstructions();
+  test_jit();
+  test_headless();
+  test_farm();
+  test_batch();
+  test_input();
+  test_pacer();
+  test_snapshot();
+  test_rewind();
+  test_savestate();
+  test_telemetry();
+  test_emulator();
+  test_renderer();
+#ifdef CHIP8_PROFILE
+  test_profile();
+#endif
 
   printf("\33[1;32m🎉 Tests passed! 🎉\33[m\n");
 }